@@ -36,6 +36,7 @@
 #define _(x) gettext(x)
 
 #include "narrative.h"
+#include "pdfexport.h"
 #include "colloquium.h"
 #include "narrative_window.h"
 #include "prefswindow.h"
@@ -232,23 +233,147 @@ GActionEntry app_entries[] = {
 };
 
 
+/* Presentations are loaded in the background.  If it takes more than a
+ * moment, a window shows the progress and allows the loading to be
+ * cancelled. */
+struct open_ctx
+{
+    GApplication *app;
+    GFile *file;
+    NarrativeLoad *nl;
+    GtkWidget *window;
+    GtkWidget *bar;
+    guint timeout;
+};
+
+
+static void free_open_ctx(struct open_ctx *ctx)
+{
+    if ( ctx->timeout != 0 ) g_source_remove(ctx->timeout);
+    if ( ctx->window != NULL ) gtk_window_destroy(GTK_WINDOW(ctx->window));
+    g_object_unref(ctx->file);
+    g_application_release(ctx->app);
+    free(ctx);
+}
+
+
+static void load_progress(double fraction, gpointer vp)
+{
+    struct open_ctx *ctx = vp;
+    if ( ctx->bar != NULL ) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->bar), fraction);
+    }
+}
+
+
+static void load_done(Narrative *n, gpointer vp)
+{
+    struct open_ctx *ctx = vp;
+
+    if ( n != NULL ) {
+        NarrativeWindow *nw;
+        nw = narrative_window_new(n, ctx->file, ctx->app);
+        gtk_window_present(GTK_WINDOW(nw));
+    } else {
+        char *uri = g_file_get_uri(ctx->file);
+        fprintf(stderr, _("Failed to load presentation '%s'\n"),
+                uri);
+        g_free(uri);
+    }
+
+    free_open_ctx(ctx);
+}
+
+
+static void cancel_open(struct open_ctx *ctx)
+{
+    narrative_load_cancel(ctx->nl);
+    free_open_ctx(ctx);
+}
+
+
+static void cancel_open_sig(GtkButton *button, struct open_ctx *ctx)
+{
+    cancel_open(ctx);
+}
+
+
+static gboolean open_close_request_sig(GtkWindow *window, struct open_ctx *ctx)
+{
+    cancel_open(ctx);
+    return TRUE;
+}
+
+
+static gboolean show_open_progress(gpointer vp)
+{
+    struct open_ctx *ctx = vp;
+    GtkWidget *box;
+    GtkWidget *label;
+    GtkWidget *button;
+    char *name;
+    char *text;
+
+    ctx->timeout = 0;
+
+    ctx->window = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(ctx->window), _("Opening presentation"));
+    gtk_window_set_default_size(GTK_WINDOW(ctx->window), 400, -1);
+    gtk_window_set_application(GTK_WINDOW(ctx->window), GTK_APPLICATION(ctx->app));
+
+    box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 8);
+    gtk_widget_set_margin_start(box, 16);
+    gtk_widget_set_margin_end(box, 16);
+    gtk_widget_set_margin_top(box, 16);
+    gtk_widget_set_margin_bottom(box, 16);
+    gtk_window_set_child(GTK_WINDOW(ctx->window), box);
+
+    name = g_file_get_basename(ctx->file);
+    text = g_strdup_printf(_("Loading %s"), name);
+    label = gtk_label_new(text);
+    g_free(text);
+    g_free(name);
+    gtk_box_append(GTK_BOX(box), label);
+
+    ctx->bar = gtk_progress_bar_new();
+    gtk_progress_bar_pulse(GTK_PROGRESS_BAR(ctx->bar));
+    gtk_box_append(GTK_BOX(box), ctx->bar);
+
+    button = gtk_button_new_with_label(_("Cancel"));
+    gtk_widget_set_halign(button, GTK_ALIGN_END);
+    gtk_box_append(GTK_BOX(box), button);
+
+    g_signal_connect(G_OBJECT(button), "clicked", G_CALLBACK(cancel_open_sig), ctx);
+    g_signal_connect(G_OBJECT(ctx->window), "close-request",
+                     G_CALLBACK(open_close_request_sig), ctx);
+
+    gtk_window_present(GTK_WINDOW(ctx->window));
+    return G_SOURCE_REMOVE;
+}
+
+
 static void colloquium_open(GApplication  *papp, GFile **files, gint n_files,
                             const gchar *hint)
 {
     int i;
 
     for ( i=0; i<n_files; i++ ) {
-        Narrative *n;
-        n = narrative_load(files[i]);
-        if ( n != NULL ) {
-            NarrativeWindow *nw;
-            nw = narrative_window_new(n, files[i], papp);
-            gtk_window_present(GTK_WINDOW(nw));
-        } else {
-            char *uri = g_file_get_uri(files[i]);
-            fprintf(stderr, _("Failed to load presentation '%s'\n"),
-                    uri);
-            g_free(uri);
+
+        struct open_ctx *ctx = malloc(sizeof(struct open_ctx));
+        if ( ctx == NULL ) continue;
+
+        ctx->app = papp;
+        ctx->file = g_object_ref(files[i]);
+        ctx->window = NULL;
+        ctx->bar = NULL;
+
+        /* Keep running until the window is open */
+        g_application_hold(papp);
+
+        ctx->timeout = g_timeout_add(250, show_open_progress, ctx);
+        ctx->nl = narrative_load_async(files[i], load_progress, load_done, ctx);
+        if ( ctx->nl == NULL ) {
+            load_done(NULL, ctx);
         }
     }
 }
@@ -438,7 +563,68 @@ static void show_help(const char *s)
 {
     printf(_("Syntax: %s [options] [<file.sc>]\n\n"), s);
     printf(_("Narrative-based presentation system.\n\n"
-             "  -h, --help    Display this help message.\n"));
+             "  -h, --help                   Display this help message.\n"
+             "      --export-pdf <in> <out>  Export the slides from <in> to PDF\n"
+             "                               file <out>, without opening any\n"
+             "                               windows.  Can be given several times.\n"
+             "  -j, --jobs <n>               Export up to <n> files at once.\n"));
+}
+
+
+/* Command-line export, which doesn't need a display */
+struct batch_export
+{
+    const char *in;
+    const char *out;
+    int r;
+};
+
+
+static void batch_export_one(gpointer data, gpointer vp)
+{
+    struct batch_export *be = data;
+    GFile *in;
+    GFile *out;
+    Slide **slides;
+    int n_slides;
+
+    in = g_file_new_for_commandline_arg(be->in);
+    out = g_file_new_for_commandline_arg(be->out);
+
+    slides = narrative_load_slides(in, &n_slides);
+    if ( slides == NULL ) {
+        fprintf(stderr, _("Failed to load presentation '%s'\n"), be->in);
+        be->r = 1;
+    } else {
+        be->r = export_pdf_slides(slides, n_slides, out);
+        if ( be->r ) {
+            fprintf(stderr, _("Failed to export '%s' to '%s'\n"), be->in, be->out);
+        }
+        narrative_free_slides(slides, n_slides);
+    }
+
+    g_object_unref(in);
+    g_object_unref(out);
+}
+
+
+static int batch_export(struct batch_export *exports, int n_exports, int n_jobs)
+{
+    GThreadPool *pool;
+    int i;
+    int r = 0;
+
+    pool = g_thread_pool_new(batch_export_one, NULL, n_jobs, TRUE, NULL);
+    for ( i=0; i<n_exports; i++ ) {
+        exports[i].r = 1;
+        g_thread_pool_push(pool, &exports[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for ( i=0; i<n_exports; i++ ) {
+        if ( exports[i].r ) r = 1;
+    }
+    return r;
 }
 
 
@@ -447,26 +633,57 @@ int main(int argc, char *argv[])
     int c;
     int status;
     Colloquium *app;
+    struct batch_export *exports;
+    int n_exports = 0;
+    int n_jobs = 1;
 
     /* Long options */
     const struct option longopts[] = {
         {"help",               0, NULL,               'h'},
+        {"export-pdf",         1, NULL,               'e'},
+        {"jobs",               1, NULL,               'j'},
         {0, 0, NULL, 0}
     };
 
+    /* Each export uses two arguments */
+    exports = malloc(argc*sizeof(struct batch_export));
+    if ( exports == NULL ) return 1;
+
     /* Short options */
-    while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hj:", longopts, NULL)) != -1) {
 
         switch (c)
         {
             case 'h' :
             show_help(argv[0]);
+            free(exports);
             return 0;
 
+            case 'e' :
+            if ( (optind >= argc) || (argv[optind][0] == '-') ) {
+                fprintf(stderr, _("--export-pdf needs an input and an output filename\n"));
+                free(exports);
+                return 1;
+            }
+            exports[n_exports].in = optarg;
+            exports[n_exports].out = argv[optind++];
+            n_exports++;
+            break;
+
+            case 'j' :
+            n_jobs = atoi(optarg);
+            if ( n_jobs < 1 ) {
+                fprintf(stderr, _("Invalid number of jobs '%s'\n"), optarg);
+                free(exports);
+                return 1;
+            }
+            break;
+
             case 0 :
             break;
 
             default :
+            free(exports);
             return 1;
         }
 
@@ -479,8 +696,17 @@ int main(int argc, char *argv[])
     bindtextdomain("colloquium", LOCALEDIR);
     textdomain("colloquium");
 
+    if ( n_exports > 0 ) {
+        status = batch_export(exports, n_exports, n_jobs);
+        free(exports);
+        return status;
+    }
+    free(exports);
+
+    /* GApplication only needs to see the filenames */
+    argv[optind-1] = argv[0];
     app = colloquium_new();
-    status = g_application_run(G_APPLICATION(app), argc, argv);
+    status = g_application_run(G_APPLICATION(app), argc-optind+1, argv+optind-1);
     g_object_unref(app);
     return status;
 }
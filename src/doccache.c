@@ -0,0 +1,616 @@
+/*
+ * doccache.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <gio/gio.h>
+#include <poppler.h>
+#include <librsvg/rsvg.h>
+
+#include <libintl.h>
+#define _(x) gettext(x)
+
+#include "doccache.h"
+
+
+/* Parsed documents (PDF or SVG), shared by everything which renders or
+ * inspects pages from them.  Only the most recently used few files are kept
+ * open.
+ *
+ * A Poppler document may only be used by one thread at a time, so each PDF
+ * file has a pool of documents, all made from the same bytes (memory-mapped,
+ * for local files).  Threads rendering from the same file at the same time get
+ * a document each, instead of waiting for one another.  SVG handles are
+ * shared, with a lock (see doc_cache_lock). */
+#define MAX_DOCS (16)
+
+struct doc_cache_entry
+{
+    char *uri;
+    guint64 mtime;
+    int loading;    /* Being opened, without the lock held */
+    int removed;    /* Freed when the last PDF document comes back */
+    GBytes *bytes;  /* For PDFs */
+    GSList *spare;  /* PDF documents not in use */
+    int n_out;      /* PDF documents in use */
+    GObject *doc;   /* For SVGs */
+    float aspect;   /* For SVGs */
+    GList *link;    /* Position in 'lru' */
+};
+
+
+static GHashTable *doc_cache = NULL;   /* URI -> entry */
+static GQueue lru = G_QUEUE_INIT;     /* Most recently used at head */
+static GCond loaded_cond;
+G_LOCK_DEFINE_STATIC(doc_cache);
+
+
+static void free_entry(struct doc_cache_entry *e)
+{
+    g_slist_free_full(e->spare, g_object_unref);
+    if ( e->bytes != NULL ) g_bytes_unref(e->bytes);
+    if ( e->doc != NULL ) g_object_unref(e->doc);
+    g_free(e->uri);
+    free(e);
+}
+
+
+/* Call with lock held.  Anyone still using a document from the entry can
+ * carry on using it. */
+static void remove_entry(struct doc_cache_entry *e)
+{
+    g_queue_delete_link(&lru, e->link);
+    g_hash_table_remove(doc_cache, e->uri);
+    e->removed = 1;
+    if ( e->n_out == 0 ) free_entry(e);
+}
+
+
+/* Call with lock held.  The most recently used entry always stays. */
+static void evict(void)
+{
+    GList *link = lru.tail;
+    while ( (g_hash_table_size(doc_cache) > MAX_DOCS) && (link != lru.head) ) {
+        struct doc_cache_entry *e = link->data;
+        link = link->prev;
+        if ( !e->loading ) remove_entry(e);
+    }
+}
+
+
+/* Call with lock held.  Returns the entry for 'uri', waiting for it if it's
+ * being opened by another thread.  If the file has been modified since it was
+ * opened, the old entry is dropped and NULL is returned.  An 'mtime' of zero
+ * (not known) matches anything. */
+static struct doc_cache_entry *find_entry(const char *uri, guint64 mtime)
+{
+    struct doc_cache_entry *e;
+
+    if ( doc_cache == NULL ) {
+        doc_cache = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    while ( 1 ) {
+        e = g_hash_table_lookup(doc_cache, uri);
+        if ( (e == NULL) || !e->loading ) break;
+        g_cond_wait(&loaded_cond, &G_LOCK_NAME(doc_cache));
+    }
+
+    if ( (e != NULL) && (mtime != 0) && (e->mtime != mtime) ) {
+        remove_entry(e);
+        return NULL;
+    }
+    return e;
+}
+
+
+/* What's known about each file's modification time, so that the main thread
+ * can make cache keys without touching the disk.  Other threads look at the
+ * file itself each time, and record what they find.  Local files are also
+ * watched, so that changes are noticed even if nothing else looks. */
+struct mtime_entry
+{
+    guint64 mtime;          /* 0 if not known (yet) */
+    int checking;           /* Being looked up in the background */
+    int watched;            /* Main thread has asked about it */
+    GFileMonitor *monitor;
+};
+
+
+static GHashTable *mtimes = NULL;   /* URI -> struct mtime_entry */
+G_LOCK_DEFINE_STATIC(mtimes);
+
+
+/* Call with lock held */
+static struct mtime_entry *get_mtime_entry(const char *uri)
+{
+    struct mtime_entry *e;
+
+    if ( mtimes == NULL ) {
+        mtimes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    e = g_hash_table_lookup(mtimes, uri);
+    if ( e != NULL ) return e;
+
+    e = malloc(sizeof(struct mtime_entry));
+    if ( e == NULL ) return NULL;
+    e->mtime = 0;
+    e->checking = 0;
+    e->watched = 0;
+    e->monitor = NULL;
+    g_hash_table_insert(mtimes, g_strdup(uri), e);
+    return e;
+}
+
+
+static guint64 read_mtime(GFile *file)
+{
+    GFileInfo *info;
+    guint64 mtime;
+
+    info = g_file_query_info(file,
+                             G_FILE_ATTRIBUTE_TIME_MODIFIED","
+                             G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                             G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    if ( info == NULL ) return 0;
+
+    mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED)*G_USEC_PER_SEC
+          + g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+    g_object_unref(info);
+    return mtime;
+}
+
+
+static guint64 read_and_record_mtime(GFile *file)
+{
+    struct mtime_entry *e;
+    char *uri;
+    guint64 mtime;
+
+    mtime = read_mtime(file);
+    uri = g_file_get_uri(file);
+
+    G_LOCK(mtimes);
+    e = get_mtime_entry(uri);
+    if ( e != NULL ) e->mtime = mtime;
+    G_UNLOCK(mtimes);
+
+    g_free(uri);
+    return mtime;
+}
+
+
+static void check_mtime_thread(GTask *task, gpointer obj, gpointer data,
+                               GCancellable *cancellable)
+{
+    read_and_record_mtime(G_FILE(data));
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void start_check(GFile *file);
+
+static void monitor_changed_sig(GFileMonitor *monitor, GFile *file, GFile *other,
+                                GFileMonitorEvent event, GFile *watched)
+{
+    start_check(watched);
+}
+
+
+static void check_mtime_done(GObject *obj, GAsyncResult *res, gpointer vp)
+{
+    GFile *file = g_task_get_task_data(G_TASK(res));
+    struct mtime_entry *e;
+    char *uri;
+    int need_monitor;
+
+    uri = g_file_get_uri(file);
+    G_LOCK(mtimes);
+    e = get_mtime_entry(uri);
+    need_monitor = 0;
+    if ( e != NULL ) {
+        e->checking = 0;
+        need_monitor = (e->monitor == NULL) && g_file_is_native(file);
+    }
+    G_UNLOCK(mtimes);
+    g_free(uri);
+
+    if ( need_monitor ) {
+        GFileMonitor *monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+                                                    NULL, NULL);
+        if ( monitor == NULL ) return;
+        g_signal_connect_data(G_OBJECT(monitor), "changed",
+                              G_CALLBACK(monitor_changed_sig),
+                              g_object_ref(file),
+                              (GClosureNotify)g_object_unref, 0);
+        G_LOCK(mtimes);
+        e->monitor = monitor;   /* Kept for the rest of the session */
+        G_UNLOCK(mtimes);
+    }
+}
+
+
+/* Main thread only.  Looks up the modification time in the background. */
+static void start_check(GFile *file)
+{
+    struct mtime_entry *e;
+    GTask *task;
+    char *uri;
+
+    uri = g_file_get_uri(file);
+    G_LOCK(mtimes);
+    e = get_mtime_entry(uri);
+    if ( (e == NULL) || e->checking ) {
+        G_UNLOCK(mtimes);
+        g_free(uri);
+        return;
+    }
+    e->checking = 1;
+    e->watched = 1;
+    G_UNLOCK(mtimes);
+    g_free(uri);
+
+    task = g_task_new(NULL, NULL, check_mtime_done, NULL);
+    g_task_set_task_data(task, g_object_ref(file), g_object_unref);
+    g_task_run_in_thread(task, check_mtime_thread);
+    g_object_unref(task);
+}
+
+
+/* Returns the modification time of 'file' in microseconds, or 0 if it isn't
+ * known.  The main thread gets the last time seen, without touching the
+ * disk.  If nothing is known yet, the file is looked at in the background
+ * (and watched for changes, if it's local).  Other threads look at the file
+ * itself. */
+guint64 doc_cache_get_mtime(GFile *file)
+{
+    struct mtime_entry *e;
+    guint64 mtime = 0;
+    int need_check;
+    char *uri;
+
+    if ( !g_main_context_is_owner(g_main_context_default()) ) {
+        return read_and_record_mtime(file);
+    }
+
+    uri = g_file_get_uri(file);
+    G_LOCK(mtimes);
+    e = get_mtime_entry(uri);
+    need_check = (e != NULL) && !e->watched;
+    if ( e != NULL ) mtime = e->mtime;
+    G_UNLOCK(mtimes);
+    g_free(uri);
+
+    if ( need_check ) start_check(file);
+    return mtime;
+}
+
+
+static GBytes *map_file(GFile *file)
+{
+    char *path;
+    GError *error = NULL;
+    GBytes *bytes;
+
+    /* Local files get mapped, everything else (e.g. resources) is read
+     * in via GIO */
+    path = g_file_get_path(file);
+    if ( path != NULL ) {
+        GMappedFile *mf = g_mapped_file_new(path, FALSE, &error);
+        g_free(path);
+        if ( mf == NULL ) {
+            fprintf(stderr, _("Failed to map PDF file: %s\n"), error->message);
+            g_error_free(error);
+            return NULL;
+        }
+        bytes = g_mapped_file_get_bytes(mf);
+        g_mapped_file_unref(mf);
+        return bytes;
+    }
+
+    bytes = g_file_load_bytes(file, NULL, NULL, &error);
+    if ( bytes == NULL ) {
+        fprintf(stderr, _("Failed to load PDF file: %s\n"), error->message);
+        g_error_free(error);
+    }
+    return bytes;
+}
+
+
+static void free_lock(GMutex *lock)
+{
+    g_mutex_clear(lock);
+    free(lock);
+}
+
+
+static PopplerDocument *new_pdf(GBytes *bytes, struct doc_cache_entry *e)
+{
+    PopplerDocument *doc;
+    GError *error = NULL;
+
+    doc = poppler_document_new_from_bytes(bytes, NULL, &error);
+    if ( doc == NULL ) {
+        fprintf(stderr, _("Failed to open PDF: %s\n"), error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    g_object_set_data(G_OBJECT(doc), "colloquium-entry", e);
+    return doc;
+}
+
+
+static int open_pdf(GFile *file, struct doc_cache_entry *e)
+{
+    PopplerDocument *doc;
+
+    e->bytes = map_file(file);
+    if ( e->bytes == NULL ) return 1;
+
+    doc = new_pdf(e->bytes, e);
+    if ( doc == NULL ) return 1;
+
+    e->spare = g_slist_prepend(NULL, doc);
+    return 0;
+}
+
+
+/* Returns the width divided by the height, or a negative number if the SVG
+ * doesn't say what its size is */
+float svg_get_aspect(RsvgHandle *fh)
+{
+    RsvgLength width, height;
+    RsvgRectangle viewbox;
+    gboolean has_viewbox, has_width, has_height;
+
+    rsvg_handle_get_intrinsic_dimensions(fh, &has_width, &width,
+                                         &has_height, &height,
+                                         &has_viewbox, &viewbox);
+
+    if ( has_viewbox ) return viewbox.width/viewbox.height;
+
+    if ( !has_width || !has_height ) {
+        fprintf(stderr, _("Failed to load SVG - no width/height\n"));
+        return -1.0;
+    }
+    if ( width.unit != height.unit ) {
+        fprintf(stderr, _("Failed to load SVG - units not the same\n"));
+        return -1.0;
+    }
+    if ( width.unit == RSVG_UNIT_PERCENT ) {
+        fprintf(stderr, _("Failed to load SVG - no viewbox and percent size\n"));
+        return -1.0;
+    }
+    return width.length / height.length;
+}
+
+
+static int open_svg(GFile *file, struct doc_cache_entry *e)
+{
+    RsvgHandle *fh;
+    GError *error = NULL;
+    GMutex *lock;
+
+    fh = rsvg_handle_new_from_gfile_sync(file, RSVG_HANDLE_FLAGS_NONE,
+                                         NULL, &error);
+    if ( fh == NULL ) {
+        fprintf(stderr, _("Failed to read SVG: %s\n"), error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    rsvg_handle_set_dpi(fh, 96);
+    e->aspect = svg_get_aspect(fh);
+    if ( e->aspect <= 0.0 ) {
+        g_object_unref(fh);
+        return 1;
+    }
+
+    /* The handle may not be used from several threads at once */
+    lock = malloc(sizeof(GMutex));
+    if ( lock == NULL ) {
+        g_object_unref(fh);
+        return 1;
+    }
+    g_mutex_init(lock);
+    g_object_set_data_full(G_OBJECT(fh), "colloquium-lock", lock,
+                           (GDestroyNotify)free_lock);
+
+    e->doc = G_OBJECT(fh);
+    return 0;
+}
+
+
+/* Takes the lock, which is still held on return.  Returns the entry for
+ * 'file', opening it if necessary, or NULL on error.  Files are opened without
+ * the lock held, so that other files can be used in the meantime.  Anyone else
+ * wanting the same file waits until it's ready. */
+static struct doc_cache_entry *lock_entry(GFile *file,
+                                          int (*open_doc)(GFile *, struct doc_cache_entry *))
+{
+    char *uri;
+    guint64 mtime;
+    struct doc_cache_entry *e;
+    int r;
+
+    uri = g_file_get_uri(file);
+    mtime = doc_cache_get_mtime(file);
+
+    G_LOCK(doc_cache);
+
+    e = find_entry(uri, mtime);
+    if ( e != NULL ) {
+        g_free(uri);
+        g_queue_unlink(&lru, e->link);
+        g_queue_push_head_link(&lru, e->link);
+        return e;
+    }
+
+    e = malloc(sizeof(struct doc_cache_entry));
+    if ( e == NULL ) {
+        g_free(uri);
+        return NULL;
+    }
+    e->uri = uri;
+    e->mtime = mtime;
+    e->loading = 1;
+    e->removed = 0;
+    e->bytes = NULL;
+    e->spare = NULL;
+    e->n_out = 0;
+    e->doc = NULL;
+    e->aspect = -1.0;
+    g_queue_push_head(&lru, e);
+    e->link = lru.head;
+    g_hash_table_insert(doc_cache, e->uri, e);
+
+    G_UNLOCK(doc_cache);
+    r = open_doc(file, e);
+    G_LOCK(doc_cache);
+
+    e->loading = 0;
+    g_cond_broadcast(&loaded_cond);
+    if ( r ) {
+        remove_entry(e);
+        return NULL;
+    }
+    evict();
+    return e;
+}
+
+
+/* Call with lock held */
+static void release_entry(struct doc_cache_entry *e)
+{
+    e->n_out--;
+    if ( e->removed && (e->n_out == 0) ) free_entry(e);
+}
+
+
+/* Returns a document for 'file', for the caller's use only until it's given
+ * back with doc_cache_put_pdf(). */
+PopplerDocument *doc_cache_get_pdf(GFile *file)
+{
+    struct doc_cache_entry *e;
+    PopplerDocument *doc;
+    GBytes *bytes;
+
+    e = lock_entry(file, open_pdf);
+    if ( e == NULL ) {
+        G_UNLOCK(doc_cache);
+        return NULL;
+    }
+
+    e->n_out++;
+    if ( e->spare != NULL ) {
+        doc = e->spare->data;
+        e->spare = g_slist_delete_link(e->spare, e->spare);
+        G_UNLOCK(doc_cache);
+        return doc;
+    }
+
+    /* All in use, so make another one.  The file doesn't have to be read
+     * again, but it does have to be parsed. */
+    bytes = g_bytes_ref(e->bytes);
+    G_UNLOCK(doc_cache);
+    doc = new_pdf(bytes, e);
+    g_bytes_unref(bytes);
+
+    if ( doc == NULL ) {
+        G_LOCK(doc_cache);
+        release_entry(e);
+        G_UNLOCK(doc_cache);
+    }
+    return doc;
+}
+
+
+/* Gives back a document from doc_cache_get_pdf(), for someone else to use.
+ * Only as many are kept as could be used at once. */
+void doc_cache_put_pdf(PopplerDocument *doc)
+{
+    struct doc_cache_entry *e;
+
+    G_LOCK(doc_cache);
+    e = g_object_get_data(G_OBJECT(doc), "colloquium-entry");
+    if ( !e->removed && (g_slist_length(e->spare) < g_get_num_processors()) ) {
+        e->spare = g_slist_prepend(e->spare, doc);
+        doc = NULL;
+    }
+    release_entry(e);
+    G_UNLOCK(doc_cache);
+
+    if ( doc != NULL ) g_object_unref(doc);
+}
+
+
+/* The parsed SVG is shared between all the slides made from it, e.g. several
+ * build steps with different hidden elements.  Set the stylesheet and render
+ * while holding the lock. */
+RsvgHandle *doc_cache_get_svg(GFile *file, float *aspect)
+{
+    struct doc_cache_entry *e;
+    RsvgHandle *fh = NULL;
+
+    e = lock_entry(file, open_svg);
+    if ( e != NULL ) {
+        fh = RSVG_HANDLE(g_object_ref(e->doc));
+        if ( aspect != NULL ) *aspect = e->aspect;
+    }
+    G_UNLOCK(doc_cache);
+    return fh;
+}
+
+
+void doc_cache_drop(GFile *file)
+{
+    char *uri = g_file_get_uri(file);
+    guint64 mtime = doc_cache_get_mtime(file);
+    struct doc_cache_entry *e;
+
+    G_LOCK(doc_cache);
+    e = find_entry(uri, mtime);
+    if ( e != NULL ) remove_entry(e);
+    G_UNLOCK(doc_cache);
+    g_free(uri);
+}
+
+
+/* Must be held while using an SVG handle from the cache */
+void doc_cache_lock(gpointer doc)
+{
+    g_mutex_lock(g_object_get_data(G_OBJECT(doc), "colloquium-lock"));
+}
+
+
+void doc_cache_unlock(gpointer doc)
+{
+    g_mutex_unlock(g_object_get_data(G_OBJECT(doc), "colloquium-lock"));
+}
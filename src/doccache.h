@@ -0,0 +1,44 @@
+/*
+ * doccache.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DOCCACHE_H
+#define DOCCACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gio/gio.h>
+#include <poppler.h>
+#include <librsvg/rsvg.h>
+
+extern guint64 doc_cache_get_mtime(GFile *file);
+extern PopplerDocument *doc_cache_get_pdf(GFile *file);
+extern void doc_cache_put_pdf(PopplerDocument *doc);
+extern RsvgHandle *doc_cache_get_svg(GFile *file, float *aspect);
+extern void doc_cache_drop(GFile *file);
+extern void doc_cache_lock(gpointer doc);
+extern void doc_cache_unlock(gpointer doc);
+
+extern float svg_get_aspect(RsvgHandle *fh);
+
+#endif /* DOCCACHE_H */
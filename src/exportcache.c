@@ -0,0 +1,168 @@
+/*
+ * exportcache.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+#include <cairo.h>
+
+#include "slide.h"
+#include "exportcache.h"
+
+
+/* Prepared export pages (see slide_prepare_cairo), keyed by slide identity
+ * and output width, so that exporting the same presentation again only has
+ * to redo the slides which have changed.  The least recently used pages are
+ * dropped when the total size goes over the budget, or when there are too
+ * many of them. */
+#define EXPORT_CACHE_SIZE (256*1024*1024)
+
+/* Cairo can't say how much memory a vector recording takes up, which might
+ * be a lot for a complicated slide.  Only a nominal size is counted for each
+ * one, so the number of pages is limited as well. */
+#define RECORDING_SIZE (64*1024)
+#define EXPORT_CACHE_ENTRIES (512)
+
+struct export_cache_entry
+{
+    char *key;
+    cairo_surface_t *prep;
+    float aspect;
+    gsize size;
+    GList *link;    /* Position in 'lru' */
+};
+
+
+static GHashTable *export_cache = NULL;
+static GQueue lru = G_QUEUE_INIT;   /* Most recently used at head */
+static gsize total_size = 0;
+G_LOCK_DEFINE_STATIC(export_cache);
+
+
+static void free_entry(struct export_cache_entry *e)
+{
+    cairo_surface_destroy(e->prep);
+    g_free(e->key);
+    free(e);
+}
+
+
+/* Call with lock held */
+static void evict(void)
+{
+    while ( ((total_size > EXPORT_CACHE_SIZE)
+          || (g_hash_table_size(export_cache) > EXPORT_CACHE_ENTRIES))
+         && (lru.tail != NULL) )
+    {
+        struct export_cache_entry *e = g_queue_pop_tail(&lru);
+        total_size -= e->size;
+        g_hash_table_remove(export_cache, e->key);  /* Frees e */
+    }
+}
+
+
+static char *make_key(Slide *s, int w)
+{
+    char *skey = slide_get_key(s);
+    char *key = g_strdup_printf("%s\n%i", skey, w);
+    g_free(skey);
+    return key;
+}
+
+
+static gsize prep_size(cairo_surface_t *prep)
+{
+    if ( cairo_surface_get_type(prep) == CAIRO_SURFACE_TYPE_IMAGE ) {
+        return (gsize)cairo_image_surface_get_stride(prep)
+                     *cairo_image_surface_get_height(prep);
+    }
+    return RECORDING_SIZE;
+}
+
+
+/* Returns a new reference to the prepared page, or NULL.  May be called from
+ * any thread, with a slide which isn't shared. */
+cairo_surface_t *export_cache_lookup(Slide *s, int w, float *aspect)
+{
+    char *key;
+    struct export_cache_entry *e;
+    cairo_surface_t *prep = NULL;
+
+    if ( s->ext_file == NULL ) return NULL;
+    key = make_key(s, w);
+
+    G_LOCK(export_cache);
+    if ( export_cache != NULL ) {
+        e = g_hash_table_lookup(export_cache, key);
+        if ( e != NULL ) {
+            g_queue_unlink(&lru, e->link);
+            g_queue_push_head_link(&lru, e->link);
+            prep = cairo_surface_reference(e->prep);
+            *aspect = e->aspect;
+        }
+    }
+    G_UNLOCK(export_cache);
+
+    g_free(key);
+    return prep;
+}
+
+
+/* May be called from any thread, with a slide which isn't shared */
+void export_cache_insert(Slide *s, int w, cairo_surface_t *prep, float aspect)
+{
+    struct export_cache_entry *e;
+
+    if ( s->ext_file == NULL ) return;
+
+    e = malloc(sizeof(struct export_cache_entry));
+    if ( e == NULL ) return;
+    e->key = make_key(s, w);
+    e->prep = cairo_surface_reference(prep);
+    e->aspect = aspect;
+    e->size = prep_size(prep);
+
+    G_LOCK(export_cache);
+    if ( export_cache == NULL ) {
+        export_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                             (GDestroyNotify)free_entry);
+    }
+    if ( g_hash_table_lookup(export_cache, e->key) != NULL ) {
+        /* Another export got there first */
+        G_UNLOCK(export_cache);
+        free_entry(e);
+        return;
+    }
+    g_queue_push_head(&lru, e);
+    e->link = lru.head;
+    g_hash_table_insert(export_cache, e->key, e);
+    total_size += e->size;
+    evict();
+    G_UNLOCK(export_cache);
+}
@@ -0,0 +1,39 @@
+/*
+ * exportcache.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef EXPORTCACHE_H
+#define EXPORTCACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cairo.h>
+
+#include "slide.h"
+
+extern cairo_surface_t *export_cache_lookup(Slide *s, int w, float *aspect);
+extern void export_cache_insert(Slide *s, int w, cairo_surface_t *prep,
+                                float aspect);
+
+#endif /* EXPORTCACHE_H */
@@ -0,0 +1,499 @@
+/*
+ * fileresolver.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <gio/gio.h>
+#include <libintl.h>
+#define _(x) gettext(x)
+
+#include "fileresolver.h"
+
+
+/* Finds the files referred to by a narrative.  A relative filename is looked
+ * for in the current directory, then up to three levels of parent directory
+ * of the narrative file, then the imagestore, and the first match wins.
+ *
+ * Each of those directories is listed once, and most filenames can be found
+ * or ruled out just by looking at the listings.  The rest are checked
+ * individually.  The listings and the checks are all done concurrently, and
+ * each filename is only resolved once, whether or not it's found.
+ *
+ * The filesystem might not be case-sensitive, so a name which is missing from
+ * a listing but matches one of its entries apart from case (or Unicode
+ * normalisation) still gets checked individually. */
+
+/* Current directory, three parents, imagestore */
+#define N_DIRS (5)
+
+
+enum probe_state
+{
+    PROBE_UNKNOWN,
+    PROBE_EXISTS,
+    PROBE_MISSING
+};
+
+
+struct listing
+{
+    FileResolver *fr;
+    GFile *dir;             /* NULL if this location doesn't apply */
+    GHashTable *names;      /* NULL if not (successfully) listed */
+    GHashTable *folded;     /* The same names, via fold_name() */
+    int listed;
+};
+
+
+struct resolution
+{
+    char *filename;
+    GFile *candidates[N_DIRS];
+    enum probe_state state[N_DIRS];
+    GFile *file;            /* NULL if not found */
+    int done;
+    int reported;
+};
+
+
+struct probe
+{
+    FileResolver *fr;
+    struct resolution *res;
+    int i;
+};
+
+
+struct _fileresolver
+{
+    struct listing dirs[N_DIRS];
+    GHashTable *resolutions;    /* Filename -> struct resolution */
+    GCancellable *cancellable;  /* During file_resolver_run() only */
+    int pending;
+};
+
+
+static void free_resolution(gpointer vp)
+{
+    struct resolution *res = vp;
+    int i;
+    for ( i=0; i<N_DIRS; i++ ) {
+        if ( res->candidates[i] != NULL ) g_object_unref(res->candidates[i]);
+    }
+    if ( res->file != NULL ) g_object_unref(res->file);
+    g_free(res->filename);
+    free(res);
+}
+
+
+/* Only directories with local paths are searched, as before */
+static GFile *local_parent(GFile *file)
+{
+    GFile *parent;
+    char *path;
+
+    if ( file == NULL ) return NULL;
+    parent = g_file_get_parent(file);
+    if ( parent == NULL ) return NULL;
+
+    path = g_file_get_path(parent);
+    if ( path == NULL ) {
+        g_object_unref(parent);
+        return NULL;
+    }
+    g_free(path);
+    return parent;
+}
+
+
+FileResolver *file_resolver_new(GFile *narrfile, GFile *imagestore)
+{
+    FileResolver *fr;
+    GFile *parent;
+    char *cwd;
+    int i;
+
+    fr = malloc(sizeof(FileResolver));
+    if ( fr == NULL ) return NULL;
+
+    cwd = g_get_current_dir();
+    fr->dirs[0].dir = g_file_new_for_path(cwd);
+    g_free(cwd);
+
+    parent = narrfile;
+    for ( i=1; i<=3; i++ ) {
+        parent = local_parent(parent);
+        fr->dirs[i].dir = parent;
+    }
+
+    fr->dirs[4].dir = (imagestore != NULL) ? g_object_ref(imagestore) : NULL;
+
+    for ( i=0; i<N_DIRS; i++ ) {
+        fr->dirs[i].fr = fr;
+        fr->dirs[i].names = NULL;
+        fr->dirs[i].folded = NULL;
+        fr->dirs[i].listed = 0;
+    }
+
+    fr->resolutions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            NULL, free_resolution);
+    fr->cancellable = NULL;
+    fr->pending = 0;
+    return fr;
+}
+
+
+void file_resolver_free(FileResolver *fr)
+{
+    int i;
+    if ( fr == NULL ) return;
+    for ( i=0; i<N_DIRS; i++ ) {
+        if ( fr->dirs[i].dir != NULL ) g_object_unref(fr->dirs[i].dir);
+        if ( fr->dirs[i].names != NULL ) g_hash_table_destroy(fr->dirs[i].names);
+        if ( fr->dirs[i].folded != NULL ) g_hash_table_destroy(fr->dirs[i].folded);
+    }
+    g_hash_table_destroy(fr->resolutions);
+    free(fr);
+}
+
+
+/* Adding the same filename more than once does no harm */
+void file_resolver_add(FileResolver *fr, const char *filename)
+{
+    struct resolution *res;
+    int i;
+
+    if ( g_hash_table_contains(fr->resolutions, filename) ) return;
+
+    res = malloc(sizeof(struct resolution));
+    if ( res == NULL ) return;
+
+    res->filename = g_strdup(filename);
+    res->file = NULL;
+    res->done = 0;
+    res->reported = 0;
+    for ( i=0; i<N_DIRS; i++ ) {
+        res->candidates[i] = NULL;
+        res->state[i] = PROBE_MISSING;
+    }
+
+    if ( strstr(filename, "://") != NULL ) {
+        res->file = g_file_new_for_uri(filename);
+        res->done = 1;
+    } else if ( g_path_is_absolute(filename) ) {
+        res->candidates[0] = g_file_new_for_path(filename);
+        res->state[0] = PROBE_UNKNOWN;
+    } else {
+        for ( i=0; i<N_DIRS; i++ ) {
+            if ( fr->dirs[i].dir == NULL ) continue;
+            res->candidates[i] = g_file_resolve_relative_path(fr->dirs[i].dir,
+                                                              filename);
+            res->state[i] = PROBE_UNKNOWN;
+        }
+    }
+
+    g_hash_table_insert(fr->resolutions, res->filename, res);
+}
+
+
+/* For comparing names without regard to case.  Returns a newly allocated
+ * string. */
+static char *fold_name(const char *name)
+{
+    char *norm;
+    char *folded;
+
+    norm = g_utf8_normalize(name, -1, G_NORMALIZE_NFD);
+    if ( norm == NULL ) return g_ascii_strdown(name, -1);
+    folded = g_utf8_casefold(norm, -1);
+    g_free(norm);
+    return folded;
+}
+
+
+static void next_files_done(GObject *obj, GAsyncResult *result, gpointer vp)
+{
+    struct listing *l = vp;
+    GFileEnumerator *en = G_FILE_ENUMERATOR(obj);
+    GError *error = NULL;
+    GList *infos;
+    GList *i;
+
+    infos = g_file_enumerator_next_files_finish(en, result, &error);
+
+    if ( infos == NULL ) {
+        if ( error != NULL ) {
+            /* An incomplete listing is no use */
+            g_hash_table_destroy(l->names);
+            g_hash_table_destroy(l->folded);
+            l->names = NULL;
+            l->folded = NULL;
+            g_error_free(error);
+        }
+        g_object_unref(en);
+        l->fr->pending--;
+        return;
+    }
+
+    for ( i=infos; i!=NULL; i=i->next ) {
+        GFileInfo *info = i->data;
+        const char *name = g_file_info_get_name(info);
+        g_hash_table_add(l->names, g_strdup(name));
+        g_hash_table_add(l->folded, fold_name(name));
+    }
+    g_list_free_full(infos, g_object_unref);
+
+    g_file_enumerator_next_files_async(en, 256, G_PRIORITY_DEFAULT,
+                                       l->fr->cancellable, next_files_done, l);
+}
+
+
+static void enumerate_done(GObject *obj, GAsyncResult *result, gpointer vp)
+{
+    struct listing *l = vp;
+    GFileEnumerator *en;
+
+    en = g_file_enumerate_children_finish(G_FILE(obj), result, NULL);
+    if ( en == NULL ) {
+        /* Filenames will have to be checked individually */
+        l->fr->pending--;
+        return;
+    }
+
+    l->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    l->folded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_file_enumerator_next_files_async(en, 256, G_PRIORITY_DEFAULT,
+                                       l->fr->cancellable, next_files_done, l);
+}
+
+
+static void probe_done(GObject *obj, GAsyncResult *result, gpointer vp)
+{
+    struct probe *p = vp;
+    GFileInfo *info;
+    GError *error = NULL;
+
+    info = g_file_query_info_finish(G_FILE(obj), result, &error);
+    if ( info != NULL ) {
+        p->res->state[p->i] = PROBE_EXISTS;
+        g_object_unref(info);
+    } else if ( g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)
+             || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) )
+    {
+        p->res->state[p->i] = PROBE_MISSING;
+        g_error_free(error);
+    } else {
+        /* Give it the benefit of the doubt, as before */
+        fprintf(stderr, _("Failed to read info: %s\n"), error->message);
+        p->res->state[p->i] = PROBE_EXISTS;
+        g_error_free(error);
+    }
+
+    p->fr->pending--;
+    free(p);
+}
+
+
+/* Whether 'name' might be in the listing, apart from case */
+static int in_folded(struct listing *l, const char *name)
+{
+    char *folded = fold_name(name);
+    int found = g_hash_table_contains(l->folded, folded);
+    g_free(folded);
+    return found;
+}
+
+
+/* What the listing says about 'filename' in directory number 'i' */
+static enum probe_state check_listing(FileResolver *fr, int i, const char *filename)
+{
+    struct listing *l = &fr->dirs[i];
+    const char *sep;
+    char *first;
+    int found;
+
+    if ( l->names == NULL ) return PROBE_UNKNOWN;
+    if ( g_path_is_absolute(filename) ) return PROBE_UNKNOWN;
+
+    sep = strchr(filename, '/');
+    if ( sep == NULL ) {
+        if ( g_hash_table_contains(l->names, filename) ) return PROBE_EXISTS;
+        return in_folded(l, filename) ? PROBE_UNKNOWN : PROBE_MISSING;
+    }
+
+    /* Only the first component can be ruled out */
+    first = g_strndup(filename, sep-filename);
+    if ( (strcmp(first, ".") == 0) || (strcmp(first, "..") == 0) ) {
+        g_free(first);
+        return PROBE_UNKNOWN;
+    }
+    found = g_hash_table_contains(l->names, first) || in_folded(l, first);
+    g_free(first);
+    return found ? PROBE_UNKNOWN : PROBE_MISSING;
+}
+
+
+static void start_probes(FileResolver *fr, struct resolution *res)
+{
+    int i;
+
+    for ( i=0; i<N_DIRS; i++ ) {
+        if ( res->state[i] != PROBE_UNKNOWN ) continue;
+        res->state[i] = check_listing(fr, i, res->filename);
+    }
+
+    /* Nothing after the first definite match matters */
+    for ( i=0; i<N_DIRS; i++ ) {
+
+        struct probe *p;
+
+        if ( res->state[i] == PROBE_EXISTS ) return;
+        if ( res->state[i] != PROBE_UNKNOWN ) continue;
+
+        p = malloc(sizeof(struct probe));
+        if ( p == NULL ) {
+            res->state[i] = PROBE_MISSING;
+            continue;
+        }
+        p->fr = fr;
+        p->res = res;
+        p->i = i;
+        fr->pending++;
+        g_file_query_info_async(res->candidates[i], G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                G_FILE_QUERY_INFO_NONE, G_PRIORITY_DEFAULT,
+                                fr->cancellable, probe_done, p);
+    }
+}
+
+
+static void settle(struct resolution *res)
+{
+    int i;
+    for ( i=0; i<N_DIRS; i++ ) {
+        if ( res->state[i] == PROBE_EXISTS ) {
+            res->file = g_object_ref(res->candidates[i]);
+            break;
+        }
+    }
+    res->done = 1;
+}
+
+
+static void wait_pending(FileResolver *fr, GMainContext *ctx)
+{
+    while ( fr->pending > 0 ) g_main_context_iteration(ctx, TRUE);
+}
+
+
+/* Resolves everything added so far.  Blocks until finished, so should
+ * usually be called on a worker thread.  Returns non-zero if 'cancellable'
+ * (which may be NULL) was cancelled, in which case nothing more is resolved
+ * and file_resolver_get() shouldn't be used. */
+int file_resolver_run(FileResolver *fr, GCancellable *cancellable)
+{
+    GMainContext *ctx;
+    GHashTableIter iter;
+    gpointer vp;
+    int todo;
+    int i;
+
+    /* Is there anything to do? */
+    todo = 0;
+    g_hash_table_iter_init(&iter, fr->resolutions);
+    while ( g_hash_table_iter_next(&iter, NULL, &vp) ) {
+        struct resolution *res = vp;
+        if ( !res->done ) todo = 1;
+    }
+    if ( !todo ) return 0;
+
+    if ( g_cancellable_is_cancelled(cancellable) ) return 1;
+    fr->cancellable = cancellable;
+
+    /* The async operations will report back to this thread */
+    ctx = g_main_context_new();
+    g_main_context_push_thread_default(ctx);
+
+    for ( i=0; i<N_DIRS; i++ ) {
+        struct listing *l = &fr->dirs[i];
+        if ( (l->dir == NULL) || l->listed ) continue;
+        l->listed = 1;
+        fr->pending++;
+        g_file_enumerate_children_async(l->dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                        G_FILE_QUERY_INFO_NONE, G_PRIORITY_DEFAULT,
+                                        cancellable, enumerate_done, l);
+    }
+    wait_pending(fr, ctx);
+
+    if ( !g_cancellable_is_cancelled(cancellable) ) {
+        g_hash_table_iter_init(&iter, fr->resolutions);
+        while ( g_hash_table_iter_next(&iter, NULL, &vp) ) {
+            struct resolution *res = vp;
+            if ( !res->done ) start_probes(fr, res);
+        }
+        wait_pending(fr, ctx);
+    }
+
+    g_main_context_pop_thread_default(ctx);
+    g_main_context_unref(ctx);
+    fr->cancellable = NULL;
+
+    /* Cancelled probes look like missing files, so don't believe them */
+    if ( g_cancellable_is_cancelled(cancellable) ) return 1;
+
+    g_hash_table_iter_init(&iter, fr->resolutions);
+    while ( g_hash_table_iter_next(&iter, NULL, &vp) ) {
+        struct resolution *res = vp;
+        if ( !res->done ) settle(res);
+    }
+    return 0;
+}
+
+
+/* Returns a new reference.  If the file couldn't be found, the result refers
+ * to the filename as given. */
+GFile *file_resolver_get(FileResolver *fr, const char *filename)
+{
+    struct resolution *res;
+
+    res = g_hash_table_lookup(fr->resolutions, filename);
+    if ( (res == NULL) || !res->done ) {
+        file_resolver_add(fr, filename);
+        file_resolver_run(fr, NULL);
+        res = g_hash_table_lookup(fr->resolutions, filename);
+        if ( res == NULL ) return g_file_new_for_path(filename);
+    }
+
+    if ( res->file != NULL ) return g_object_ref(res->file);
+
+    if ( !res->reported ) {
+        fprintf(stderr, "%s not found!\n", filename);
+        res->reported = 1;
+    }
+    return g_file_new_for_path(filename);
+}
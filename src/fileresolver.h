@@ -0,0 +1,41 @@
+/*
+ * fileresolver.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef FILERESOLVER_H
+#define FILERESOLVER_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gio/gio.h>
+
+typedef struct _fileresolver FileResolver;
+
+extern FileResolver *file_resolver_new(GFile *narrfile, GFile *imagestore);
+extern void file_resolver_free(FileResolver *fr);
+extern void file_resolver_add(FileResolver *fr, const char *filename);
+extern int file_resolver_run(FileResolver *fr, GCancellable *cancellable);
+extern GFile *file_resolver_get(FileResolver *fr, const char *filename);
+
+#endif /* FILERESOLVER_H */
@@ -0,0 +1,515 @@
+/*
+ * handout.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <libintl.h>
+#define _(x) gettext(x)
+
+#include <gtk/gtk.h>
+#include <cairo.h>
+#include <cairo-pdf.h>
+#include <pango/pangocairo.h>
+
+#include "narrative.h"
+#include "slide.h"
+#include "pdfexport.h"
+#include "handout.h"
+
+
+/* A speaker handout: the narrative text down the left of each page, with the
+ * slides down the right next to where they come in the text.
+ *
+ * The text and slides are copied on the main thread, and the PDF is written
+ * on a worker thread, a page at a time.  Each paragraph is laid out only
+ * when it's reached, and each slide is only loaded when it's placed, so the
+ * memory needed is not much more than the text itself. */
+
+/* A4, in points */
+#define PAGE_W (595.0)
+#define PAGE_H (842.0)
+#define MARGIN (50.0)
+#define GUTTER (20.0)
+#define SLIDE_COL_W (200.0)
+#define SLIDE_GAP (10.0)
+#define PARA_GAP (6.0)
+#define BULLET_INDENT (14.0)
+#define TEXT_COL_W (PAGE_W - 2.0*MARGIN - GUTTER - SLIDE_COL_W)
+
+/* Slides are drawn at this width and then scaled down, to keep bitmaps
+ * reasonably sharp when printed */
+#define SLIDE_RENDER_W (1000)
+
+
+/* A slide, or a paragraph of text with its formatting */
+struct handout_item
+{
+    Slide *slide;           /* Private copy, or NULL for a paragraph */
+    char *text;             /* Including the bullet, if any */
+    PangoAttrList *attrs;
+    const char *font;
+    int bullet;
+};
+
+
+struct handout_job
+{
+    GFile *file;
+    int n_items;
+    struct handout_item *items;
+    GCancellable *cancellable;
+
+    ExportProgressFunc progress;
+    gpointer progress_vp;
+    GMainContext *context;
+    GTask *task;
+};
+
+
+struct handout
+{
+    cairo_t *cr;
+    double text_y;
+    double slide_y;
+};
+
+
+static void free_handout_job(struct handout_job *job)
+{
+    int i;
+    for ( i=0; i<job->n_items; i++ ) {
+        struct handout_item *item = &job->items[i];
+        if ( item->slide != NULL ) slide_free(item->slide);
+        g_free(item->text);
+        if ( item->attrs != NULL ) pango_attr_list_unref(item->attrs);
+    }
+    free(job->items);
+    g_object_unref(job->file);
+    if ( job->cancellable != NULL ) g_object_unref(job->cancellable);
+    g_main_context_unref(job->context);
+    free(job);
+}
+
+
+static void add_span_attrs(GtkTextTag *tags[3], PangoAttrList *attrs,
+                           GtkTextIter *pos, guint start, guint end)
+{
+    PangoAttribute *attr;
+
+    if ( gtk_text_iter_has_tag(pos, tags[0]) ) {
+        attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
+        attr->start_index = start;
+        attr->end_index = end;
+        pango_attr_list_insert(attrs, attr);
+    }
+    if ( gtk_text_iter_has_tag(pos, tags[1]) ) {
+        attr = pango_attr_style_new(PANGO_STYLE_ITALIC);
+        attr->start_index = start;
+        attr->end_index = end;
+        pango_attr_list_insert(attrs, attr);
+    }
+    if ( gtk_text_iter_has_tag(pos, tags[2]) ) {
+        attr = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
+        attr->start_index = start;
+        attr->end_index = end;
+        pango_attr_list_insert(attrs, attr);
+    }
+}
+
+
+/* Main thread only.  Returns non-zero if the paragraph has no text, e.g. if
+ * it only holds slides. */
+static int snapshot_paragraph(struct handout_item *item, GtkTextBuffer *buf,
+                              GtkTextTag *tags[3], GtkTextIter *start,
+                              GtkTextIter *end)
+{
+    GString *text;
+    GtkTextIter pos;
+
+    if ( gtk_text_iter_has_tag(start, lookup_tag(buf, "prestitle")) ) {
+        item->font = "Sans Bold 18";
+    } else if ( gtk_text_iter_has_tag(start, lookup_tag(buf, "segstart")) ) {
+        item->font = "Sans Bold 13";
+    } else {
+        item->font = "Sans 10";
+    }
+
+    text = g_string_new(NULL);
+    item->attrs = pango_attr_list_new();
+    item->bullet = 0;
+    item->slide = NULL;
+
+    if ( gtk_text_iter_has_tag(start, lookup_tag(buf, "bulletpoint")) ) {
+        g_string_append(text, "•\t");
+        item->bullet = 1;
+    }
+
+    pos = *start;
+    while ( gtk_text_iter_compare(&pos, end) < 0 ) {
+
+        GtkTextIter next = pos;
+        char *str;
+        guint s0;
+
+        gtk_text_iter_forward_to_tag_toggle(&next, NULL);
+        if ( gtk_text_iter_compare(&next, end) > 0 ) next = *end;
+
+        str = gtk_text_buffer_get_text(buf, &pos, &next, TRUE);
+        s0 = text->len;
+        g_string_append(text, str);
+        add_span_attrs(tags, item->attrs, &pos, s0, text->len);
+        g_free(str);
+
+        pos = next;
+    }
+
+    if ( (text->len == 0) || (item->bullet && (text->len == strlen("•\t"))) ) {
+        g_string_free(text, TRUE);
+        pango_attr_list_unref(item->attrs);
+        return 1;
+    }
+
+    item->text = g_string_free(text, FALSE);
+    return 0;
+}
+
+
+/* Main thread only */
+static int snapshot_narrative(struct handout_job *job, Narrative *n)
+{
+    GtkTextBuffer *buf = n->textbuf;
+    GtkTextTag *tags[3];
+    GtkTextIter line_start;
+    int n_slides = narrative_count_slides(n);
+    int max_items;
+    int k = 0;
+
+    max_items = gtk_text_buffer_get_line_count(buf) + n_slides;
+    job->items = malloc(max_items*sizeof(struct handout_item));
+    if ( job->items == NULL ) return 1;
+    job->n_items = 0;
+
+    tags[0] = lookup_tag(buf, "bold");
+    tags[1] = lookup_tag(buf, "italic");
+    tags[2] = lookup_tag(buf, "underline");
+
+    gtk_text_buffer_get_start_iter(buf, &line_start);
+    do {
+
+        GtkTextIter line_end = line_start;
+        int line = gtk_text_iter_get_line(&line_start);
+        struct handout_item *item;
+
+        if ( !gtk_text_iter_ends_line(&line_end) ) {
+            gtk_text_iter_forward_to_line_end(&line_end);
+        }
+
+        /* The slides are in the same order as the text */
+        while ( k < n_slides ) {
+            Slide *slide = narrative_get_slide(n, k);
+            GtkTextIter anchor;
+            gtk_text_buffer_get_iter_at_child_anchor(buf, &anchor, slide->anchor);
+            if ( gtk_text_iter_get_line(&anchor) != line ) break;
+            item = &job->items[job->n_items++];
+            item->slide = slide_copy(slide);
+            item->text = NULL;
+            item->attrs = NULL;
+            k++;
+        }
+
+        item = &job->items[job->n_items];
+        if ( !snapshot_paragraph(item, buf, tags, &line_start, &line_end) ) {
+            job->n_items++;
+        }
+
+    } while ( gtk_text_iter_forward_line(&line_start) );
+
+    return 0;
+}
+
+
+static void new_page(struct handout *h)
+{
+    cairo_show_page(h->cr);
+    h->text_y = MARGIN;
+    h->slide_y = MARGIN;
+}
+
+
+static void place_slide(struct handout *h, Slide *slide)
+{
+    cairo_surface_t *prep;
+    float aspect;
+    double sh, x, y;
+    double scale;
+
+    /* Videos can't go on paper */
+    if ( slide_ftype(slide) == SLIDE_FTYPE_VIDEO ) return;
+
+    aspect = slide_get_aspect(slide);
+    sh = SLIDE_COL_W/aspect;
+    x = PAGE_W - MARGIN - SLIDE_COL_W;
+
+    /* Not above the text which leads up to it */
+    y = MAX(h->slide_y, h->text_y);
+    if ( y + sh > PAGE_H - MARGIN ) {
+        new_page(h);
+        y = MARGIN;
+    }
+
+    prep = slide_prepare_cairo(slide, SLIDE_RENDER_W);
+
+    scale = SLIDE_COL_W/SLIDE_RENDER_W;
+    cairo_save(h->cr);
+    cairo_translate(h->cr, x, y);
+    cairo_scale(h->cr, scale, scale);
+    cairo_rectangle(h->cr, 0.0, 0.0, SLIDE_RENDER_W, SLIDE_RENDER_W/aspect);
+    cairo_clip(h->cr);
+    slide_render_cairo_prepared(slide, prep, SLIDE_RENDER_W, h->cr);
+    cairo_restore(h->cr);
+
+    if ( prep != NULL ) cairo_surface_destroy(prep);
+
+    cairo_save(h->cr);
+    cairo_rectangle(h->cr, x, y, SLIDE_COL_W, sh);
+    cairo_set_source_rgb(h->cr, 0.5, 0.5, 0.5);
+    cairo_set_line_width(h->cr, 0.5);
+    cairo_stroke(h->cr);
+    cairo_restore(h->cr);
+
+    h->slide_y = y + sh + SLIDE_GAP;
+}
+
+
+static PangoLayout *paragraph_layout(struct handout *h, struct handout_item *item)
+{
+    PangoLayout *layout;
+    PangoFontDescription *fontdesc;
+
+    layout = pango_cairo_create_layout(h->cr);
+    pango_cairo_context_set_resolution(pango_layout_get_context(layout), 72.0);
+    pango_layout_context_changed(layout);
+    fontdesc = pango_font_description_from_string(item->font);
+    pango_layout_set_font_description(layout, fontdesc);
+    pango_font_description_free(fontdesc);
+    pango_layout_set_width(layout, pango_units_from_double(TEXT_COL_W));
+    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+    pango_layout_set_text(layout, item->text, -1);
+    pango_layout_set_attributes(layout, item->attrs);
+
+    if ( item->bullet ) {
+        /* Hanging indent, so that the text lines up after the bullet */
+        PangoTabArray *tabs = pango_tab_array_new_with_positions(1, TRUE,
+                                                                 PANGO_TAB_LEFT,
+                                                                 (int)BULLET_INDENT);
+        pango_layout_set_tabs(layout, tabs);
+        pango_tab_array_free(tabs);
+        pango_layout_set_indent(layout, -pango_units_from_double(BULLET_INDENT));
+    }
+
+    return layout;
+}
+
+
+/* Line by line, so that a paragraph can run over onto the next page */
+static void write_paragraph(struct handout *h, struct handout_item *item)
+{
+    PangoLayout *layout;
+    PangoLayoutIter *iter;
+    double para_top;
+    double offset = 0.0;
+    double bottom = 0.0;
+
+    layout = paragraph_layout(h, item);
+
+    para_top = h->text_y;
+    iter = pango_layout_get_iter(layout);
+    do {
+
+        PangoLayoutLine *line = pango_layout_iter_get_line_readonly(iter);
+        PangoRectangle logical;
+        double top, height;
+
+        pango_layout_iter_get_line_extents(iter, NULL, &logical);
+        top = pango_units_to_double(logical.y);
+        height = pango_units_to_double(logical.height);
+
+        /* A line too tall for any page just has to overflow */
+        if ( (para_top + top - offset + height > PAGE_H - MARGIN)
+          && (para_top + top - offset > MARGIN) )
+        {
+            new_page(h);
+            para_top = MARGIN;
+            offset = top;
+        }
+
+        cairo_move_to(h->cr, MARGIN + pango_units_to_double(logical.x),
+                      para_top - offset
+                        + pango_units_to_double(pango_layout_iter_get_baseline(iter)));
+        pango_cairo_show_layout_line(h->cr, line);
+
+        bottom = top + height - offset;
+
+    } while ( pango_layout_iter_next_line(iter) );
+    pango_layout_iter_free(iter);
+    g_object_unref(layout);
+
+    h->text_y = para_top + bottom + PARA_GAP;
+}
+
+
+static void write_handout(struct handout *h, struct handout_job *job)
+{
+    int i;
+
+    for ( i=0; i<job->n_items; i++ ) {
+
+        struct handout_item *item = &job->items[i];
+
+        if ( g_cancellable_is_cancelled(job->cancellable) ) return;
+
+        if ( item->slide != NULL ) {
+            place_slide(h, item->slide);
+            /* The slides take most of the time */
+            if ( job->progress != NULL ) {
+                export_report_progress(job->task, job->context, job->progress,
+                                       job->progress_vp, (double)(i+1)/job->n_items);
+            }
+        } else {
+            write_paragraph(h, item);
+        }
+    }
+}
+
+
+/* Can be run on any thread */
+static int write_pdf(struct handout_job *job, GError **error)
+{
+    struct handout h;
+    GFileOutputStream *fh;
+    cairo_surface_t *surf;
+    int r;
+
+    /* Written to a temporary file, which replaces the original only if
+     * everything went well */
+    fh = g_file_replace(job->file, NULL, FALSE, G_FILE_CREATE_NONE,
+                        job->cancellable, error);
+    if ( fh == NULL ) return 1;
+
+    surf = cairo_pdf_surface_create_for_stream(export_write_to_stream, fh,
+                                               PAGE_W, PAGE_H);
+
+    h.cr = cairo_create(surf);
+    h.text_y = MARGIN;
+    h.slide_y = MARGIN;
+
+    write_handout(&h, job);
+    cairo_show_page(h.cr);
+
+    cairo_destroy(h.cr);
+    cairo_surface_finish(surf);
+    r = (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS);
+    cairo_surface_destroy(surf);
+
+    if ( g_cancellable_set_error_if_cancelled(job->cancellable, error) ) {
+        r = 1;
+    } else if ( r ) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    _("Failed to write handout"));
+    }
+
+    r = export_close_stream(fh, r, error);
+    g_object_unref(fh);
+
+    return r;
+}
+
+
+static void export_thread(GTask *task, gpointer source, gpointer vp,
+                          GCancellable *cancellable)
+{
+    struct handout_job *job = vp;
+    GError *error = NULL;
+
+    if ( write_pdf(job, &error) ) {
+        g_task_return_error(task, error);
+    } else {
+        g_task_return_boolean(task, TRUE);
+    }
+}
+
+
+/* The text and slides are copied straight away, so the narrative can be
+ * changed, or even freed, while the export is running.  'progress' and
+ * 'callback' are called on the current thread-default main context. */
+void export_handout_async(Narrative *n, GFile *file, GCancellable *cancellable,
+                          ExportProgressFunc progress, gpointer progress_vp,
+                          GAsyncReadyCallback callback, gpointer vp)
+{
+    struct handout_job *job;
+    GTask *task;
+
+    task = g_task_new(NULL, cancellable, callback, vp);
+    g_task_set_source_tag(task, export_handout_async);
+
+    job = malloc(sizeof(struct handout_job));
+    if ( job == NULL ) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                _("Out of memory"));
+        g_object_unref(task);
+        return;
+    }
+
+    if ( snapshot_narrative(job, n) ) {
+        free(job);
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                _("Out of memory"));
+        g_object_unref(task);
+        return;
+    }
+
+    job->file = g_object_ref(file);
+    job->cancellable = (cancellable != NULL) ? g_object_ref(cancellable) : NULL;
+    job->progress = progress;
+    job->progress_vp = progress_vp;
+    job->context = g_main_context_ref_thread_default();
+    job->task = task;
+
+    g_task_set_task_data(task, job, (GDestroyNotify)free_handout_job);
+    g_task_run_in_thread(task, export_thread);
+    g_object_unref(task);
+}
+
+
+/* Returns zero on success */
+int export_handout_finish(GAsyncResult *result, GError **error)
+{
+    return !g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -0,0 +1,41 @@
+/*
+ * handout.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef HANDOUT_H
+#define HANDOUT_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gio/gio.h>
+
+#include "narrative.h"
+#include "pdfexport.h"
+
+extern void export_handout_async(Narrative *n, GFile *file, GCancellable *cancellable,
+                                 ExportProgressFunc progress, gpointer progress_vp,
+                                 GAsyncReadyCallback callback, gpointer vp);
+extern int export_handout_finish(GAsyncResult *result, GError **error);
+
+#endif /* HANDOUT_H */
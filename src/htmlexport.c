@@ -0,0 +1,557 @@
+/*
+ * htmlexport.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <libintl.h>
+#define _(x) gettext(x)
+
+#include <gtk/gtk.h>
+
+#include "narrative.h"
+#include "slide.h"
+#include "htmlexport.h"
+
+
+/* Writes the narrative as a web page, index.html, in the chosen folder.  The
+ * slides go in a "slides" subfolder as PNG files at several widths, so that
+ * the browser can choose the most suitable (srcset).
+ *
+ * The image filenames come from a hash of the slide's identity, which covers
+ * the file's modification time, page number and hidden elements.  Images
+ * which already exist are therefore still up to date, and are neither
+ * rendered nor written again.  Images which are no longer used are deleted
+ * afterwards. */
+
+static const int widths[] = { 480, 960, 1920 };
+#define N_WIDTHS (3)
+#define MAIN_WIDTH (960)   /* Also the maximum width of the page */
+
+
+struct html_slide
+{
+    Slide *slide;           /* Private copy */
+    gsize pos;              /* Where it goes in the HTML */
+    char *hash;             /* NULL if it can't be shown */
+    float aspect;
+};
+
+
+struct html_job
+{
+    GFile *dir;
+    GFile *slides_dir;
+    GString *html;
+    int n_slides;
+    struct html_slide *slides;
+    GCancellable *cancellable;
+    gint n_done;
+    gint n_failed;
+
+    ExportProgressFunc progress;
+    gpointer progress_vp;
+    GMainContext *context;
+    GTask *task;
+};
+
+
+static void free_html_job(struct html_job *job)
+{
+    int i;
+    for ( i=0; i<job->n_slides; i++ ) {
+        slide_free(job->slides[i].slide);
+        g_free(job->slides[i].hash);
+    }
+    free(job->slides);
+    g_string_free(job->html, TRUE);
+    g_object_unref(job->dir);
+    g_object_unref(job->slides_dir);
+    if ( job->cancellable != NULL ) g_object_unref(job->cancellable);
+    g_main_context_unref(job->context);
+    free(job);
+}
+
+
+/* Text runs, with any formatting */
+static void write_run(GString *html, GtkTextBuffer *buf, GtkTextIter *start,
+                      GtkTextIter *end, GtkTextTag *tags[3])
+{
+    const char *open[3] = { "<strong>", "<em>", "<u>" };
+    const char *close[3] = { "</strong>", "</em>", "</u>" };
+    char *str;
+    char *esc;
+    int i;
+
+    str = gtk_text_buffer_get_text(buf, start, end, TRUE);
+    if ( str[0] == '\0' ) {
+        g_free(str);
+        return;
+    }
+
+    esc = g_markup_escape_text(str, -1);
+    for ( i=0; i<3; i++ ) {
+        if ( gtk_text_iter_has_tag(start, tags[i]) ) g_string_append(html, open[i]);
+    }
+    g_string_append(html, esc);
+    for ( i=2; i>=0; i-- ) {
+        if ( gtk_text_iter_has_tag(start, tags[i]) ) g_string_append(html, close[i]);
+    }
+
+    g_free(esc);
+    g_free(str);
+}
+
+
+static void write_paragraph(GString *html, GtkTextBuffer *buf, GtkTextIter *start,
+                            GtkTextIter *end, const char *element,
+                            GtkTextTag *tags[3])
+{
+    GtkTextIter pos = *start;
+    gsize len_before = html->len;
+
+    g_string_append_printf(html, "<%s>", element);
+    while ( gtk_text_iter_compare(&pos, end) < 0 ) {
+        GtkTextIter next = pos;
+        gtk_text_iter_forward_to_tag_toggle(&next, NULL);
+        if ( gtk_text_iter_compare(&next, end) > 0 ) next = *end;
+        write_run(html, buf, &pos, &next, tags);
+        pos = next;
+    }
+
+    /* Leave out paragraphs with no text, e.g. the ones holding slides */
+    if ( html->len == len_before + strlen(element) + 2 ) {
+        g_string_truncate(html, len_before);
+        return;
+    }
+    g_string_append_printf(html, "</%s>\n", element);
+}
+
+
+/* Main thread only.  The slides are placed later, when their images exist. */
+static void write_text(struct html_job *job, Narrative *n)
+{
+    GtkTextBuffer *buf = n->textbuf;
+    GtkTextTag *tags[3];
+    GtkTextTag *prestitle, *segstart, *bulletpoint;
+    GtkTextIter line_start;
+    int in_list = 0;
+    int k = 0;
+
+    tags[0] = lookup_tag(buf, "bold");
+    tags[1] = lookup_tag(buf, "italic");
+    tags[2] = lookup_tag(buf, "underline");
+    prestitle = lookup_tag(buf, "prestitle");
+    segstart = lookup_tag(buf, "segstart");
+    bulletpoint = lookup_tag(buf, "bulletpoint");
+
+    gtk_text_buffer_get_start_iter(buf, &line_start);
+    do {
+
+        GtkTextIter line_end = line_start;
+        int line = gtk_text_iter_get_line(&line_start);
+        int bullet = gtk_text_iter_has_tag(&line_start, bulletpoint);
+        const char *element;
+
+        if ( !gtk_text_iter_ends_line(&line_end) ) {
+            gtk_text_iter_forward_to_line_end(&line_end);
+        }
+
+        if ( in_list && !bullet ) {
+            g_string_append(job->html, "</ul>\n");
+            in_list = 0;
+        }
+
+        /* The slides are in the same order as the text.  A figure can't go
+         * inside a list, so the list is started again afterwards. */
+        while ( k < job->n_slides ) {
+            Slide *slide = narrative_get_slide(n, k);
+            GtkTextIter anchor;
+            gtk_text_buffer_get_iter_at_child_anchor(buf, &anchor, slide->anchor);
+            if ( gtk_text_iter_get_line(&anchor) != line ) break;
+            if ( in_list ) {
+                g_string_append(job->html, "</ul>\n");
+                in_list = 0;
+            }
+            job->slides[k++].pos = job->html->len;
+        }
+
+        if ( bullet ) {
+            if ( !in_list ) {
+                g_string_append(job->html, "<ul>\n");
+                in_list = 1;
+            }
+            element = "li";
+        } else if ( gtk_text_iter_has_tag(&line_start, prestitle) ) {
+            element = "h1";
+        } else if ( gtk_text_iter_has_tag(&line_start, segstart) ) {
+            element = "h2";
+        } else {
+            element = "p";
+        }
+        write_paragraph(job->html, buf, &line_start, &line_end, element, tags);
+
+    } while ( gtk_text_iter_forward_line(&line_start) );
+
+    if ( in_list ) g_string_append(job->html, "</ul>\n");
+
+    /* Just in case */
+    while ( k < job->n_slides ) job->slides[k++].pos = job->html->len;
+}
+
+
+static char *image_name(const char *hash, int w)
+{
+    return g_strdup_printf("%s-%i.png", hash, w);
+}
+
+
+static int write_image(struct html_job *job, struct html_slide *hs, int w)
+{
+    GFile *file;
+    GdkTexture *tex;
+    GBytes *png;
+    char *name;
+    GError *error = NULL;
+    int r = 0;
+
+    name = image_name(hs->hash, w);
+    file = g_file_get_child(job->slides_dir, name);
+    g_free(name);
+
+    /* Still up to date? */
+    if ( g_file_query_exists(file, NULL) ) {
+        g_object_unref(file);
+        return 0;
+    }
+
+    /* Not going on screen, so it shouldn't push anything out of the cache */
+    tex = slide_render_texture_uncached(hs->slide, w);
+    if ( tex == NULL ) {
+        g_object_unref(file);
+        return 1;
+    }
+
+    png = gdk_texture_save_to_png_bytes(tex);
+    g_object_unref(tex);
+
+    if ( !g_file_replace_contents(file, g_bytes_get_data(png, NULL),
+                                  g_bytes_get_size(png), NULL, FALSE,
+                                  G_FILE_CREATE_NONE, NULL, job->cancellable,
+                                  &error) )
+    {
+        if ( !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ) {
+            fprintf(stderr, _("Failed to write image: %s\n"), error->message);
+        }
+        g_error_free(error);
+        r = 1;
+    }
+
+    g_bytes_unref(png);
+    g_object_unref(file);
+    return r;
+}
+
+
+static void report_progress(struct html_job *job)
+{
+    int done = g_atomic_int_add(&job->n_done, 1) + 1;
+
+    if ( job->progress == NULL ) return;
+    export_report_progress(job->task, job->context, job->progress,
+                           job->progress_vp, (double)done/job->n_slides);
+}
+
+
+/* Each slide is done by one worker thread, at all the sizes */
+static void prepare_slide(gpointer data, gpointer vp)
+{
+    struct html_slide *hs = data;
+    struct html_job *job = vp;
+    enum slide_filetype ftype;
+    char *key;
+    int i;
+
+    if ( g_cancellable_is_cancelled(job->cancellable) ) return;
+
+    ftype = slide_ftype(hs->slide);
+    if ( (ftype != SLIDE_FTYPE_PDF) && (ftype != SLIDE_FTYPE_SVG)
+      && (ftype != SLIDE_FTYPE_IMAGE) )
+    {
+        /* Videos, or missing files */
+        report_progress(job);
+        return;
+    }
+
+    hs->aspect = slide_get_aspect(hs->slide);
+    key = slide_get_key(hs->slide);
+    hs->hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+    g_free(key);
+
+    for ( i=0; i<N_WIDTHS; i++ ) {
+        if ( g_cancellable_is_cancelled(job->cancellable) ) break;
+        if ( write_image(job, hs, widths[i]) ) {
+            g_atomic_int_inc(&job->n_failed);
+        }
+    }
+
+    report_progress(job);
+}
+
+
+static void write_figure(GString *out, struct html_slide *hs, int num)
+{
+    char *name;
+    int i;
+
+    name = image_name(hs->hash, MAIN_WIDTH);
+    g_string_append_printf(out, "<figure class=\"slide\"><img src=\"slides/%s\"", name);
+    g_free(name);
+
+    g_string_append(out, " srcset=\"");
+    for ( i=0; i<N_WIDTHS; i++ ) {
+        name = image_name(hs->hash, widths[i]);
+        g_string_append_printf(out, "%sslides/%s %iw", (i>0) ? ", " : "",
+                               name, widths[i]);
+        g_free(name);
+    }
+    g_string_append_printf(out, "\" sizes=\"(max-width: %ipx) 100vw, %ipx\"",
+                           MAIN_WIDTH, MAIN_WIDTH);
+    g_string_append_printf(out, " width=\"%i\" height=\"%i\" alt=\"",
+                           MAIN_WIDTH, (int)(MAIN_WIDTH/hs->aspect));
+    g_string_append_printf(out, _("Slide %i"), num);
+    g_string_append(out, "\" loading=\"lazy\"></figure>\n");
+}
+
+
+static GBytes *assemble_html(struct html_job *job)
+{
+    GString *out;
+    char *title;
+    char *esc;
+    gsize pos = 0;
+    int i;
+
+    title = g_file_get_basename(job->dir);
+    esc = g_markup_escape_text(title, -1);
+    g_free(title);
+
+    out = g_string_sized_new(job->html->len + 1024*job->n_slides);
+    g_string_append_printf(out, "<!DOCTYPE html>\n<html>\n<head>\n"
+                           "<meta charset=\"utf-8\">\n"
+                           "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
+                           "<title>%s</title>\n"
+                           "<style>\n"
+                           "body { max-width: %ipx; margin: 0 auto; padding: 1em; font-family: sans-serif; }\n"
+                           "figure.slide { margin: 1em 0; }\n"
+                           "figure.slide img { width: 100%%; height: auto; }\n"
+                           "</style>\n</head>\n<body>\n", esc, MAIN_WIDTH);
+    g_free(esc);
+
+    for ( i=0; i<job->n_slides; i++ ) {
+        struct html_slide *hs = &job->slides[i];
+        g_string_append_len(out, job->html->str+pos, hs->pos-pos);
+        pos = hs->pos;
+        if ( hs->hash != NULL ) write_figure(out, hs, i+1);
+    }
+    g_string_append_len(out, job->html->str+pos, job->html->len-pos);
+
+    g_string_append(out, "</body>\n</html>\n");
+    return g_string_free_to_bytes(out);
+}
+
+
+/* SHA-256 in hex, then the width, as from image_name() */
+static int is_image_name(const char *name)
+{
+    int i;
+
+    for ( i=0; i<64; i++ ) {
+        if ( !g_ascii_isxdigit(name[i]) ) return 0;
+    }
+    if ( name[64] != '-' ) return 0;
+    for ( i=65; g_ascii_isdigit(name[i]); i++ );
+    if ( i == 65 ) return 0;
+    return strcmp(name+i, ".png") == 0;
+}
+
+
+/* Deletes the images left over from earlier exports, which the new page
+ * doesn't use.  Other files in the folder are left alone. */
+static void prune_images(struct html_job *job, GCancellable *cancellable)
+{
+    GHashTable *used;
+    GFileEnumerator *en;
+    GFileInfo *info;
+    GError *error = NULL;
+    int i, j;
+
+    en = g_file_enumerate_children(job->slides_dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                   G_FILE_QUERY_INFO_NONE, cancellable, &error);
+    if ( en == NULL ) {
+        fprintf(stderr, _("Failed to list slide images: %s\n"), error->message);
+        g_error_free(error);
+        return;
+    }
+
+    used = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for ( i=0; i<job->n_slides; i++ ) {
+        if ( job->slides[i].hash == NULL ) continue;
+        for ( j=0; j<N_WIDTHS; j++ ) {
+            g_hash_table_add(used, image_name(job->slides[i].hash, widths[j]));
+        }
+    }
+
+    while ( (info = g_file_enumerator_next_file(en, cancellable, NULL)) != NULL ) {
+        const char *name = g_file_info_get_name(info);
+        if ( is_image_name(name) && !g_hash_table_contains(used, name) ) {
+            GFile *file = g_file_get_child(job->slides_dir, name);
+            g_file_delete(file, cancellable, NULL);
+            g_object_unref(file);
+        }
+        g_object_unref(info);
+    }
+
+    g_hash_table_destroy(used);
+    g_object_unref(en);
+}
+
+
+static void export_thread(GTask *task, gpointer source, gpointer vp,
+                          GCancellable *cancellable)
+{
+    struct html_job *job = vp;
+    GThreadPool *pool;
+    GFile *index;
+    GBytes *html;
+    GError *error = NULL;
+    int i;
+
+    if ( !g_file_make_directory_with_parents(job->slides_dir, cancellable, &error) ) {
+        if ( !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_EXISTS) ) {
+            g_task_return_error(task, error);
+            return;
+        }
+        g_clear_error(&error);
+    }
+
+    pool = g_thread_pool_new(prepare_slide, job, g_get_num_processors(),
+                             FALSE, NULL);
+    for ( i=0; i<job->n_slides; i++ ) {
+        g_thread_pool_push(pool, &job->slides[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    if ( g_task_return_error_if_cancelled(task) ) return;
+
+    index = g_file_get_child(job->dir, "index.html");
+    html = assemble_html(job);
+    if ( !g_file_replace_contents(index, g_bytes_get_data(html, NULL),
+                                  g_bytes_get_size(html), NULL, FALSE,
+                                  G_FILE_CREATE_NONE, NULL, cancellable, &error) )
+    {
+        g_task_return_error(task, error);
+    } else {
+        /* Only once nothing refers to them any more */
+        prune_images(job, cancellable);
+        if ( g_atomic_int_get(&job->n_failed) > 0 ) {
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                    _("Failed to write %i slide images"),
+                                    g_atomic_int_get(&job->n_failed));
+        } else {
+            g_task_return_boolean(task, TRUE);
+        }
+    }
+    g_bytes_unref(html);
+    g_object_unref(index);
+}
+
+
+/* The text and slides are copied straight away, so the narrative can be
+ * changed, or even freed, while the export is running.  'progress' and
+ * 'callback' are called on the current thread-default main context. */
+void export_html_async(Narrative *n, GFile *dir, GCancellable *cancellable,
+                       ExportProgressFunc progress, gpointer progress_vp,
+                       GAsyncReadyCallback callback, gpointer vp)
+{
+    struct html_job *job;
+    GTask *task;
+    int i;
+
+    task = g_task_new(NULL, cancellable, callback, vp);
+    g_task_set_source_tag(task, export_html_async);
+
+    job = malloc(sizeof(struct html_job));
+    if ( job == NULL ) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                _("Out of memory"));
+        g_object_unref(task);
+        return;
+    }
+
+    job->n_slides = narrative_count_slides(n);
+    job->slides = malloc(job->n_slides*sizeof(struct html_slide));
+    if ( (job->slides == NULL) && (job->n_slides > 0) ) {
+        free(job);
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                _("Out of memory"));
+        g_object_unref(task);
+        return;
+    }
+    for ( i=0; i<job->n_slides; i++ ) {
+        job->slides[i].slide = slide_copy(narrative_get_slide(n, i));
+        job->slides[i].pos = 0;
+        job->slides[i].hash = NULL;
+        job->slides[i].aspect = 1.0;
+    }
+
+    job->dir = g_object_ref(dir);
+    job->slides_dir = g_file_get_child(dir, "slides");
+    job->html = g_string_new(NULL);
+    job->cancellable = (cancellable != NULL) ? g_object_ref(cancellable) : NULL;
+    job->n_done = 0;
+    job->n_failed = 0;
+    job->progress = progress;
+    job->progress_vp = progress_vp;
+    job->context = g_main_context_ref_thread_default();
+    job->task = task;
+
+    write_text(job, n);
+
+    g_task_set_task_data(task, job, (GDestroyNotify)free_html_job);
+    g_task_run_in_thread(task, export_thread);
+    g_object_unref(task);
+}
+
+
+/* Returns zero on success */
+int export_html_finish(GAsyncResult *result, GError **error)
+{
+    return !g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <math.h>
 #include <gio/gio.h>
 #include <gtk/gtk.h>
 #include <poppler.h>
@@ -42,12 +43,148 @@
 
 #include "slide.h"
 #include "narrative.h"
-#include "thumbnailwidget.h"
+#include "fileresolver.h"
+
+
+static int anchor_offset(GtkTextBuffer *buf, GtkTextChildAnchor *anc)
+{
+    GtkTextIter iter;
+    gtk_text_buffer_get_iter_at_child_anchor(buf, &iter, anc);
+    return gtk_text_iter_get_offset(&iter);
+}
+
+
+/* Binary search for the first slide in the index at or after 'offset' */
+static int index_search(Narrative *n, int offset)
+{
+    int lo = 0;
+    int hi = n->slide_index->len;
+
+    while ( lo < hi ) {
+        int mid = (lo+hi)/2;
+        Slide *s = g_ptr_array_index(n->slide_index, mid);
+        if ( anchor_offset(n->textbuf, s->anchor) < offset ) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/* Runs after the anchor has been inserted, including when undoing */
+static void insert_anchor_sig(GtkTextBuffer *buf, GtkTextIter *pos,
+                              GtkTextChildAnchor *anc, Narrative *n)
+{
+    Slide *s = g_object_get_data(G_OBJECT(anc), "slide");
+    if ( s == NULL ) return;
+    s->anchor = anc;
+    g_ptr_array_insert(n->slide_index,
+                       index_search(n, anchor_offset(buf, anc)), s);
+}
+
+
+static int wordcount(char *text)
+{
+       int j;
+       int words = 0;
+       size_t len = strlen(text);
+       for ( j=0; j<len; j++ ) {
+           if ( text[j] == ' ' ) words++;
+       }
+       return words;
+}
+
+
+static void count_line(Narrative *n, int line)
+{
+    GtkTextIter start, end;
+    char *txt;
+
+    gtk_text_buffer_get_iter_at_line(n->textbuf, &start, line);
+    end = start;
+    gtk_text_iter_forward_line(&end);
+    txt = gtk_text_iter_get_slice(&start, &end);
+    word_counts_set(n->word_counts, line, wordcount(txt));
+    g_free(txt);
+}
+
+
+/* Widens the range of lines to be fixed up by narrative_fixup_tags().  The
+ * marks then move along with any further edits. */
+static void mark_dirty(Narrative *n, GtkTextIter *start, GtkTextIter *end)
+{
+    GtkTextIter ds, de;
+
+    if ( n->dirty ) {
+        gtk_text_buffer_get_iter_at_mark(n->textbuf, &ds, n->dirty_start);
+        gtk_text_buffer_get_iter_at_mark(n->textbuf, &de, n->dirty_end);
+        if ( gtk_text_iter_compare(start, &ds) < 0 ) ds = *start;
+        if ( gtk_text_iter_compare(end, &de) > 0 ) de = *end;
+    } else {
+        ds = *start;
+        de = *end;
+    }
+
+    gtk_text_buffer_move_mark(n->textbuf, n->dirty_start, &ds);
+    gtk_text_buffer_move_mark(n->textbuf, n->dirty_end, &de);
+    n->dirty = 1;
+}
+
+
+/* Runs after the text has been inserted, when 'pos' is at the end of it */
+static void insert_text_sig(GtkTextBuffer *buf, GtkTextIter *pos,
+                            char *text, int len, Narrative *n)
+{
+    GtkTextIter start;
+    int first, last, line;
+
+    gtk_text_buffer_get_iter_at_offset(buf, &start,
+                                       gtk_text_iter_get_offset(pos)
+                                       - g_utf8_strlen(text, len));
+    first = gtk_text_iter_get_line(&start);
+    last = gtk_text_iter_get_line(pos);
+
+    word_counts_insert_lines(n->word_counts, first+1, last-first);
+    for ( line=first; line<=last; line++ ) {
+        count_line(n, line);
+    }
+
+    mark_dirty(n, &start, pos);
+}
+
+
+/* Runs before the text is deleted */
+static void delete_range_sig(GtkTextBuffer *buf, GtkTextIter *start,
+                             GtkTextIter *end, Narrative *n)
+{
+    int first = index_search(n, gtk_text_iter_get_offset(start));
+    int last = index_search(n, gtk_text_iter_get_offset(end));
+    if ( last > first ) {
+        g_ptr_array_remove_range(n->slide_index, first, last-first);
+    }
+
+    first = gtk_text_iter_get_line(start);
+    last = gtk_text_iter_get_line(end);
+    word_counts_delete_lines(n->word_counts, first+1, last-first);
+}
+
+
+/* Runs after the text has been deleted, when the remains of the lines have
+ * been joined together */
+static void delete_range_after_sig(GtkTextBuffer *buf, GtkTextIter *start,
+                                   GtkTextIter *end, Narrative *n)
+{
+    count_line(n, gtk_text_iter_get_line(start));
+    mark_dirty(n, start, start);
+}
 
 
 Narrative *narrative_new()
 {
     Narrative *n;
+    GtkTextIter start;
     n = malloc(sizeof(*n));
     if ( n == NULL ) return NULL;
     n->textbuf = gtk_text_buffer_new(NULL);
@@ -56,10 +193,29 @@ Narrative *narrative_new()
     n->slides = malloc(64*sizeof(Slide *));
     n->max_slides = 64;
 
-    n->n_time_marks = 1;
-    n->time_marks = malloc(60*sizeof(struct time_mark));
-    n->time_marks[0].minutes = 1.0;
-    n->time_marks[0].y = 300.0;
+    n->slide_index = g_ptr_array_new();
+    g_signal_connect_after(G_OBJECT(n->textbuf), "insert-child-anchor",
+                           G_CALLBACK(insert_anchor_sig), n);
+    g_signal_connect(G_OBJECT(n->textbuf), "delete-range",
+                     G_CALLBACK(delete_range_sig), n);
+
+    n->word_counts = word_counts_new();
+    n->dirty = 0;
+    gtk_text_buffer_get_start_iter(n->textbuf, &start);
+    n->dirty_start = gtk_text_buffer_create_mark(n->textbuf, NULL, &start, TRUE);
+    n->dirty_end = gtk_text_buffer_create_mark(n->textbuf, NULL, &start, FALSE);
+    g_signal_connect_after(G_OBJECT(n->textbuf), "insert-text",
+                           G_CALLBACK(insert_text_sig), n);
+    g_signal_connect_after(G_OBJECT(n->textbuf), "delete-range",
+                           G_CALLBACK(delete_range_after_sig), n);
+
+    n->n_time_marks = 0;
+    n->max_time_marks = 0;
+    n->time_marks = NULL;
+    n->highlight_start = NULL;
+    n->highlight_end = NULL;
+    n->save_head = NULL;
+    n->save_tail = NULL;
     n->total_minutes = 0.0;
 
     gtk_text_buffer_create_tag(n->textbuf, "segstart",
@@ -101,32 +257,48 @@ Narrative *narrative_new()
 }
 
 
+/* Saves of the same narrative are written one after the other, so that the
+ * last one always wins */
+struct save_ctx
+{
+    Narrative *n;               /* NULL if the narrative has been freed */
+    GtkTextBuffer *textbuf;
+    GFile *file;
+    GBytes *bytes;
+    NarrativeSaveDoneFunc done;
+    gpointer vp;
+    struct save_ctx *next;
+};
+
+
 /* Free the narrative and all contents */
 void narrative_free(Narrative *n)
 {
+    struct save_ctx *ctx;
+
+    /* Saves still in progress will finish without the narrative */
+    for ( ctx=n->save_head; ctx!=NULL; ctx=ctx->next ) ctx->n = NULL;
+
+    g_signal_handlers_disconnect_by_data(G_OBJECT(n->textbuf), n);
+    g_ptr_array_free(n->slide_index, TRUE);
+    word_counts_free(n->word_counts);
+    free(n->time_marks);
     g_object_unref(n->textbuf);
     free(n);
 }
 
 
-static ssize_t write_string(GOutputStream *fh, char *str)
+static void write_string(GString *fh, const char *str)
 {
-    gssize r;
-    GError *error = NULL;
-    r = g_output_stream_write(fh, str, strlen(str), NULL, &error);
-    if ( r == -1 ) {
-        fprintf(stderr, "Write failed: %s\n", error->message);
-        return -1;
-    }
-    return strlen(str);
+    g_string_append(fh, str);
 }
 
 
-static void write_series(GOutputStream *fh, char *c, int n)
+static void write_series(GString *fh, char c, int n)
 {
     int i;
     for ( i=0; i<n; i++ ) {
-        write_string(fh, c);
+        g_string_append_c(fh, c);
     }
 }
 
@@ -169,109 +341,175 @@ static gchar *relativize(GFile *file, GFile *parents[2])
 }
 
 
-static void write_tag_start(GOutputStream *fh,
-                            GtkTextTag *tag,
+/* The tags which mean something in Markdown */
+enum save_tag
+{
+    SAVE_TAG_OTHER,
+    SAVE_TAG_BOLD,
+    SAVE_TAG_ITALIC,
+    SAVE_TAG_UNDERLINE,
+    SAVE_TAG_SEGSTART,
+    SAVE_TAG_PRESTITLE,
+    SAVE_TAG_BULLETPOINT,
+    SAVE_TAG_SLIDE,
+    N_SAVE_TAGS
+};
+
+
+struct save_tags
+{
+    GtkTextTag *tags[N_SAVE_TAGS];
+};
+
+
+/* Looks the tags up once, so they can be recognised by pointer */
+static void get_save_tags(GtkTextBuffer *buf, struct save_tags *st)
+{
+    st->tags[SAVE_TAG_OTHER] = NULL;
+    st->tags[SAVE_TAG_BOLD] = lookup_tag(buf, "bold");
+    st->tags[SAVE_TAG_ITALIC] = lookup_tag(buf, "italic");
+    st->tags[SAVE_TAG_UNDERLINE] = lookup_tag(buf, "underline");
+    st->tags[SAVE_TAG_SEGSTART] = lookup_tag(buf, "segstart");
+    st->tags[SAVE_TAG_PRESTITLE] = lookup_tag(buf, "prestitle");
+    st->tags[SAVE_TAG_BULLETPOINT] = lookup_tag(buf, "bulletpoint");
+    st->tags[SAVE_TAG_SLIDE] = lookup_tag(buf, "slide");
+}
+
+
+static enum save_tag classify_tag(struct save_tags *st, GtkTextTag *tag)
+{
+    int i;
+    for ( i=1; i<N_SAVE_TAGS; i++ ) {
+        if ( st->tags[i] == tag ) return i;
+    }
+    return SAVE_TAG_OTHER;
+}
+
+
+static void write_slide(GString *fh, Slide *slide, GFile *parents[2])
+{
+    char *ef;
+
+    write_string(fh, "```\n");
+    ef = relativize(slide->ext_file, parents);
+    if ( ef != NULL ) {
+        write_string(fh, "File ");
+        write_string(fh, ef);
+        write_string(fh, "\n");
+    } else {
+        write_string(fh, "File *** not found ***\n");
+    }
+    if ( slide->ext_slidenumber > 0 ) {
+        g_string_append_printf(fh, "Page %i\n", slide->ext_slidenumber);
+    }
+    if ( slide->hide_elements != NULL ) {
+        int i = 0;
+        while ( slide->hide_elements[i] != NULL ) {
+            write_string(fh, "Hide ");
+            write_string(fh, slide->hide_elements[i]);
+            write_string(fh, "\n");
+            i++;
+        }
+    }
+    write_string(fh, "```");
+    g_free(ef);
+}
+
+
+static void write_tag_start(GString *fh,
+                            enum save_tag tag,
                             GtkTextIter *iter,
                             int *char_count,
                             int *tags_open,
                             GFile *parents[2])
 {
-    gchar *name;
-    g_object_get(G_OBJECT(tag), "name", &name, NULL);
-    if ( strcmp(name, "bold") == 0 ) {
+    Slide *slide;
+
+    switch ( tag ) {
+
+        case SAVE_TAG_BOLD :
         write_string(fh, "**");
         set_bit(tags_open, TB_BOLD);
-    }
-    if ( strcmp(name, "italic") == 0 ) {
+        break;
+
+        case SAVE_TAG_ITALIC :
         write_string(fh, "*");
         set_bit(tags_open, TB_ITALIC);
-    }
-    if ( strcmp(name, "underline") == 0 ) {
+        break;
+
+        case SAVE_TAG_UNDERLINE :
         write_string(fh, "_");
         set_bit(tags_open, TB_UNDERLINE);
-    }
-    if ( strcmp(name, "segstart") == 0 ) {
+        break;
+
+        case SAVE_TAG_SEGSTART :
         write_string(fh, "\n");
         *char_count = 0;
-    }
-    if ( strcmp(name, "prestitle") == 0 ) {
+        break;
+
+        case SAVE_TAG_PRESTITLE :
         *char_count = 0;
-    }
-    if ( strcmp(name, "bulletpoint") == 0 ) {
+        break;
+
+        case SAVE_TAG_BULLETPOINT :
         write_string(fh, "* ");
+        break;
+
+        case SAVE_TAG_SLIDE :
+        slide = narrative_slide_at_iter(iter);
+        if ( slide != NULL ) write_slide(fh, slide, parents);
+        break;
+
+        default :
+        break;
     }
-    if ( strcmp(name, "slide") == 0 ) {
-        GtkTextChildAnchor *anc = gtk_text_iter_get_child_anchor(iter);
-        if ( anc != NULL ) {
-            GtkWidget **widgets;
-            Slide *slide;
-            guint len;
-            char tmp[64];
-            char *ef;
-            widgets = gtk_text_child_anchor_get_widgets(anc, &len);
-            assert(len == 1);
-            slide = thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(widgets[0]));
-            write_string(fh, "```\n");
-            ef = relativize(slide->ext_file, parents);
-            if ( ef != NULL ) {
-                write_string(fh, "File ");
-                write_string(fh, ef);
-                write_string(fh, "\n");
-            } else {
-                write_string(fh, "File *** not found ***\n");
-            }
-            if ( slide->ext_slidenumber > 0 ) {
-                snprintf(tmp, 64, "Page %i\n", slide->ext_slidenumber);
-                write_string(fh, tmp);
-            }
-            if ( slide->hide_elements != NULL ) {
-                int i = 0;
-                while ( slide->hide_elements[i] != NULL ) {
-                    write_string(fh, "Hide ");
-                    write_string(fh, slide->hide_elements[i]);
-                    write_string(fh, "\n");
-                    i++;
-                }
-            }
-            write_string(fh, "```");
-            g_free(ef);
-        }
-    }
-    g_free(name);
 }
 
 
-static void write_tag_end(GOutputStream *fh, GtkTextTag *tag, int *last_len, int *tags_open)
+static void write_tag_end(GString *fh, enum save_tag tag, int *last_len, int *tags_open)
 {
-    gchar *name;
-    g_object_get(G_OBJECT(tag), "name", &name, NULL);
-    if ( (strcmp(name, "bold") == 0) && (*tags_open & TB_BOLD) ) {
-        write_string(fh, "**");
-        clear_bit(tags_open, TB_BOLD);
-    }
-    if ( (strcmp(name, "italic") == 0) && (*tags_open & TB_ITALIC) ) {
-        write_string(fh, "*");
-        clear_bit(tags_open, TB_ITALIC);
-    }
-    if ( (strcmp(name, "underline") == 0) && (*tags_open & TB_UNDERLINE) ) {
-        write_string(fh, "_");
-        clear_bit(tags_open, TB_UNDERLINE);
-    }
-    if ( strcmp(name, "prestitle") == 0 ) {
+    switch ( tag ) {
+
+        case SAVE_TAG_BOLD :
+        if ( *tags_open & TB_BOLD ) {
+            write_string(fh, "**");
+            clear_bit(tags_open, TB_BOLD);
+        }
+        break;
+
+        case SAVE_TAG_ITALIC :
+        if ( *tags_open & TB_ITALIC ) {
+            write_string(fh, "*");
+            clear_bit(tags_open, TB_ITALIC);
+        }
+        break;
+
+        case SAVE_TAG_UNDERLINE :
+        if ( *tags_open & TB_UNDERLINE ) {
+            write_string(fh, "_");
+            clear_bit(tags_open, TB_UNDERLINE);
+        }
+        break;
+
+        case SAVE_TAG_PRESTITLE :
         write_string(fh, "\n");
-        write_series(fh, "=", *last_len);
+        write_series(fh, '=', *last_len);
         *last_len = 0;
-    }
-    if ( strcmp(name, "segstart") == 0 ) {
+        break;
+
+        case SAVE_TAG_SEGSTART :
         write_string(fh, "\n");
-        write_series(fh, "-", *last_len);
+        write_series(fh, '-', *last_len);
         *last_len = 0;
+        break;
+
+        default :
+        break;
     }
-    g_free(name);
 }
 
 
-static void close_span_tags(GOutputStream *fh, int *tags)
+static void close_span_tags(GString *fh, int *tags)
 {
     if ( *tags & TB_BOLD ) {
         write_string(fh, "**");
@@ -288,135 +526,90 @@ static void close_span_tags(GOutputStream *fh, int *tags)
 }
 
 
-static char *escape_text(const char *in, size_t len)
+/* Escapes straight into the output.  Returns the number of characters. */
+static int write_escaped_text(GString *fh, const char *str, size_t len)
 {
-    int i, j;
-    size_t nl = 0;
-    size_t np = 0;
-    const char *esc = "*/_";
-    size_t n_esc = 3;
-    char *out;
-
-    for ( i=0; i<len; i++ ) {
-        for ( j=0; j<n_esc; j++ ) {
-            if ( in[i] == esc[j] ) {
-                nl++;
-                break;
-            }
-        }
-    }
-
-    out = malloc(len + nl + 1);
-    if ( out == NULL ) return NULL;
+    size_t i;
+    size_t run = 0;
 
-    np = 0;
     for ( i=0; i<len; i++ ) {
-        for ( j=0; j<n_esc; j++ ) {
-            if ( in[i] == esc[j] ) {
-                out[np++] = '\\';
-                break;
-            }
+        if ( (str[i] == '*') || (str[i] == '/') || (str[i] == '_') ) {
+            g_string_append_len(fh, str+run, i-run);
+            g_string_append_c(fh, '\\');
+            run = i;
         }
-        out[np++] = in[i];
     }
-    out[np] = '\0';
+    g_string_append_len(fh, str+run, len-run);
 
-    return out;
+    return g_utf8_strlen(str, len);
 }
 
 
-static int write_escaped_text(GOutputStream *fh, char *str)
-{
-    size_t len = strlen(str);
-    int char_len = g_utf8_strlen(str, len);
-    char *esc = escape_text(str, len);
-    if ( write_string(fh, esc) == -1 ) return 0;
-    free(esc);
-    g_free(str);
-    return char_len;
-}
-
-
-static void write_tags(GtkTextIter pos, int *char_count, GOutputStream *fh,
-                       int *tags_open, GFile *parents[2])
+static void write_tags(GtkTextIter *pos, struct save_tags *st, int *char_count,
+                       GString *fh, int *tags_open, GFile *parents[2])
 {
+    GSList *tags;
     GSList *tag;
 
-    for ( tag=gtk_text_iter_get_toggled_tags(&pos, FALSE);
-          tag != NULL;
-          tag=g_slist_next(tag) )
-    {
-        write_tag_end(fh, tag->data, char_count, tags_open);
+    tags = gtk_text_iter_get_toggled_tags(pos, FALSE);
+    for ( tag=tags; tag != NULL; tag=g_slist_next(tag) ) {
+        write_tag_end(fh, classify_tag(st, tag->data), char_count, tags_open);
     }
+    g_slist_free(tags);
 
-    for ( tag=gtk_text_iter_get_toggled_tags(&pos, TRUE);
-          tag != NULL;
-          tag=g_slist_next(tag) )
-    {
-        write_tag_start(fh, tag->data, &pos, char_count, tags_open, parents);
+    tags = gtk_text_iter_get_toggled_tags(pos, TRUE);
+    for ( tag=tags; tag != NULL; tag=g_slist_next(tag) ) {
+        write_tag_start(fh, classify_tag(st, tag->data), pos, char_count,
+                        tags_open, parents);
     }
+    g_slist_free(tags);
 }
 
 
-static int write_markdown(GOutputStream *fh, Narrative *n, GFile *parents[2])
+/* Walks from one tag toggle to the next, splitting the text at line breaks
+ * along the way.  Each line becomes a paragraph. */
+static int write_markdown(GString *fh, Narrative *n, GFile *parents[2])
 {
-    GtkTextIter start, end;
-    int finished = 0;
+    GtkTextIter pos, next;
+    struct save_tags st;
     int char_count = 0;
     int tags_open = 0;
 
-    gtk_text_buffer_get_start_iter(n->textbuf, &start);
-    gtk_text_buffer_get_end_iter(n->textbuf, &end);
+    get_save_tags(n->textbuf, &st);
 
-    write_tags(start, &char_count, fh, &tags_open, parents);
-    do {
+    gtk_text_buffer_get_start_iter(n->textbuf, &pos);
+    write_tags(&pos, &st, &char_count, fh, &tags_open, parents);
 
-        GtkTextIter end_tag, end_para;
-        GtkTextIter nrl;  /* "Next Relevant Location */
-        int have_etag, have_epara;
-        int epara = 0;
-
-        end_tag = start;
-        end_para = start;
-        have_etag = gtk_text_iter_forward_to_tag_toggle(&end_tag, NULL);
-        have_epara = gtk_text_iter_forward_to_line_end(&end_para);
-        if ( !have_etag && !have_epara ) {
-            nrl = end;
-            finished = 1;
-        } else {
-            int r;
-            r = gtk_text_iter_compare(&end_tag, &end_para);
-            if ( r < 0 ) {
-                /* end_tag comes first */
-                nrl = end_tag;
-            } else {
-                /* end_para comes first, or they coincide */
-                nrl = end_para;
-                epara = 1;
-            }
-        }
+    while ( !gtk_text_iter_is_end(&pos) ) {
 
-        char *str = gtk_text_buffer_get_text(n->textbuf, &start, &nrl, TRUE);
-        char_count += write_escaped_text(fh, str);
+        char *str;
+        const char *p;
+        const char *nl;
 
-        write_tags(nrl, &char_count, fh, &tags_open, parents);
+        next = pos;
+        gtk_text_iter_forward_to_tag_toggle(&next, NULL);
 
-        if ( epara ) {
+        str = gtk_text_buffer_get_text(n->textbuf, &pos, &next, TRUE);
+        p = str;
+        while ( (nl = strchr(p, '\n')) != NULL ) {
+
+            char_count += write_escaped_text(fh, p, nl-p);
 
             /* Close any open span tags (bold/italic/underline) */
             close_span_tags(fh, &tags_open);
 
-            /* Sneakily move to start of the next paragraph */
-            if ( gtk_text_iter_forward_line(&nrl) ) {
+            /* No paragraph break after the very last line */
+            if ( (nl[1] != '\0') || !gtk_text_iter_is_end(&next) ) {
                 write_string(fh, "\n\n");
-                write_tags(nrl, &char_count, fh, &tags_open, parents);
-            } /* else no more lines */
-
+            }
+            p = nl+1;
         }
+        char_count += write_escaped_text(fh, p, strlen(p));
+        g_free(str);
 
-        start = nrl;
-
-    } while ( !finished );
+        write_tags(&next, &st, &char_count, fh, &tags_open, parents);
+        pos = next;
+    }
     write_string(fh, "\n");
 
     return 0;
@@ -432,259 +625,390 @@ static GFile *imagestore_as_gfile(GSettings *settings)
 }
 
 
+/* Takes a snapshot of the text as Markdown.  Slide filenames are written
+ * relative to 'dir' or 'imagestore' if possible, and either of them can be
+ * NULL.  Main thread only. */
+GBytes *narrative_serialise(Narrative *n, GFile *dir, GFile *imagestore)
+{
+    GString *out;
+    GFile *parents[2];
+
+    parents[0] = dir;
+    parents[1] = imagestore;
+
+    out = g_string_sized_new(gtk_text_buffer_get_char_count(n->textbuf)*11/10);
+    write_markdown(out, n, parents);
+
+    return g_string_free_to_bytes(out);
+}
+
+
+static GBytes *serialise_narrative(Narrative *n, GFile *file)
+{
+    GBytes *bytes;
+    GFile *dir;
+    GFile *imagestore;
+
+    GSettings *settings = g_settings_new("uk.me.bitwiz.colloquium");
+    dir = g_file_get_parent(file);
+    imagestore = imagestore_as_gfile(settings);
+    g_object_unref(settings);
+
+    bytes = narrative_serialise(n, dir, imagestore);
+
+    if ( dir != NULL ) g_object_unref(dir);
+    if ( imagestore != NULL ) g_object_unref(imagestore);
+    return bytes;
+}
+
+
 int narrative_save(Narrative *n, GFile *file)
 {
-    GFileOutputStream *fh;
-    int r;
+    GBytes *bytes;
     GError *error = NULL;
-    GFile *parents[2];
 
     if ( file == NULL ) {
         fprintf(stderr, "Saving to NULL!\n");
         return 1;
     }
 
-    GSettings *settings = g_settings_new("uk.me.bitwiz.colloquium");
-    parents[0] = g_file_get_parent(file);
-    parents[1] = imagestore_as_gfile(settings);
-    g_object_unref(settings);
-
-    fh = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
-    if ( fh == NULL ) {
-        fprintf(stderr, _("Open failed: %s\n"), error->message);
+    /* Written to a temporary file, which then replaces the original */
+    bytes = serialise_narrative(n, file);
+    if ( !g_file_replace_contents(file, g_bytes_get_data(bytes, NULL),
+                                  g_bytes_get_size(bytes), NULL, FALSE,
+                                  G_FILE_CREATE_NONE, NULL, NULL, &error) )
+    {
+        fprintf(stderr, _("Save failed: %s\n"), error->message);
+        g_error_free(error);
+        g_bytes_unref(bytes);
         return 1;
     }
-    r = write_markdown(G_OUTPUT_STREAM(fh), n, parents);
-    if ( r ) {
-        fprintf(stderr, _("Couldn't save presentation\n"));
-    }
-    g_object_unref(fh);
-    g_object_unref(parents[0]);
-    if ( parents[1] != NULL ) g_object_unref(parents[1]);
+    g_bytes_unref(bytes);
 
     gtk_text_buffer_set_modified(n->textbuf, FALSE);
     return 0;
 }
 
 
-static int wordcount(char *text)
+/* There might not be an application, e.g. in a command-line tool */
+static void hold_app(void)
 {
-       int j;
-       int words = 0;
-       size_t len = strlen(text);
-       for ( j=0; j<len; j++ ) {
-           if ( text[j] == ' ' ) words++;
-       }
-       return words;
+    GApplication *app = g_application_get_default();
+    if ( app != NULL ) g_application_hold(app);
 }
 
 
-void narrative_update_timing(GtkTextView *nv, Narrative *n, double wpm)
+static void release_app(void)
 {
-    GtkTextIter start;
-    int i = 0;
-    double total_minutes = 0.0;
-    double last_mark = 0.0;
-
-    n->n_time_marks = 0;
-    gtk_text_buffer_get_start_iter(n->textbuf, &start);
-    do {
-        int y, h;
-        char *txt;
-        GtkTextIter end = start;
-        gtk_text_iter_forward_line(&end);
-        gtk_text_view_get_line_yrange(nv, &start, &y, &h);
-        txt = gtk_text_iter_get_slice(&start, &end);
-        total_minutes += wordcount(txt)/wpm;
-        g_free(txt);
-
-        if ( total_minutes - last_mark >= 1.0 ) {
-            n->time_marks[i].y = y;
-            n->time_marks[i].minutes = total_minutes;
-            i++;
-            if ( i == 60 ) break; /* Lazy memory "management" */
-            last_mark = total_minutes;
-        }
-        start = end;
-    } while ( !gtk_text_iter_is_end(&start) );
-    n->n_time_marks = i;
-    n->total_minutes = total_minutes;
+    GApplication *app = g_application_get_default();
+    if ( app != NULL ) g_application_release(app);
 }
 
 
-#ifdef HAVE_MD4C
+static void start_write(struct save_ctx *ctx);
 
-enum narrative_item_type
+static void save_written(GObject *obj, GAsyncResult *res, gpointer vp)
 {
-    NARRATIVE_ITEM_TEXT,
-    NARRATIVE_ITEM_SEGSTART,
-    NARRATIVE_ITEM_SEGEND,
-    NARRATIVE_ITEM_PRESTITLE,
-    NARRATIVE_ITEM_SLIDE,
-    NARRATIVE_ITEM_BP,
-    NARRATIVE_ITEM_EOP,
-    NARRATIVE_ITEM_CODE,
-};
+    struct save_ctx *ctx = vp;
+    struct save_ctx *next;
+    GError *error = NULL;
+    int r = 0;
 
+    next = ctx->next;
 
-struct code_block {
-    int used;
-    char *filename;
-    int page;
-    char **hide_elements;
-    int n_hide;
-    int max_hide;
-};
+    if ( !g_file_replace_contents_finish(G_FILE(obj), res, NULL, &error) ) {
+        fprintf(stderr, _("Save failed: %s\n"), error->message);
+        g_error_free(error);
+        /* Whatever was in the snapshot still needs saving, unless a later
+         * snapshot is queued, in which case that one decides */
+        if ( next == NULL ) gtk_text_buffer_set_modified(ctx->textbuf, TRUE);
+        r = 1;
+    }
 
+    if ( ctx->n != NULL ) {
+        ctx->n->save_head = next;
+        if ( next == NULL ) ctx->n->save_tail = NULL;
+    }
 
-static void clear_code_block(struct code_block *cb)
+    if ( ctx->done != NULL ) ctx->done(r, ctx->vp);
+
+    g_bytes_unref(ctx->bytes);
+    g_object_unref(ctx->file);
+    g_object_unref(ctx->textbuf);
+    free(ctx);
+
+    if ( next != NULL ) start_write(next);
+    release_app();
+}
+
+
+static void start_write(struct save_ctx *ctx)
 {
-    int i;
+    /* Written to a temporary file, which then replaces the original */
+    g_file_replace_contents_bytes_async(ctx->file, ctx->bytes, NULL, FALSE,
+                                        G_FILE_CREATE_NONE, NULL,
+                                        save_written, ctx);
+}
 
-    if ( cb->used == 1 ) {
-        fprintf(stderr, "Clearing a used code block\n");
+
+/* The text is serialised straight away, and then written in the background.
+ * 'done' is called on the main thread, with a non-zero value if saving
+ * failed.  It's called even if the narrative has been freed in the
+ * meantime. */
+void narrative_save_async(Narrative *n, GFile *file,
+                          NarrativeSaveDoneFunc done, gpointer vp)
+{
+    struct save_ctx *ctx;
+
+    if ( file == NULL ) {
+        fprintf(stderr, "Saving to NULL!\n");
+        if ( done != NULL ) done(1, vp);
+        return;
     }
 
-    for ( i=0; i<cb->n_hide; i++ ) {
-        free(cb->hide_elements[i]);
+    ctx = malloc(sizeof(struct save_ctx));
+    if ( ctx == NULL ) {
+        if ( done != NULL ) done(1, vp);
+        return;
     }
-    cb->n_hide = 0;
 
-    free(cb->filename);
-    cb->filename = NULL;
-    cb->page = 0;
-}
+    ctx->n = n;
+    ctx->textbuf = g_object_ref(n->textbuf);
+    ctx->file = g_object_ref(file);
+    ctx->bytes = serialise_narrative(n, file);
+    ctx->done = done;
+    ctx->vp = vp;
+    ctx->next = NULL;
 
+    /* Changes made from now on are not covered by this save */
+    gtk_text_buffer_set_modified(n->textbuf, FALSE);
 
-struct md_parse_ctx {
-    Narrative *n;
-    GFile *nfile;
-    enum narrative_item_type type;
-    int bold;
-    int italic;
-    int underline;
-    int need_newline;
-    GFile *imagestore;
-    struct code_block cb;
-};
+    /* Don't quit before it's been written */
+    hold_app();
 
+    if ( n->save_tail != NULL ) {
+        n->save_tail->next = ctx;
+        n->save_tail = ctx;
+    } else {
+        n->save_head = ctx;
+        n->save_tail = ctx;
+        start_write(ctx);
+    }
+}
 
-void insert_slide_anchor(GtkTextBuffer *buf, Slide *slide, GtkTextIter start, int newline)
+
+/* Highlights the line containing 'pos' (from its position to the end of the
+ * line), or just removes the highlight if 'pos' is NULL.  Only the previously
+ * highlighted line is cleared, so this costs the same however long the
+ * narrative is. */
+void narrative_set_highlight(Narrative *n, GtkTextIter *pos)
 {
-    GtkTextIter end;
-    GtkTextMark *mark;
+    GtkTextIter start, end;
+    GtkTextBuffer *buf = n->textbuf;
+    GtkTextTag *tag = lookup_tag(buf, "highlight");
 
-    /* Mark this position for later */
-    mark = gtk_text_mark_new(NULL, TRUE);
-    gtk_text_buffer_add_mark(buf, mark, &start);
+    if ( n->highlight_start != NULL ) {
+        gtk_text_buffer_get_iter_at_mark(buf, &start, n->highlight_start);
+        gtk_text_buffer_get_iter_at_mark(buf, &end, n->highlight_end);
+        gtk_text_buffer_remove_tag(buf, tag, &start, &end);
+    }
 
-    /* Insert the slide's anchor */
-    slide->anchor = gtk_text_buffer_create_child_anchor(buf, &start);
+    if ( pos == NULL ) return;
 
-    /* Retrieve the mark  and figure out positions before and after the slide */
-    gtk_text_buffer_get_iter_at_mark(buf, &end, mark);
-    start = end;
-    gtk_text_iter_forward_cursor_position(&end);
-    gtk_text_buffer_apply_tag_by_name(buf, "slide", &start, &end);
+    start = *pos;
+    end = start;
+    if ( !gtk_text_iter_ends_line(&end) ) gtk_text_iter_forward_to_line_end(&end);
 
-    /* Retrieve the mark (again) and add a newline, if requested */
-    if ( newline ) {
-        gtk_text_buffer_get_iter_at_mark(buf, &end, mark);
-        gtk_text_iter_forward_cursor_position(&end);
-        gtk_text_buffer_insert(buf, &end, "\n", 1);
-    }
+    gtk_text_buffer_apply_tag(buf, tag, &start, &end);
 
-    /* Mark is not needed any more */
-    gtk_text_buffer_delete_mark(buf, mark);
+    if ( n->highlight_start == NULL ) {
+        n->highlight_start = gtk_text_buffer_create_mark(buf, NULL, &start, TRUE);
+        n->highlight_end = gtk_text_buffer_create_mark(buf, NULL, &end, FALSE);
+    } else {
+        gtk_text_buffer_move_mark(buf, n->highlight_start, &start);
+        gtk_text_buffer_move_mark(buf, n->highlight_end, &end);
+    }
 }
 
 
-static int g_file_exists(GFile *file)
+/* The word counts are kept up to date as the text changes, so this only has
+ * to look up where each minute ends */
+void narrative_update_timing(Narrative *n, double wpm)
 {
-    GFileInfo *info;
-    GError *error;
+    int i;
+    int n_marks;
 
-    error = NULL;
-    info = g_file_query_info(file, "standard::", G_FILE_QUERY_INFO_NONE, NULL, &error);
-    if ( info == NULL ) {
-        if ( error->code == G_IO_ERROR_NOT_FOUND ) {
-            return 0;
-        } else {
-            fprintf(stderr, _("Failed to read info: %s\n"), error->message);
-            return -1;
-        }
+    n->total_minutes = word_counts_total(n->word_counts)/wpm;
+    n_marks = floor(n->total_minutes);
+
+    if ( n_marks > n->max_time_marks ) {
+        int nmax = n_marks + 32;
+        struct time_mark *nmarks = realloc(n->time_marks, nmax*sizeof(struct time_mark));
+        if ( nmarks == NULL ) return;
+        n->time_marks = nmarks;
+        n->max_time_marks = nmax;
     }
-    g_object_unref(info);
-    return 1;
+
+    for ( i=0; i<n_marks; i++ ) {
+        int line = word_counts_find(n->word_counts, ceil((i+1)*wpm));
+        if ( line == word_counts_get_n_lines(n->word_counts) ) break;
+        n->time_marks[i].line = line;
+        n->time_marks[i].minutes = word_counts_sum(n->word_counts, line+1)/wpm;
+    }
+    n->n_time_marks = i;
 }
 
 
-static GFile *find_file(const char *filename, GFile *narrfile, GFile *imagestore)
+/* Loading happens in two stages.  First, the Markdown is parsed into a list
+ * of text runs and slides, which doesn't involve GTK and so can be done on a
+ * worker thread.  Then the text buffer is built from the list on the main
+ * thread, a batch of runs at a time. */
+struct load_item
 {
-    GFile *f;
-    GFile *parent_gfile;
-    char *parent;
-    int level;
+    gsize start;            /* Byte position in load_data.text */
+    gsize len;              /* Length in bytes */
+    int n_chars;
+    const char *block_tag;
+    int tags;               /* TB_BOLD etc */
+    Slide *slide;           /* If not NULL, this item is a slide, not text */
+    char *filename;         /* For the slide, as written in the narrative */
+};
+
 
-    if ( strstr(filename, "://") != NULL ) {
-        return g_file_new_for_uri(filename);
+struct load_data
+{
+    GString *text;
+    GArray *items;
+};
+
+
+static void free_load_data(struct load_data *ld)
+{
+    int i;
+    for ( i=0; i<ld->items->len; i++ ) {
+        struct load_item *item = &g_array_index(ld->items, struct load_item, i);
+        if ( item->slide != NULL ) slide_free(item->slide);
+        free(item->filename);
     }
+    g_array_free(ld->items, TRUE);
+    g_string_free(ld->text, TRUE);
+    free(ld);
+}
 
-    f = g_file_new_for_commandline_arg(filename);
-    if ( g_file_exists(f) ) return f;
-    g_object_unref(f);
 
-    parent_gfile = g_file_dup(narrfile);
-    for ( level=0; level<3; level++ ) {
+static struct load_data *new_load_data(void)
+{
+    struct load_data *ld = malloc(sizeof(struct load_data));
+    if ( ld == NULL ) return NULL;
+    ld->text = g_string_new(NULL);
+    ld->items = g_array_new(FALSE, FALSE, sizeof(struct load_item));
+    return ld;
+}
 
-        GFile *old_parent = parent_gfile;
-        parent_gfile = g_file_get_parent(old_parent);
-        g_object_unref(old_parent);
 
-        parent = g_file_get_path(parent_gfile);
-        if ( parent != NULL ) {
-            f = g_file_new_for_commandline_arg_and_cwd(filename, parent);
-            if ( g_file_exists(f) ) return f;
-            g_object_unref(f);
+/* Adjacent runs with the same formatting are merged */
+static void add_text_item(struct load_data *ld, const char *text, size_t len,
+                          const char *block_tag, int tags)
+{
+    struct load_item item;
+
+    if ( ld->items->len > 0 ) {
+        struct load_item *last = &g_array_index(ld->items, struct load_item,
+                                                ld->items->len-1);
+        if ( (last->slide == NULL) && (last->block_tag == block_tag)
+          && (last->tags == tags) )
+        {
+            g_string_append_len(ld->text, text, len);
+            last->len += len;
+            last->n_chars += g_utf8_strlen(text, len);
+            return;
         }
-        g_free(parent);
     }
-    g_object_unref(parent_gfile);
 
-    if ( imagestore != NULL ) {
-        f = g_file_resolve_relative_path(imagestore, filename);
-        if ( g_file_exists(f) ) return f;
-        g_object_unref(f);
-    }
+    item.start = ld->text->len;
+    item.len = len;
+    item.n_chars = g_utf8_strlen(text, len);
+    item.block_tag = block_tag;
+    item.tags = tags;
+    item.slide = NULL;
+    item.filename = NULL;
+    g_string_append_len(ld->text, text, len);
+    g_array_append_val(ld->items, item);
+}
 
-    fprintf(stderr, "%s not found!\n", filename);
 
-    return g_file_new_for_path(filename);
+/* The file will be filled in when all the filenames are known */
+static void add_slide_item(struct load_data *ld, Slide *slide, const char *filename)
+{
+    struct load_item item;
+    item.start = ld->text->len;
+    item.len = 0;
+    item.n_chars = 0;
+    item.block_tag = NULL;
+    item.tags = 0;
+    item.slide = slide;
+    item.filename = strdup(filename);
+    g_array_append_val(ld->items, item);
 }
 
 
-static int add_slide(Narrative *n, Slide *slide)
+#ifdef HAVE_MD4C
+
+enum narrative_item_type
 {
-    GtkTextIter start;
+    NARRATIVE_ITEM_TEXT,
+    NARRATIVE_ITEM_SEGSTART,
+    NARRATIVE_ITEM_SEGEND,
+    NARRATIVE_ITEM_PRESTITLE,
+    NARRATIVE_ITEM_SLIDE,
+    NARRATIVE_ITEM_BP,
+    NARRATIVE_ITEM_EOP,
+    NARRATIVE_ITEM_CODE,
+};
 
-    if ( n->n_slides == n->max_slides ) {
-        int nmax_slides = n->max_slides*2;
-        Slide **nslides = realloc(n->slides, nmax_slides*sizeof(Slide *));
-        if ( nslides == NULL ) {
-            fprintf(stderr, "Failed to add slide\n");
-            return 1;
-        }
-        n->max_slides = nmax_slides;
-        n->slides = nslides;
+
+struct code_block {
+    int used;
+    char *filename;
+    int page;
+    char **hide_elements;
+    int n_hide;
+    int max_hide;
+};
+
+
+static void clear_code_block(struct code_block *cb)
+{
+    int i;
+
+    if ( cb->used == 1 ) {
+        fprintf(stderr, "Clearing a used code block\n");
+    }
+
+    for ( i=0; i<cb->n_hide; i++ ) {
+        free(cb->hide_elements[i]);
     }
-    n->slides[n->n_slides++] = slide;
+    cb->n_hide = 0;
 
-    gtk_text_buffer_get_end_iter(n->textbuf, &start);
-    insert_slide_anchor(n->textbuf, slide, start, 0);
-    return 0;
+    free(cb->filename);
+    cb->filename = NULL;
+    cb->page = 0;
 }
 
 
+struct md_parse_ctx {
+    struct load_data *ld;
+    GCancellable *cancellable;
+    FileResolver *resolver;
+    enum narrative_item_type type;
+    int bold;
+    int italic;
+    int underline;
+    int need_newline;
+    struct code_block cb;
+};
+
+
 static int md_enter_block(MD_BLOCKTYPE type, void *detail, void *vp)
 {
     struct md_parse_ctx *ps = vp;
@@ -777,13 +1101,10 @@ static void handle_code_block(struct md_parse_ctx *ps)
     if ( cb->filename != NULL ) {
 
         Slide *slide = slide_new();
-        slide_set_ext_file(slide, find_file(cb->filename, ps->nfile, ps->imagestore));
         slide_set_ext_number(slide, cb->page);
         slide_set_hidden_elements(slide, cb->hide_elements, cb->n_hide);
-        if ( add_slide(ps->n, slide) ) {
-            fprintf(stderr, "Failed to add slide\n");
-            return;
-        }
+        add_slide_item(ps->ld, slide, cb->filename);
+        file_resolver_add(ps->resolver, cb->filename);
     }
 
     ps->cb.used = 0;
@@ -839,10 +1160,10 @@ static int md_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE len, void *vp)
 {
     struct md_parse_ctx *ps = vp;
 
+    if ( g_cancellable_is_cancelled(ps->cancellable) ) return 1;
+
     if ( ps->need_newline ) {
-        GtkTextIter end;
-        gtk_text_buffer_get_end_iter(ps->n->textbuf, &end);
-        gtk_text_buffer_insert(ps->n->textbuf, &end, "\n", -1);
+        add_text_item(ps->ld, "\n", 1, NULL, 0);
         ps->need_newline = 0;
     }
 
@@ -855,13 +1176,9 @@ static int md_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE len, void *vp)
         if ( strlen(sc) < 3 ) return 1;
 
         Slide *slide = slide_new();
-        slide_set_ext_file(slide, find_file(sc+2, ps->nfile, ps->imagestore));
         slide_set_ext_number(slide, atoi(tx));
-
-        if ( add_slide(ps->n, slide) ) {
-            fprintf(stderr, "Failed to add slide\n");
-            return 1;
-        }
+        add_slide_item(ps->ld, slide, sc+2);
+        file_resolver_add(ps->resolver, sc+2);
 
         free(tx);
 
@@ -871,31 +1188,12 @@ static int md_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE len, void *vp)
 
     } else {
 
-        GtkTextIter start_iter, end_iter;
-        int start_offset;
-
-        gtk_text_buffer_get_end_iter(ps->n->textbuf, &end_iter);
-        start_offset = gtk_text_iter_get_offset(&end_iter);
-
-        const char *tn = block_tag_name(ps);
-        if ( tn == NULL ) {
-            gtk_text_buffer_insert(ps->n->textbuf, &end_iter, text, len);
-        } else {
-            gtk_text_buffer_insert_with_tags_by_name(ps->n->textbuf, &end_iter, text, len,
-                                                     block_tag_name(ps), NULL);
-        }
+        int tags = 0;
+        if ( ps->bold ) tags |= TB_BOLD;
+        if ( ps->italic ) tags |= TB_ITALIC;
+        if ( ps->underline ) tags |= TB_UNDERLINE;
+        add_text_item(ps->ld, text, len, block_tag_name(ps), tags);
 
-        gtk_text_buffer_get_iter_at_offset(ps->n->textbuf, &start_iter, start_offset);
-
-        if ( ps->bold ) {
-            gtk_text_buffer_apply_tag_by_name(ps->n->textbuf, "bold", &start_iter, &end_iter);
-        }
-        if ( ps->italic ) {
-            gtk_text_buffer_apply_tag_by_name(ps->n->textbuf, "italic", &start_iter, &end_iter);
-        }
-        if ( ps->underline ) {
-            gtk_text_buffer_apply_tag_by_name(ps->n->textbuf, "underline", &start_iter, &end_iter);
-        }
     }
 
     return 0;
@@ -922,17 +1220,44 @@ const struct MD_PARSER md_parser =
 };
 
 
-static Narrative *parse_md_narrative(const char *text, size_t len, GFile *nfile)
+/* All the files are looked for at once, each of them only once.
+ * Returns non-zero if cancelled. */
+static int resolve_slide_files(struct load_data *ld, FileResolver *fr,
+                               GCancellable *cancellable)
+{
+    int i;
+
+    if ( file_resolver_run(fr, cancellable) ) return 1;
+
+    for ( i=0; i<ld->items->len; i++ ) {
+        struct load_item *item = &g_array_index(ld->items, struct load_item, i);
+        GFile *file;
+        if ( item->slide == NULL ) continue;
+        file = file_resolver_get(fr, item->filename);
+        slide_set_ext_file(item->slide, file);
+        g_object_unref(file);
+    }
+    return 0;
+}
+
+
+/* Can be called from any thread.  Returns NULL on failure, or if
+ * 'cancellable' is cancelled */
+static struct load_data *parse_md_narrative(const char *text, size_t len, GFile *nfile,
+                                            GFile *imagestore, GCancellable *cancellable)
 {
     struct md_parse_ctx pstate;
+    int r;
 
-    pstate.n = narrative_new();
+    pstate.ld = new_load_data();
+    if ( pstate.ld == NULL ) return NULL;
+    pstate.cancellable = cancellable;
     pstate.bold = 0;
     pstate.italic = 0;
     pstate.underline = 0;
     pstate.type = NARRATIVE_ITEM_TEXT;
     pstate.need_newline = 0;
-    pstate.nfile = nfile;
+    pstate.resolver = file_resolver_new(nfile, imagestore);
     pstate.cb.filename = NULL;
     pstate.cb.max_hide = 16;
     pstate.cb.hide_elements = malloc(pstate.cb.max_hide*sizeof(char *));
@@ -940,20 +1265,28 @@ static Narrative *parse_md_narrative(const char *text, size_t len, GFile *nfile)
     pstate.cb.page = 0;
     pstate.cb.used = 0;
 
-    GSettings *settings = g_settings_new("uk.me.bitwiz.colloquium");
-    pstate.imagestore = imagestore_as_gfile(settings);
-    g_object_unref(settings);
+    r = md_parse(text, len, &md_parser, &pstate);
+    free(pstate.cb.hide_elements);
 
-    gtk_text_buffer_begin_irreversible_action(pstate.n->textbuf);
-    md_parse(text, len, &md_parser, &pstate);
-    gtk_text_buffer_end_irreversible_action(pstate.n->textbuf);
+    if ( (r != 0) && g_cancellable_is_cancelled(cancellable) ) {
+        file_resolver_free(pstate.resolver);
+        free_load_data(pstate.ld);
+        return NULL;
+    }
 
-    return pstate.n;
+    if ( resolve_slide_files(pstate.ld, pstate.resolver, cancellable) ) {
+        file_resolver_free(pstate.resolver);
+        free_load_data(pstate.ld);
+        return NULL;
+    }
+    file_resolver_free(pstate.resolver);
+    return pstate.ld;
 }
 
 #else  // HAVE_MD4C
 
-static Narrative *parse_md_narrative(const char *text, size_t len, GFile *nfile)
+static struct load_data *parse_md_narrative(const char *text, size_t len, GFile *nfile,
+                                            GFile *imagestore, GCancellable *cancellable)
 {
     return NULL;
 }
@@ -961,25 +1294,380 @@ static Narrative *parse_md_narrative(const char *text, size_t len, GFile *nfile)
 #endif
 
 
-Narrative *narrative_load(GFile *file)
+void insert_slide_anchor(GtkTextBuffer *buf, Slide *slide, GtkTextIter start, int newline)
+{
+    GtkTextIter end;
+    GtkTextMark *mark;
+
+    /* Mark this position for later */
+    mark = gtk_text_mark_new(NULL, TRUE);
+    gtk_text_buffer_add_mark(buf, mark, &start);
+
+    /* Insert the slide's anchor, which will add it to the slide index */
+    slide->anchor = gtk_text_child_anchor_new();
+    g_object_set_data(G_OBJECT(slide->anchor), "slide", slide);
+    gtk_text_buffer_insert_child_anchor(buf, &start, slide->anchor);
+    g_object_unref(slide->anchor);  /* Buffer holds a reference */
+
+    /* Retrieve the mark  and figure out positions before and after the slide */
+    gtk_text_buffer_get_iter_at_mark(buf, &end, mark);
+    start = end;
+    gtk_text_iter_forward_cursor_position(&end);
+    gtk_text_buffer_apply_tag_by_name(buf, "slide", &start, &end);
+
+    /* Retrieve the mark (again) and add a newline, if requested */
+    if ( newline ) {
+        gtk_text_buffer_get_iter_at_mark(buf, &end, mark);
+        gtk_text_iter_forward_cursor_position(&end);
+        gtk_text_buffer_insert(buf, &end, "\n", 1);
+    }
+
+    /* Mark is not needed any more */
+    gtk_text_buffer_delete_mark(buf, mark);
+}
+
+
+static int add_slide(Narrative *n, Slide *slide)
+{
+    GtkTextIter start;
+
+    if ( n->n_slides == n->max_slides ) {
+        int nmax_slides = n->max_slides*2;
+        Slide **nslides = realloc(n->slides, nmax_slides*sizeof(Slide *));
+        if ( nslides == NULL ) {
+            fprintf(stderr, "Failed to add slide\n");
+            return 1;
+        }
+        n->max_slides = nmax_slides;
+        n->slides = nslides;
+    }
+    n->slides[n->n_slides++] = slide;
+
+    gtk_text_buffer_get_end_iter(n->textbuf, &start);
+    insert_slide_anchor(n->textbuf, slide, start, 0);
+    return 0;
+}
+
+
+/* Up to this many runs are inserted into the buffer in one go */
+#define MAX_BATCH (1024)
+
+static void build_text(Narrative *n, struct load_data *ld, int first, int last)
+{
+    GtkTextIter start, end;
+    GtkTextTag *tags[3];
+    int base;
+    int i;
+    int offs;
+    struct load_item *fi = &g_array_index(ld->items, struct load_item, first);
+    struct load_item *li = &g_array_index(ld->items, struct load_item, last-1);
+
+    tags[0] = lookup_tag(n->textbuf, "bold");
+    tags[1] = lookup_tag(n->textbuf, "italic");
+    tags[2] = lookup_tag(n->textbuf, "underline");
+
+    gtk_text_buffer_get_end_iter(n->textbuf, &end);
+    base = gtk_text_iter_get_offset(&end);
+    gtk_text_buffer_insert(n->textbuf, &end, ld->text->str + fi->start,
+                           li->start + li->len - fi->start);
+
+    offs = base;
+    for ( i=first; i<last; i++ ) {
+
+        struct load_item *item = &g_array_index(ld->items, struct load_item, i);
+
+        if ( (item->block_tag != NULL) || (item->tags != 0) ) {
+
+            int j;
+
+            gtk_text_buffer_get_iter_at_offset(n->textbuf, &start, offs);
+            gtk_text_buffer_get_iter_at_offset(n->textbuf, &end, offs+item->n_chars);
+
+            if ( item->block_tag != NULL ) {
+                gtk_text_buffer_apply_tag_by_name(n->textbuf, item->block_tag,
+                                                  &start, &end);
+            }
+            for ( j=0; j<3; j++ ) {
+                if ( item->tags & (1<<j) ) {
+                    gtk_text_buffer_apply_tag(n->textbuf, tags[j], &start, &end);
+                }
+            }
+        }
+
+        offs += item->n_chars;
+    }
+}
+
+
+/* Builds the buffer from item number 'pos' onwards, until 'deadline' (in
+ * terms of g_get_monotonic_time()) if it's positive.  Returns the position
+ * to carry on from. */
+static int build_buffer(Narrative *n, struct load_data *ld, int pos, gint64 deadline)
+{
+    while ( pos < ld->items->len ) {
+
+        struct load_item *item = &g_array_index(ld->items, struct load_item, pos);
+
+        if ( item->slide != NULL ) {
+            add_slide(n, item->slide);
+            item->slide = NULL;  /* Belongs to the narrative now */
+            pos++;
+        } else {
+            int last = pos;
+            while ( (last < ld->items->len) && (last-pos < MAX_BATCH)
+                 && (g_array_index(ld->items, struct load_item, last).slide == NULL) )
+            {
+                last++;
+            }
+            build_text(n, ld, pos, last);
+            pos = last;
+        }
+
+        if ( (deadline > 0) && (g_get_monotonic_time() > deadline) ) break;
+    }
+    return pos;
+}
+
+
+static GFile *get_imagestore(void)
+{
+    GSettings *settings = g_settings_new("uk.me.bitwiz.colloquium");
+    GFile *imagestore = imagestore_as_gfile(settings);
+    g_object_unref(settings);
+    return imagestore;
+}
+
+
+static struct load_data *read_and_parse(GFile *file, GFile *imagestore,
+                                        GCancellable *cancellable)
 {
     GBytes *bytes;
     const char *text;
     size_t len;
-    Narrative *n;
+    struct load_data *ld;
 
-    bytes = g_file_load_bytes(file, NULL, NULL, NULL);
+    bytes = g_file_load_bytes(file, cancellable, NULL, NULL);
     if ( bytes == NULL ) return NULL;
 
     text = g_bytes_get_data(bytes, &len);
-    n = parse_md_narrative(text, len, file);
+    ld = parse_md_narrative(text, len, file, imagestore, cancellable);
     g_bytes_unref(bytes);
+    return ld;
+}
+
+
+static Narrative *start_build(void)
+{
+    Narrative *n = narrative_new();
     if ( n == NULL ) return NULL;
+    gtk_text_buffer_begin_irreversible_action(n->textbuf);
+    return n;
+}
+
+
+static void finish_build(Narrative *n)
+{
+    gtk_text_buffer_end_irreversible_action(n->textbuf);
+
+    /* The tags are already tidy */
+    n->dirty = 0;
+}
+
+
+Narrative *narrative_load(GFile *file)
+{
+    struct load_data *ld;
+    Narrative *n;
+    GFile *imagestore;
 
+    imagestore = get_imagestore();
+    ld = read_and_parse(file, imagestore, NULL);
+    if ( imagestore != NULL ) g_object_unref(imagestore);
+    if ( ld == NULL ) return NULL;
+
+    n = start_build();
+    if ( n != NULL ) {
+        build_buffer(n, ld, 0, 0);
+        finish_build(n);
+    }
+    free_load_data(ld);
     return n;
 }
 
 
+/* Reads only the slides, in presentation order, without building a text
+ * buffer.  Doesn't touch GTK, so can be used without a display and from any
+ * thread.  Returns NULL on failure.  Free the result with
+ * narrative_free_slides(). */
+Slide **narrative_load_slides(GFile *file, int *n_slides)
+{
+    struct load_data *ld;
+    GFile *imagestore;
+    Slide **slides;
+    int i, n;
+
+    imagestore = get_imagestore();
+    ld = read_and_parse(file, imagestore, NULL);
+    if ( imagestore != NULL ) g_object_unref(imagestore);
+    if ( ld == NULL ) return NULL;
+
+    slides = malloc(ld->items->len*sizeof(Slide *));
+    if ( (slides == NULL) && (ld->items->len > 0) ) {
+        free_load_data(ld);
+        return NULL;
+    }
+
+    n = 0;
+    for ( i=0; i<ld->items->len; i++ ) {
+        struct load_item *item = &g_array_index(ld->items, struct load_item, i);
+        if ( item->slide == NULL ) continue;
+        slides[n++] = item->slide;
+        item->slide = NULL;
+    }
+    free_load_data(ld);
+
+    *n_slides = n;
+    return slides;
+}
+
+
+void narrative_free_slides(Slide **slides, int n_slides)
+{
+    int i;
+    for ( i=0; i<n_slides; i++ ) {
+        slide_free(slides[i]);
+    }
+    free(slides);
+}
+
+
+/* An asynchronous version of narrative_load(), which parses the file on a
+ * worker thread and then builds the narrative on the main thread in small
+ * steps.  The window stays responsive in the meantime. */
+struct _narrativeload
+{
+    GFile *file;
+    GFile *imagestore;
+    GCancellable *cancellable;
+    struct load_data *ld;
+    Narrative *n;
+    int pos;
+    NarrativeLoadProgressFunc progress;
+    NarrativeLoadDoneFunc done;
+    gpointer vp;
+};
+
+
+static void free_load(NarrativeLoad *nl)
+{
+    if ( nl->ld != NULL ) free_load_data(nl->ld);
+    if ( nl->n != NULL ) {
+        gtk_text_buffer_end_irreversible_action(nl->n->textbuf);
+        narrative_free(nl->n);
+    }
+    g_object_unref(nl->file);
+    if ( nl->imagestore != NULL ) g_object_unref(nl->imagestore);
+    g_object_unref(nl->cancellable);
+    free(nl);
+}
+
+
+static gboolean build_step(gpointer vp)
+{
+    NarrativeLoad *nl = vp;
+    Narrative *n;
+
+    if ( g_cancellable_is_cancelled(nl->cancellable) ) {
+        free_load(nl);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* Short enough to keep the main loop going smoothly */
+    nl->pos = build_buffer(nl->n, nl->ld, nl->pos, g_get_monotonic_time()+10000);
+
+    if ( nl->pos < nl->ld->items->len ) {
+        if ( nl->progress != NULL ) {
+            nl->progress((double)nl->pos/nl->ld->items->len, nl->vp);
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
+    n = nl->n;
+    nl->n = NULL;
+    finish_build(n);
+    nl->done(n, nl->vp);
+    free_load(nl);
+    return G_SOURCE_REMOVE;
+}
+
+
+static gboolean parse_done(gpointer vp)
+{
+    NarrativeLoad *nl = vp;
+
+    if ( g_cancellable_is_cancelled(nl->cancellable) ) {
+        free_load(nl);
+        return G_SOURCE_REMOVE;
+    }
+
+    if ( nl->ld != NULL ) nl->n = start_build();
+    if ( nl->n == NULL ) {
+        nl->done(NULL, nl->vp);
+        free_load(nl);
+        return G_SOURCE_REMOVE;
+    }
+
+    nl->pos = 0;
+    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, build_step, nl, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+
+static gpointer parse_thread(gpointer vp)
+{
+    NarrativeLoad *nl = vp;
+    nl->ld = read_and_parse(nl->file, nl->imagestore, nl->cancellable);
+    g_idle_add(parse_done, nl);
+    return NULL;
+}
+
+
+/* Call from the main thread.  'done' will be called with the new narrative,
+ * or NULL if loading failed, unless the load is cancelled first.  'progress'
+ * (if not NULL) is called from time to time with the fraction done. */
+NarrativeLoad *narrative_load_async(GFile *file, NarrativeLoadProgressFunc progress,
+                                    NarrativeLoadDoneFunc done, gpointer vp)
+{
+    NarrativeLoad *nl;
+    GThread *thread;
+
+    nl = malloc(sizeof(NarrativeLoad));
+    if ( nl == NULL ) return NULL;
+
+    nl->file = g_object_ref(file);
+    nl->imagestore = get_imagestore();
+    nl->cancellable = g_cancellable_new();
+    nl->ld = NULL;
+    nl->n = NULL;
+    nl->pos = 0;
+    nl->progress = progress;
+    nl->done = done;
+    nl->vp = vp;
+
+    thread = g_thread_new("narrative-load", parse_thread, nl);
+    g_thread_unref(thread);
+    return nl;
+}
+
+
+/* Call from the main thread only.  Neither callback will be called after
+ * this, and 'nl' must not be used again. */
+void narrative_load_cancel(NarrativeLoad *nl)
+{
+    g_cancellable_cancel(nl->cancellable);
+}
+
+
 GtkTextTag *lookup_tag(GtkTextBuffer *buf, const char *name)
 {
     GtkTextTagTable *table = gtk_text_buffer_get_tag_table(buf);
@@ -989,47 +1677,73 @@ GtkTextTag *lookup_tag(GtkTextBuffer *buf, const char *name)
 
 Slide *narrative_get_first_slide(Narrative *nar)
 {
-    GtkTextIter iter;
+    return narrative_get_slide(nar, 0);
+}
 
-    gtk_text_buffer_get_start_iter(nar->textbuf, &iter);
-    if ( gtk_text_iter_forward_to_tag_toggle(&iter, lookup_tag(nar->textbuf, "slide")) ) {
 
-        guint n;
-        GtkWidget **th;
-        GtkTextChildAnchor *anc;
-        Slide *slide;
+int narrative_count_slides(Narrative *n)
+{
+    return n->slide_index->len;
+}
 
-        anc = gtk_text_iter_get_child_anchor(&iter);
-        if ( anc == NULL ) {
-            fprintf(stderr, "No anchor found despite slide tag!\n");
-            return NULL;
-        }
-        th = gtk_text_child_anchor_get_widgets(anc, &n);
-        assert(n == 1);
-        slide = thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(th[0]));
-        g_free(th);
-        return slide;
-    }
-    return NULL;
+
+/* The i'th slide in presentation order, or NULL if out of range */
+Slide *narrative_get_slide(Narrative *n, int i)
+{
+    if ( (i < 0) || (i >= n->slide_index->len) ) return NULL;
+    return g_ptr_array_index(n->slide_index, i);
 }
 
 
-void narrative_fixup_tags(Narrative *n)
+/* The position in presentation order of the first slide at or after 'pos'.
+ * The slide before 'pos' is one less. */
+int narrative_slide_index_at(Narrative *n, GtkTextIter *pos)
+{
+    return index_search(n, gtk_text_iter_get_offset(pos));
+}
+
+
+/* The slide whose anchor is at 'iter', or NULL */
+Slide *narrative_slide_at_iter(GtkTextIter *iter)
+{
+    GtkTextChildAnchor *anc = gtk_text_iter_get_child_anchor(iter);
+    if ( anc == NULL ) return NULL;
+    return g_object_get_data(G_OBJECT(anc), "slide");
+}
+
+
+/* Makes the line-only tags cover whole lines, for the lines from 'pos' up to
+ * 'end' */
+static void fixup_tags(Narrative *n, GtkTextIter pos, GtkTextIter end)
 {
-    GtkTextIter pos;
     const int n_line_only_tags = 3;
     GtkTextTag *line_only_tags[n_line_only_tags];
+    int end_offset;
+    int i;
 
     GtkTextTagTable *table = gtk_text_buffer_get_tag_table(n->textbuf);
     line_only_tags[0] = gtk_text_tag_table_lookup(table, "segstart");
     line_only_tags[1] = gtk_text_tag_table_lookup(table, "prestitle");
     line_only_tags[2] = gtk_text_tag_table_lookup(table, "bulletpoint");
 
-    gtk_text_buffer_get_start_iter(n->textbuf, &pos);
+    gtk_text_iter_set_line_offset(&pos, 0);
+    if ( !gtk_text_iter_ends_line(&end) ) gtk_text_iter_forward_to_line_end(&end);
+
+    /* A tag which started on an earlier line might now run into this one */
+    for ( i=0; i<n_line_only_tags; i++ ) {
+        GtkTextTag *tag = line_only_tags[i];
+        if ( gtk_text_iter_has_tag(&pos, tag) && !gtk_text_iter_starts_tag(&pos, tag) ) {
+            GtkTextIter tag_start = pos;
+            gtk_text_iter_backward_to_tag_toggle(&tag_start, tag);
+            gtk_text_iter_set_line_offset(&tag_start, 0);
+            if ( gtk_text_iter_compare(&tag_start, &pos) < 0 ) pos = tag_start;
+        }
+    }
 
-    do {
+    /* Tagging doesn't change any offsets */
+    end_offset = gtk_text_iter_get_offset(&end);
 
-        int i;
+    do {
 
         for ( i=0; i<n_line_only_tags; i++ ) {
 
@@ -1062,5 +1776,30 @@ void narrative_fixup_tags(Narrative *n)
             }
         }
 
-    } while ( gtk_text_iter_forward_to_tag_toggle(&pos, NULL) );
+    } while ( gtk_text_iter_forward_to_tag_toggle(&pos, NULL)
+           && (gtk_text_iter_get_offset(&pos) <= end_offset) );
+}
+
+
+/* Fixes up the tags on the lines which have been edited since last time */
+void narrative_fixup_tags(Narrative *n)
+{
+    GtkTextIter start, end;
+
+    if ( !n->dirty ) return;
+    n->dirty = 0;
+
+    gtk_text_buffer_get_iter_at_mark(n->textbuf, &start, n->dirty_start);
+    gtk_text_buffer_get_iter_at_mark(n->textbuf, &end, n->dirty_end);
+    fixup_tags(n, start, end);
+}
+
+
+void narrative_fixup_all_tags(Narrative *n)
+{
+    GtkTextIter start, end;
+
+    n->dirty = 0;
+    gtk_text_buffer_get_bounds(n->textbuf, &start, &end);
+    fixup_tags(n, start, end);
 }
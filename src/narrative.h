@@ -32,11 +32,14 @@
 typedef struct _narrative Narrative;
 
 #include "slide.h"
+#include "wordcounts.h"
 
+/* Screen positions are left to the narrative window, so that only the
+ * visible part of the text needs to be laid out */
 struct time_mark
 {
     double minutes;
-    double y;
+    int line;
 };
 
 
@@ -50,9 +53,28 @@ struct _narrative
     int max_slides;
     Slide **slides;
 
+    /* ... but these are, and are kept up to date as the text changes */
+    GPtrArray *slide_index;
+
+    WordCounts *word_counts;
+
+    /* Lines which need narrative_fixup_tags() */
+    int dirty;
+    GtkTextMark *dirty_start;
+    GtkTextMark *dirty_end;
+
     struct time_mark *time_marks;
     int n_time_marks;
+    int max_time_marks;
     double total_minutes;
+
+    /* The highlighted line, or NULL if nothing has been highlighted yet */
+    GtkTextMark *highlight_start;
+    GtkTextMark *highlight_end;
+
+    /* Background saves, oldest first */
+    struct save_ctx *save_head;
+    struct save_ctx *save_tail;
 };
 
 
@@ -60,14 +82,37 @@ extern Narrative *narrative_new(void);
 extern void narrative_free(Narrative *n);
 
 extern Narrative *narrative_load(GFile *file);
+extern Slide **narrative_load_slides(GFile *file, int *n_slides);
+extern void narrative_free_slides(Slide **slides, int n_slides);
+
+typedef struct _narrativeload NarrativeLoad;
+typedef void (*NarrativeLoadProgressFunc)(double fraction, gpointer vp);
+typedef void (*NarrativeLoadDoneFunc)(Narrative *n, gpointer vp);
+
+extern NarrativeLoad *narrative_load_async(GFile *file,
+                                           NarrativeLoadProgressFunc progress,
+                                           NarrativeLoadDoneFunc done, gpointer vp);
+extern void narrative_load_cancel(NarrativeLoad *nl);
 extern int narrative_save(Narrative *n, GFile *file);
+extern GBytes *narrative_serialise(Narrative *n, GFile *dir, GFile *imagestore);
+
+typedef void (*NarrativeSaveDoneFunc)(int r, gpointer vp);
+
+extern void narrative_save_async(Narrative *n, GFile *file,
+                                 NarrativeSaveDoneFunc done, gpointer vp);
 
 extern void insert_slide_anchor(GtkTextBuffer *buf, Slide *slide, GtkTextIter start, int newline);
-extern void narrative_update_timing(GtkTextView *nv, Narrative *n, double wpm);
+extern void narrative_update_timing(Narrative *n, double wpm);
+extern void narrative_set_highlight(Narrative *n, GtkTextIter *pos);
 
 extern GtkTextTag *lookup_tag(GtkTextBuffer *buf, const char *name);
 extern Slide *narrative_get_first_slide(Narrative *nar);
+extern int narrative_count_slides(Narrative *n);
+extern Slide *narrative_get_slide(Narrative *n, int i);
+extern int narrative_slide_index_at(Narrative *n, GtkTextIter *pos);
+extern Slide *narrative_slide_at_iter(GtkTextIter *iter);
 
 extern void narrative_fixup_tags(Narrative *n);
+extern void narrative_fixup_all_tags(Narrative *n);
 
 #endif /* NARRATIVE_H */
@@ -39,9 +39,13 @@
 #include "narrative_window.h"
 #include "slide_window.h"
 #include "pdfexport.h"
+#include "handout.h"
+#include "htmlexport.h"
 #include "timer.h"
 #include "timer_window.h"
 #include "thumbnailwidget.h"
+#include "prefetch.h"
+#include "slidepaintable.h"
 
 G_DEFINE_FINAL_TYPE(NarrativeWindow, colloquium_narrative_window, GTK_TYPE_APPLICATION_WINDOW)
 
@@ -66,16 +70,22 @@ static int num_items_to_eop(Narrative *n)
 }
 
 
-static void show_error(NarrativeWindow *nw, const char *err)
+static void show_message(NarrativeWindow *nw, const char *msg)
 {
     GtkAlertDialog *mw;
     const char *buttons[2] = {"Close", NULL};
-    mw = gtk_alert_dialog_new("%s", err);
+    mw = gtk_alert_dialog_new("%s", msg);
     gtk_alert_dialog_set_buttons(mw, buttons);
     gtk_alert_dialog_show(mw, GTK_WINDOW(nw));
 }
 
 
+static void show_error(NarrativeWindow *nw, const char *err)
+{
+    show_message(nw, err);
+}
+
+
 char *narrative_window_get_filename(NarrativeWindow *nw)
 {
     char *filename;
@@ -130,6 +140,16 @@ void slide_window_closed_sig(GtkWidget *sw, NarrativeWindow *nw)
 }
 
 
+static void save_done(int r, gpointer vp)
+{
+    NarrativeWindow *nw = vp;
+    if ( r ) {
+        show_error(nw, _("Failed to save presentation"));
+    }
+    g_object_unref(nw);
+}
+
+
 static void saveas_response_sig(GObject *d, GAsyncResult *res, gpointer vp)
 {
     NarrativeWindow *nw = vp;
@@ -138,9 +158,7 @@ static void saveas_response_sig(GObject *d, GAsyncResult *res, gpointer vp)
     file = gtk_file_dialog_save_finish(GTK_FILE_DIALOG(d), res, NULL);
     if ( file == NULL ) return;
 
-    if ( narrative_save(nw->n, file) ) {
-        show_error(nw, _("Failed to save presentation"));
-    }
+    narrative_save_async(nw->n, file, save_done, g_object_ref(nw));
 
     if ( nw->file != file ) {
         if ( nw->file != NULL ) g_object_unref(nw->file);
@@ -169,17 +187,181 @@ static void saveas_sig(GSimpleAction *action, GVariant *parameter, gpointer vp)
 }
 
 
+/* Progress and cancellation for the background exports.  The finish function
+ * can also give a message to show afterwards, or set 'message' to NULL. */
+typedef int (*ExportFinishFunc)(GAsyncResult *res, char **message, GError **error);
+
+struct export_ctx
+{
+    NarrativeWindow *nw;
+    ExportFinishFunc finish;
+    GCancellable *cancellable;
+    GtkWidget *window;
+    GtkWidget *bar;
+    GtkWidget *button;
+};
+
+
+static void export_progress(double fraction, gpointer vp)
+{
+    struct export_ctx *ctx = vp;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ctx->bar), fraction);
+}
+
+
+static void export_done(GObject *source, GAsyncResult *res, gpointer vp)
+{
+    struct export_ctx *ctx = vp;
+    GError *error = NULL;
+    char *message = NULL;
+
+    if ( ctx->finish(res, &message, &error) ) {
+        if ( !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ) {
+            fprintf(stderr, _("Export failed: %s\n"), error->message);
+            show_error(ctx->nw, _("Failed to export presentation"));
+        }
+        g_error_free(error);
+    } else if ( message != NULL ) {
+        show_message(ctx->nw, message);
+        g_free(message);
+    }
+
+    gtk_window_destroy(GTK_WINDOW(ctx->window));
+    g_object_unref(ctx->cancellable);
+    g_object_unref(ctx->nw);
+    free(ctx);
+}
+
+
+static void cancel_export(struct export_ctx *ctx)
+{
+    /* The window goes away when the export has actually stopped */
+    g_cancellable_cancel(ctx->cancellable);
+    gtk_widget_set_sensitive(ctx->button, FALSE);
+}
+
+
+static void cancel_export_sig(GtkButton *button, struct export_ctx *ctx)
+{
+    cancel_export(ctx);
+}
+
+
+static gboolean export_close_request_sig(GtkWindow *window, struct export_ctx *ctx)
+{
+    cancel_export(ctx);
+    return TRUE;
+}
+
+
+static GtkWidget *export_progress_window(struct export_ctx *ctx, GFile *file,
+                                         const char *title)
+{
+    GtkWidget *window;
+    GtkWidget *box;
+    GtkWidget *label;
+    char *name;
+    char *text;
+
+    window = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(window), title);
+    gtk_window_set_default_size(GTK_WINDOW(window), 400, -1);
+    gtk_window_set_transient_for(GTK_WINDOW(window), GTK_WINDOW(ctx->nw));
+    gtk_window_set_modal(GTK_WINDOW(window), TRUE);
+
+    box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 8);
+    gtk_widget_set_margin_start(box, 16);
+    gtk_widget_set_margin_end(box, 16);
+    gtk_widget_set_margin_top(box, 16);
+    gtk_widget_set_margin_bottom(box, 16);
+    gtk_window_set_child(GTK_WINDOW(window), box);
+
+    name = g_file_get_basename(file);
+    text = g_strdup_printf(_("Exporting %s"), name);
+    label = gtk_label_new(text);
+    g_free(text);
+    g_free(name);
+    gtk_box_append(GTK_BOX(box), label);
+
+    ctx->bar = gtk_progress_bar_new();
+    gtk_box_append(GTK_BOX(box), ctx->bar);
+
+    ctx->button = gtk_button_new_with_label(_("Cancel"));
+    gtk_widget_set_halign(ctx->button, GTK_ALIGN_END);
+    gtk_box_append(GTK_BOX(box), ctx->button);
+
+    g_signal_connect(G_OBJECT(ctx->button), "clicked",
+                     G_CALLBACK(cancel_export_sig), ctx);
+    g_signal_connect(G_OBJECT(window), "close-request",
+                     G_CALLBACK(export_close_request_sig), ctx);
+
+    return window;
+}
+
+
+static struct export_ctx *start_export(NarrativeWindow *nw, GFile *file,
+                                       const char *title, ExportFinishFunc finish)
+{
+    struct export_ctx *ctx;
+
+    ctx = malloc(sizeof(struct export_ctx));
+    if ( ctx == NULL ) return NULL;
+
+    ctx->nw = g_object_ref(nw);
+    ctx->finish = finish;
+    ctx->cancellable = g_cancellable_new();
+    ctx->window = export_progress_window(ctx, file, title);
+    gtk_window_present(GTK_WINDOW(ctx->window));
+    return ctx;
+}
+
+
+static int finish_pdf_export(GAsyncResult *res, char **message, GError **error)
+{
+    int n_reused;
+
+    *message = NULL;
+    if ( export_pdf_finish(res, &n_reused, error) ) return 1;
+
+    /* Says why a repeated export was so quick */
+    if ( n_reused > 0 ) {
+        *message = g_strdup_printf(_("Exported the presentation.  %i slides "
+                                     "hadn't changed since the last export, "
+                                     "and were reused."), n_reused);
+    }
+    return 0;
+}
+
+
+static int finish_html_export(GAsyncResult *res, char **message, GError **error)
+{
+    *message = NULL;
+    return export_html_finish(res, error);
+}
+
+
+static int finish_handout_export(GAsyncResult *res, char **message, GError **error)
+{
+    *message = NULL;
+    return export_handout_finish(res, error);
+}
+
+
 static void exportpdf_response_sig(GObject *d, GAsyncResult *res, gpointer vp)
 {
     NarrativeWindow *nw = vp;
+    struct export_ctx *ctx;
     GFile *file;
 
     file = gtk_file_dialog_save_finish(GTK_FILE_DIALOG(d), res, NULL);
     if ( file == NULL ) return;
 
-    if ( export_pdf(nw->n, file) ) {
-        show_error(nw, _("Failed to save presentation"));
+    ctx = start_export(nw, file, _("Export as PDF"), finish_pdf_export);
+    if ( ctx != NULL ) {
+        export_pdf_async(nw->n, file, ctx->cancellable, export_progress, ctx,
+                         export_done, ctx);
     }
+    g_object_unref(file);
 }
 
 
@@ -198,6 +380,72 @@ static void exportpdf_sig(GSimpleAction *action, GVariant *parameter, gpointer v
 }
 
 
+static void exporthandout_response_sig(GObject *d, GAsyncResult *res, gpointer vp)
+{
+    NarrativeWindow *nw = vp;
+    struct export_ctx *ctx;
+    GFile *file;
+
+    file = gtk_file_dialog_save_finish(GTK_FILE_DIALOG(d), res, NULL);
+    if ( file == NULL ) return;
+
+    ctx = start_export(nw, file, _("Export handout as PDF"), finish_handout_export);
+    if ( ctx != NULL ) {
+        export_handout_async(nw->n, file, ctx->cancellable, export_progress, ctx,
+                             export_done, ctx);
+    }
+    g_object_unref(file);
+}
+
+
+static void exporthandout_sig(GSimpleAction *action, GVariant *parameter, gpointer vp)
+{
+    GtkFileDialog *d;
+    NarrativeWindow *nw = vp;
+
+    d = gtk_file_dialog_new();
+
+    gtk_file_dialog_set_title(d, _("Export handout as PDF"));
+    gtk_file_dialog_set_accept_label(d, _("Save"));
+
+    gtk_file_dialog_save(d, GTK_WINDOW(nw),
+                         NULL, exporthandout_response_sig, nw);
+}
+
+
+static void exporthtml_response_sig(GObject *d, GAsyncResult *res, gpointer vp)
+{
+    NarrativeWindow *nw = vp;
+    struct export_ctx *ctx;
+    GFile *dir;
+
+    dir = gtk_file_dialog_select_folder_finish(GTK_FILE_DIALOG(d), res, NULL);
+    if ( dir == NULL ) return;
+
+    ctx = start_export(nw, dir, _("Export as web page"), finish_html_export);
+    if ( ctx != NULL ) {
+        export_html_async(nw->n, dir, ctx->cancellable, export_progress, ctx,
+                          export_done, ctx);
+    }
+    g_object_unref(dir);
+}
+
+
+static void exporthtml_sig(GSimpleAction *action, GVariant *parameter, gpointer vp)
+{
+    GtkFileDialog *d;
+    NarrativeWindow *nw = vp;
+
+    d = gtk_file_dialog_new();
+
+    gtk_file_dialog_set_title(d, _("Export as web page"));
+    gtk_file_dialog_set_accept_label(d, _("Export"));
+
+    gtk_file_dialog_select_folder(d, GTK_WINDOW(nw),
+                                  NULL, exporthtml_response_sig, nw);
+}
+
+
 static void nw_about_sig(GSimpleAction *action, GVariant *parameter, gpointer vp)
 {
     NarrativeWindow *nw = vp;
@@ -213,9 +461,7 @@ static void save_sig(GSimpleAction *action, GVariant *parameter, gpointer vp)
         return saveas_sig(NULL, NULL, nw);
     }
 
-    if ( narrative_save(nw->n, nw->file) ) {
-        show_error(nw, _("Failed to save presentation"));
-    }
+    narrative_save_async(nw->n, nw->file, save_done, g_object_ref(nw));
 }
 
 
@@ -323,20 +569,72 @@ static void set_clock_pos(NarrativeWindow *nw)
 
 static void update_highlight(NarrativeWindow *nw)
 {
-    GtkTextIter start, end;
-    gtk_text_buffer_get_bounds(nw->n->textbuf, &start, &end);
-    gtk_text_buffer_remove_tag_by_name(nw->n->textbuf, "highlight", &start, &end);
+    GtkTextIter pos;
+    GtkTextBuffer *buf = nw->n->textbuf;
 
-    if ( !nw->presenting ) return;
+    if ( !nw->presenting ) {
+        narrative_set_highlight(nw->n, NULL);
+        return;
+    }
 
-    GtkTextMark *cursor;
-    cursor = gtk_text_buffer_get_insert(nw->n->textbuf);
-    gtk_text_buffer_get_iter_at_mark(nw->n->textbuf, &start, cursor);
+    gtk_text_buffer_get_iter_at_mark(buf, &pos, gtk_text_buffer_get_insert(buf));
+    narrative_set_highlight(nw->n, &pos);
+}
+
+
+/* Render the next few slides after the cursor, and the one before, at the
+ * sizes of the slide windows */
+static void update_prefetch(NarrativeWindow *nw)
+{
+    Slide **slides;
+    int widths[16];
+    int heights[16];
+    double scales[16];
+    int n_slides = 0;
+    int n_sizes = 0;
+    int n_ahead;
+    int i, pos;
+    GtkTextIter start;
+
+    n_ahead = g_settings_get_uint(nw->settings, "prefetch-slides");
+    slides = malloc((n_ahead+1)*sizeof(Slide *));
+    if ( slides == NULL ) return;
+
+    gtk_text_buffer_get_iter_at_mark(nw->n->textbuf, &start,
+                                     gtk_text_buffer_get_insert(nw->n->textbuf));
+
+    pos = narrative_slide_index_at(nw->n, &start);
+
+    for ( i=pos; (i<narrative_count_slides(nw->n)) && (n_slides<n_ahead); i++ ) {
+        Slide *s = narrative_get_slide(nw->n, i);
+        if ( s != nw->presenting_slide ) slides[n_slides++] = s;
+    }
 
-    end = start;
-    gtk_text_iter_forward_to_line_end(&end);
+    for ( i=pos-1; i>=0; i-- ) {
+        Slide *s = narrative_get_slide(nw->n, i);
+        if ( s != nw->presenting_slide ) {
+            slides[n_slides++] = s;
+            break;
+        }
+    }
 
-    gtk_text_buffer_apply_tag_by_name(nw->n->textbuf, "highlight", &start, &end);
+    for ( i=0; i<nw->n_slidewindows; i++ ) {
+        int j;
+        int w = gtk_widget_get_width(nw->slidewindows[i]->sv);
+        int h = gtk_widget_get_height(nw->slidewindows[i]->sv);
+        double scale = slide_paintable_widget_scale(nw->slidewindows[i]->sv);
+        for ( j=0; j<n_sizes; j++ ) {
+            if ( (widths[j] == w) && (heights[j] == h) && (scales[j] == scale) ) break;
+        }
+        if ( j == n_sizes ) {
+            widths[n_sizes] = w;
+            heights[n_sizes] = h;
+            scales[n_sizes++] = scale;
+        }
+    }
+
+    prefetcher_update(nw->prefetcher, slides, n_slides, widths, heights, scales, n_sizes);
+    free(slides);
 }
 
 
@@ -347,6 +645,7 @@ static void set_presenting_slide(NarrativeWindow *nw, Slide *s)
     for ( i=0; i<nw->n_slidewindows; i++ ) {
         slide_window_set_slide(nw->slidewindows[i], s);
     }
+    if ( nw->presenting ) update_prefetch(nw);
 }
 
 
@@ -363,7 +662,7 @@ static void advance_paragraph(NarrativeWindow *nw)
 {
     GtkTextMark *cursor;
     GtkTextIter iter;
-    GtkTextChildAnchor *anc;
+    Slide *slide;
 
     g_signal_emit_by_name(G_OBJECT(nw->nv), "move-cursor",
             GTK_MOVEMENT_PARAGRAPHS, 1, FALSE);
@@ -379,14 +678,8 @@ static void advance_paragraph(NarrativeWindow *nw)
     update_highlight(nw);
 
     /* Is the cursor on a slide? */
-    anc = gtk_text_iter_get_child_anchor(&iter);
-    if ( anc != NULL ) {
-        guint n;
-        GtkWidget **th = gtk_text_child_anchor_get_widgets(anc, &n);
-        assert(n == 1);
-        set_presenting_slide(nw, thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(th[0])));
-        g_free(th);
-    }
+    slide = narrative_slide_at_iter(&iter);
+    if ( slide != NULL ) set_presenting_slide(nw, slide);
 }
 
 
@@ -515,7 +808,7 @@ static void update_statusbar(NarrativeWindow *nw)
 static void settings_wpm_changed_sig(GSettings *self, gchar *key, NarrativeWindow *nw)
 {
     double wpm = g_settings_get_double(nw->settings, "words-per-minute");
-    narrative_update_timing(GTK_TEXT_VIEW(nw->nv), nw->n, wpm);
+    narrative_update_timing(nw->n, wpm);
     update_statusbar(nw);
     gtk_widget_queue_draw(GTK_WIDGET(nw->timing_ruler));
 }
@@ -527,13 +820,28 @@ static void modified_changed_sig(GtkTextBuffer *buf, NarrativeWindow *nw)
 }
 
 
-static void changed_sig(GtkTextBuffer *buf, NarrativeWindow *nw)
+/* Once per frame, however many edits there were.  The buffer emits "changed"
+ * before the narrative has updated its word counts for the edit, so the
+ * timing is also worked out here rather than in changed_sig(). */
+static gboolean fixup_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer vp)
 {
+    NarrativeWindow *nw = vp;
     double wpm = g_settings_get_double(nw->settings, "words-per-minute");
+
+    nw->fixup_tick = 0;
     narrative_fixup_tags(nw->n);
-    narrative_update_timing(GTK_TEXT_VIEW(nw->nv), nw->n, wpm);
+    narrative_update_timing(nw->n, wpm);
     update_statusbar(nw);
     gtk_widget_queue_draw(GTK_WIDGET(nw->timing_ruler));
+    return G_SOURCE_REMOVE;
+}
+
+
+static void changed_sig(GtkTextBuffer *buf, NarrativeWindow *nw)
+{
+    if ( nw->fixup_tick == 0 ) {
+        nw->fixup_tick = gtk_widget_add_tick_callback(nw->nv, fixup_tick, nw, NULL);
+    }
 }
 
 
@@ -549,6 +857,18 @@ static void scroll_down(NarrativeWindow *nw)
 }
 
 
+static void save_and_close_done(int r, gpointer vp)
+{
+    NarrativeWindow *nw = vp;
+    if ( r ) {
+        show_error(nw, _("Failed to save presentation"));
+    } else {
+        gtk_window_close(GTK_WINDOW(nw));
+    }
+    g_object_unref(nw);
+}
+
+
 static void confirm_chosen(GObject *source, GAsyncResult *res, gpointer vp)
 {
     NarrativeWindow *nw = vp;
@@ -560,11 +880,8 @@ static void confirm_chosen(GObject *source, GAsyncResult *res, gpointer vp)
         gtk_text_buffer_set_modified(nw->n->textbuf, FALSE);
         gtk_window_close(GTK_WINDOW(nw));
     } else if ( i == 1 ) {
-        if ( narrative_save(nw->n, nw->file) ) {
-            show_error(nw, _("Failed to save presentation"));
-        } else {
-            gtk_window_close(GTK_WINDOW(nw));
-        }
+        narrative_save_async(nw->n, nw->file, save_and_close_done,
+                             g_object_ref(nw));
     } /* else i == 2, do nothing */
 }
 
@@ -617,7 +934,7 @@ static gboolean nw_key_press_sig(GtkEventControllerKey *self,
         break;
 
         case GDK_KEY_F1 :
-        narrative_fixup_tags(nw->n);
+        narrative_fixup_all_tags(nw->n);
         return TRUE;
 
     }
@@ -699,6 +1016,13 @@ static gboolean nw_destroy_sig(GtkWidget *da, NarrativeWindow *nw)
     for ( i=0; i<nw->n_slidewindows; i++ ) {
         gtk_window_close(GTK_WINDOW(nw->slidewindows[i]));
     }
+    prefetcher_free(nw->prefetcher);
+    nw->prefetcher = NULL;
+    g_clear_object(&nw->ruler_layout);
+    if ( nw->fixup_tick != 0 ) {
+        gtk_widget_remove_tick_callback(nw->nv, nw->fixup_tick);
+        nw->fixup_tick = 0;
+    }
     g_object_unref(nw->settings);
     if ( nw->monitor_update_timeout > 0 ) {
         g_source_remove(nw->monitor_update_timeout);
@@ -714,6 +1038,7 @@ static void stop_presenting(NarrativeWindow *nw)
     update_highlight(nw);
     gtk_widget_unparent(nw->presenting_label);
     nw->presenting_slide = NULL;
+    prefetcher_clear(nw->prefetcher);
 
     /* Put focus back in editor (not the toolbar) */
     gtk_widget_grab_focus(GTK_WIDGET(nw->nv));
@@ -750,6 +1075,7 @@ static void start_presenting_here_sig(GSimpleAction *action, GVariant *parameter
     NarrativeWindow *nw = vp;
     GtkTextMark *cursor;
     GtkTextIter iter;
+    Slide *slide;
 
     g_signal_emit_by_name(G_OBJECT(nw->nv), "move-cursor",
             GTK_MOVEMENT_PARAGRAPH_ENDS, -1, FALSE);
@@ -758,27 +1084,13 @@ static void start_presenting_here_sig(GSimpleAction *action, GVariant *parameter
     /* Look backwards to the last slide, and set it */
     cursor = gtk_text_buffer_get_insert(nw->n->textbuf);
     gtk_text_buffer_get_iter_at_mark(nw->n->textbuf, &iter, cursor);
-    if ( gtk_text_iter_backward_to_tag_toggle(&iter, lookup_tag(nw->n->textbuf, "slide")) ) {
-
-        guint n;
-        GtkWidget **th;
-        GtkTextChildAnchor *anc;
-
-        gtk_text_iter_backward_cursor_position(&iter);
-        anc = gtk_text_iter_get_child_anchor(&iter);
-        if ( anc == NULL ) {
-            fprintf(stderr, "No anchor found despite slide tag!\n");
-            return;
-        }
-        th = gtk_text_child_anchor_get_widgets(anc, &n);
-        assert(n == 1);
+    slide = narrative_get_slide(nw->n, narrative_slide_index_at(nw->n, &iter)-1);
+    if ( slide != NULL ) {
         if ( nw->n_slidewindows == 0 ) {
-            open_slide_window(nw, thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(th[0])));
+            open_slide_window(nw, slide);
         } else {
-            set_presenting_slide(nw, thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(th[0])));
+            set_presenting_slide(nw, slide);
         }
-
-        g_free(th);
     }
 }
 
@@ -839,13 +1151,31 @@ static void fsslide_sig(GSimpleAction *action, GVariant *parameter, gpointer vp)
 }
 
 
+/* Index of the first time mark at or after 'line' */
+static int first_time_mark(Narrative *n, int line)
+{
+    int lo = 0;
+    int hi = n->n_time_marks;
+
+    while ( lo < hi ) {
+        int mid = (lo+hi)/2;
+        if ( n->time_marks[mid].line < line ) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
 static void draw_timing_ruler(GtkDrawingArea *da, cairo_t *cr, int w, int h, gpointer vp)
 {
     NarrativeWindow *nw = vp;
     int i;
     double scroll_pos;
-    PangoLayout *layout;
-    PangoFontDescription *fontdesc;
+    GtkTextIter iter;
+    int first_line, last_line;
     GdkRGBA col;
 
     /* Foreground */
@@ -862,16 +1192,24 @@ static void draw_timing_ruler(GtkDrawingArea *da, cairo_t *cr, int w, int h, gpo
 
     scroll_pos = gtk_adjustment_get_value(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(nw->nv)));
 
-    layout = pango_layout_new(gtk_widget_get_pango_context(GTK_WIDGET(nw->nv)));
-    fontdesc = pango_font_description_from_string("Sans 12");
-    pango_layout_set_font_description(layout, fontdesc);
+    /* Only the visible lines (and the one above, whose label might overhang)
+     * need to be laid out */
+    gtk_text_view_get_line_at_y(GTK_TEXT_VIEW(nw->nv), &iter, scroll_pos, NULL);
+    first_line = gtk_text_iter_get_line(&iter) - 1;
+    gtk_text_view_get_line_at_y(GTK_TEXT_VIEW(nw->nv), &iter, scroll_pos+h, NULL);
+    last_line = gtk_text_iter_get_line(&iter);
 
-    for ( i=0; i<nw->n->n_time_marks; i++ ) {
+    for ( i=first_time_mark(nw->n, first_line); i<nw->n->n_time_marks; i++ ) {
 
         char tmp[64];
         double y;
+        int ly, lh;
+
+        if ( nw->n->time_marks[i].line > last_line ) break;
 
-        y = nw->n->time_marks[i].y-scroll_pos;
+        gtk_text_buffer_get_iter_at_line(nw->n->textbuf, &iter, nw->n->time_marks[i].line);
+        gtk_text_view_get_line_yrange(GTK_TEXT_VIEW(nw->nv), &iter, &ly, &lh);
+        y = ly-scroll_pos;
 
         cairo_move_to(cr, 0.0, y);
         cairo_line_to(cr, 20.0, y);
@@ -881,16 +1219,13 @@ static void draw_timing_ruler(GtkDrawingArea *da, cairo_t *cr, int w, int h, gpo
 
         snprintf(tmp, 63, _("%.0f min"), nw->n->time_marks[i].minutes);
         cairo_move_to(cr, 5.0, y+2.0);
-        pango_layout_set_text(layout, tmp, -1);
+        pango_layout_set_text(nw->ruler_layout, tmp, -1);
         cairo_set_source_rgb(cr, col.red, col.green, col.blue);
-        pango_cairo_update_layout(cr, layout);
-        pango_cairo_show_layout(cr, layout);
+        pango_cairo_update_layout(cr, nw->ruler_layout);
+        pango_cairo_show_layout(cr, nw->ruler_layout);
         cairo_fill(cr);
 
     }
-
-    g_object_unref(layout);
-    pango_font_description_free(fontdesc);
 }
 
 
@@ -900,6 +1235,8 @@ GActionEntry nw_entries[] = {
     { "save", save_sig, NULL, NULL, NULL },
     { "saveas", saveas_sig, NULL, NULL, NULL },
     { "exportpdf", exportpdf_sig, NULL, NULL, NULL },
+    { "exporthandout", exporthandout_sig, NULL, NULL, NULL },
+    { "exporthtml", exporthtml_sig, NULL, NULL, NULL },
     { "slide", add_slide_sig, NULL, NULL, NULL },
     { "eop", add_eop_sig, NULL, NULL, NULL },
     { "prestitle", add_prestitle_sig, NULL, NULL, NULL },
@@ -1056,7 +1393,7 @@ static void finish_nw(gpointer vp)
 {
     NarrativeWindow *nw = vp;
     double wpm = g_settings_get_double(nw->settings, "words-per-minute");
-    narrative_update_timing(GTK_TEXT_VIEW(nw->nv), nw->n, wpm);
+    narrative_update_timing(nw->n, wpm);
     update_statusbar(nw);
     gtk_widget_queue_draw(GTK_WIDGET(nw->timing_ruler));
 }
@@ -1153,8 +1490,10 @@ NarrativeWindow *narrative_window_new(Narrative *n, GFile *file, GApplication *a
     nw->slide_sorter = NULL;
     nw->presenting = 0;
     nw->presenting_slide = NULL;
+    nw->prefetcher = prefetcher_new();
     nw->timer = colloquium_timer_new();
     nw->monitor_update_timeout = 0;
+    nw->fixup_tick = 0;
     if ( file != NULL ) g_object_ref(file);
 
     gtk_application_window_set_show_menubar(GTK_APPLICATION_WINDOW(nw), TRUE);
@@ -1192,6 +1531,11 @@ NarrativeWindow *narrative_window_new(Narrative *n, GFile *file, GApplication *a
                                        g_settings_get_uint(nw->settings, "gutter-width"));
     gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(nw->timing_ruler), draw_timing_ruler, nw, NULL);
 
+    PangoFontDescription *fontdesc = pango_font_description_from_string("Sans 12");
+    nw->ruler_layout = pango_layout_new(gtk_widget_get_pango_context(GTK_WIDGET(nw->nv)));
+    pango_layout_set_font_description(nw->ruler_layout, fontdesc);
+    pango_font_description_free(fontdesc);
+
     apply_settings(nw->settings, NULL, nw);
 
     nw->toolbar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
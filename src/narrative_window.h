@@ -40,6 +40,7 @@ typedef struct _narrativewindowclass NarrativeWindowClass;
 #include "slide_window.h"
 #include "narrative.h"
 #include "slide_sorter.h"
+#include "prefetch.h"
 
 struct _narrativewindow
 {
@@ -55,14 +56,17 @@ struct _narrativewindow
     SlideWindow         *slidewindows[16];
     int                  n_slidewindows;
     GtkWidget           *timing_ruler;
+    PangoLayout         *ruler_layout;
     SlideSorter         *slide_sorter;
     GtkWidget           *toolbar;
     int                  presenting;
     GtkWidget           *presenting_label;
     Slide               *presenting_slide;
+    Prefetcher          *prefetcher;
     GSettings           *settings;
     GtkWidget           *status_text;
     guint                monitor_update_timeout;
+    guint                fixup_tick;
 };
 
 
@@ -21,6 +21,7 @@
  */
 
 
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -28,6 +29,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 
 #include <libintl.h>
 #define _(x) gettext(x)
@@ -38,58 +40,415 @@
 
 #include "narrative.h"
 #include "slide.h"
-#include "thumbnailwidget.h"
+#include "pdfexport.h"
+#include "exportcache.h"
 
 
-int export_pdf(Narrative *n, GFile *file)
+#define EXPORT_WIDTH (1000)
+
+
+/* Pages are prepared (files opened and parsed, slides recorded) on worker
+ * threads, a few pages ahead of where the PDF has got to.  Only writing the
+ * pages into the PDF, in order, is done one at a time. */
+struct export_page
 {
-    gchar *filename;
-    cairo_surface_t *surf;
-    GtkTextIter pos;
-    cairo_t *cr;
+    Slide *slide;           /* Private copy */
+    float aspect;
+    cairo_surface_t *prep;  /* From slide_prepare_cairo() */
+    int ready;
+};
 
-    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(n->textbuf);
-    GtkTextTag *slidetag = gtk_text_tag_table_lookup(table, "slide");
 
-    gtk_text_buffer_get_start_iter(n->textbuf, &pos);
+struct export_job
+{
+    GFile *file;
+    int n_pages;
+    struct export_page *pages;
+    gint n_reused;
 
-    /* Sadly no cairo_pdf_surface_create_for_gfile (yet?) */
-    filename = g_file_get_path(file);
-    if ( filename == NULL ) return 1;
-    surf = cairo_pdf_surface_create(filename, 1, 1);
-    g_free(filename);
+    GCancellable *cancellable;
+    GMutex lock;
+    GCond cond;
 
-    cr = cairo_create(surf);
+    ExportProgressFunc progress;
+    gpointer progress_vp;
+    GMainContext *context;
+    GTask *task;
+};
+
+
+struct export_progress
+{
+    GTask *task;
+    ExportProgressFunc progress;
+    gpointer vp;
+    double fraction;
+};
+
+
+/* The slides are copied, and needn't outlive the job */
+static struct export_job *new_export_job(Slide **slides, int n_slides, GFile *file,
+                                         GCancellable *cancellable)
+{
+    struct export_job *job;
+    int i;
+
+    job = malloc(sizeof(struct export_job));
+    if ( job == NULL ) return NULL;
 
-    do {
-
-        if ( gtk_text_iter_starts_tag(&pos, slidetag) ) {
-            GtkTextChildAnchor *anc;
-            anc = gtk_text_iter_get_child_anchor(&pos);
-            if ( anc != NULL ) {
-                Slide *slide;
-                guint nc;
-                GtkWidget **th = gtk_text_child_anchor_get_widgets(anc, &nc);
-                assert(nc == 1);
-                slide = thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(th[0]));
-                g_free(th);
-
-                float asp = slide_get_aspect(slide);
-                cairo_pdf_surface_set_size(surf, 1000, 1000/asp);
-                cairo_save(cr);
-                slide_render_cairo(slide, 1000, cr);
-                cairo_restore(cr);
-                cairo_show_page(cr);
+    job->n_pages = n_slides;
+    job->pages = malloc(job->n_pages*sizeof(struct export_page));
+    if ( (job->pages == NULL) && (job->n_pages > 0) ) {
+        free(job);
+        return NULL;
+    }
 
+    for ( i=0; i<job->n_pages; i++ ) {
+        job->pages[i].slide = slide_copy(slides[i]);
+        job->pages[i].aspect = slides[i]->aspect;
+        job->pages[i].prep = NULL;
+        job->pages[i].ready = 0;
+    }
+
+    job->file = g_object_ref(file);
+    job->n_reused = 0;
+    job->cancellable = (cancellable != NULL) ? g_object_ref(cancellable) : NULL;
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+    job->progress = NULL;
+    job->progress_vp = NULL;
+    job->context = NULL;
+    job->task = NULL;
+    return job;
+}
+
+
+/* Main thread only */
+static struct export_job *new_narrative_export_job(Narrative *n, GFile *file,
+                                                   GCancellable *cancellable)
+{
+    struct export_job *job;
+    Slide **slides;
+    int n_slides;
+    int i;
+
+    n_slides = narrative_count_slides(n);
+    slides = malloc(n_slides*sizeof(Slide *));
+    if ( (slides == NULL) && (n_slides > 0) ) return NULL;
+    for ( i=0; i<n_slides; i++ ) {
+        slides[i] = narrative_get_slide(n, i);
+    }
+
+    job = new_export_job(slides, n_slides, file, cancellable);
+    free(slides);
+    return job;
+}
+
+
+static void free_export_job(struct export_job *job)
+{
+    int i;
+    for ( i=0; i<job->n_pages; i++ ) {
+        if ( job->pages[i].prep != NULL ) cairo_surface_destroy(job->pages[i].prep);
+        slide_free(job->pages[i].slide);
+    }
+    free(job->pages);
+    g_object_unref(job->file);
+    if ( job->cancellable != NULL ) g_object_unref(job->cancellable);
+    if ( job->context != NULL ) g_main_context_unref(job->context);
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    free(job);
+}
+
+
+static void prepare_page(gpointer data, gpointer vp)
+{
+    struct export_page *page = data;
+    struct export_job *job = vp;
+
+    if ( !g_cancellable_is_cancelled(job->cancellable) ) {
+
+        enum slide_filetype ftype = slide_ftype(page->slide);
+
+        if ( (ftype == SLIDE_FTYPE_PDF) || (ftype == SLIDE_FTYPE_SVG)
+          || (ftype == SLIDE_FTYPE_IMAGE) )
+        {
+            /* Unchanged since last time? */
+            page->prep = export_cache_lookup(page->slide, EXPORT_WIDTH, &page->aspect);
+            if ( page->prep != NULL ) {
+                g_atomic_int_inc(&job->n_reused);
             } else {
-                fprintf(stderr, "Slide but no anchor found!\n");
+                page->aspect = slide_get_aspect(page->slide);
+                page->prep = slide_prepare_cairo(page->slide, EXPORT_WIDTH);
+                if ( page->prep != NULL ) {
+                    export_cache_insert(page->slide, EXPORT_WIDTH, page->prep,
+                                        page->aspect);
+                }
             }
+
+        } else if ( ftype != SLIDE_FTYPE_VIDEO ) {
+            page->aspect = slide_get_aspect(page->slide);
+
+        } else if ( page->aspect <= 0.0 ) {
+            /* Nothing here may touch GTK, which rules out asking a video for
+             * its aspect ratio.  Videos don't appear in the PDF anyway. */
+            page->aspect = 1.0;
         }
+    }
+
+    g_mutex_lock(&job->lock);
+    page->ready = 1;
+    g_cond_broadcast(&job->cond);
+    g_mutex_unlock(&job->lock);
+}
+
+
+static void free_progress(struct export_progress *ep)
+{
+    g_object_unref(ep->task);
+    free(ep);
+}
+
+
+static gboolean deliver_progress(gpointer vp)
+{
+    struct export_progress *ep = vp;
+
+    /* Too late if the caller has already been told that it's finished */
+    if ( !g_task_get_completed(ep->task) ) {
+        ep->progress(ep->fraction, ep->vp);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+
+/* Can be called from the thread running 'task', to call 'progress' on
+ * 'context' (see export_pdf_async) */
+void export_report_progress(GTask *task, GMainContext *context,
+                            ExportProgressFunc progress, gpointer vp,
+                            double fraction)
+{
+    struct export_progress *ep;
+
+    ep = malloc(sizeof(struct export_progress));
+    if ( ep == NULL ) return;
+    ep->task = g_object_ref(task);
+    ep->progress = progress;
+    ep->vp = vp;
+    ep->fraction = fraction;
+    g_main_context_invoke_full(context, G_PRIORITY_DEFAULT,
+                               deliver_progress, ep,
+                               (GDestroyNotify)free_progress);
+}
+
+
+static void report_progress(struct export_job *job, double fraction)
+{
+    if ( job->progress == NULL ) return;
+    export_report_progress(job->task, job->context, job->progress,
+                           job->progress_vp, fraction);
+}
+
+
+/* For cairo_pdf_surface_create_for_stream(), with a GOutputStream */
+cairo_status_t export_write_to_stream(void *vp, const unsigned char *data,
+                                      unsigned int len)
+{
+    GOutputStream *stream = vp;
+    if ( !g_output_stream_write_all(stream, data, len, NULL, NULL, NULL) ) {
+        return CAIRO_STATUS_WRITE_ERROR;
+    }
+    return CAIRO_STATUS_SUCCESS;
+}
 
-    } while ( gtk_text_iter_forward_to_tag_toggle(&pos, slidetag) );
+
+/* Closes a stream from g_file_replace(), which replaces the original file.
+ * If 'failed' is set, the original file is left untouched instead.  Returns
+ * non-zero if the file wasn't replaced. */
+int export_close_stream(GFileOutputStream *fh, int failed, GError **error)
+{
+    if ( failed ) {
+        /* Cancelling the close abandons the new file */
+        GCancellable *abandon = g_cancellable_new();
+        g_cancellable_cancel(abandon);
+        g_output_stream_close(G_OUTPUT_STREAM(fh), abandon, NULL);
+        g_object_unref(abandon);
+        return 1;
+    }
+    return !g_output_stream_close(G_OUTPUT_STREAM(fh), NULL, error);
+}
+
+
+/* Can be run on any thread */
+static int write_pdf(struct export_job *job, GError **error)
+{
+    GFileOutputStream *fh;
+    GThreadPool *pool;
+    cairo_surface_t *surf;
+    cairo_t *cr;
+    int n_threads;
+    int window;
+    int next;
+    int i;
+    int r;
+
+    /* Written to a temporary file, which replaces the original only if
+     * everything went well */
+    fh = g_file_replace(job->file, NULL, FALSE, G_FILE_CREATE_NONE,
+                        job->cancellable, error);
+    if ( fh == NULL ) return 1;
+
+    surf = cairo_pdf_surface_create_for_stream(export_write_to_stream, fh, 1, 1);
+    cr = cairo_create(surf);
+
+    n_threads = g_get_num_processors();
+    pool = g_thread_pool_new(prepare_page, job, n_threads, FALSE, NULL);
+
+    /* Don't get too far ahead, to keep memory use down */
+    window = 2*n_threads;
+    next = 0;
+
+    for ( i=0; i<job->n_pages; i++ ) {
+
+        struct export_page *page = &job->pages[i];
+
+        while ( (next < job->n_pages) && (next < i+window) ) {
+            g_thread_pool_push(pool, &job->pages[next++], NULL);
+        }
+
+        g_mutex_lock(&job->lock);
+        while ( !page->ready ) g_cond_wait(&job->cond, &job->lock);
+        g_mutex_unlock(&job->lock);
+
+        if ( g_cancellable_is_cancelled(job->cancellable) ) break;
+
+        cairo_pdf_surface_set_size(surf, EXPORT_WIDTH, EXPORT_WIDTH/page->aspect);
+        cairo_save(cr);
+        slide_render_cairo_prepared(page->slide, page->prep, EXPORT_WIDTH, cr);
+        cairo_restore(cr);
+        cairo_show_page(cr);
+
+        /* Won't be needed again */
+        if ( page->prep != NULL ) {
+            cairo_surface_destroy(page->prep);
+            page->prep = NULL;
+        }
+
+        report_progress(job, (double)(i+1)/job->n_pages);
+    }
+
+    /* Pages which haven't been started yet are dropped */
+    g_thread_pool_free(pool, TRUE, TRUE);
 
     cairo_destroy(cr);
     cairo_surface_finish(surf);
+    r = (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS);
+    cairo_surface_destroy(surf);
+
+    if ( g_cancellable_set_error_if_cancelled(job->cancellable, error) ) {
+        r = 1;
+    } else if ( r ) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    _("Failed to write PDF"));
+    }
+
+    r = export_close_stream(fh, r, error);
+    g_object_unref(fh);
+
+    return r;
+}
+
 
+static int run_export_job(struct export_job *job)
+{
+    GError *error = NULL;
+    int r;
+
+    r = write_pdf(job, &error);
+    if ( r ) {
+        fprintf(stderr, _("PDF export failed: %s\n"), error->message);
+        g_error_free(error);
+    }
+
+    free_export_job(job);
+    return r;
+}
+
+
+int export_pdf(Narrative *n, GFile *file)
+{
+    struct export_job *job = new_narrative_export_job(n, file, NULL);
+    if ( job == NULL ) return 1;
+    return run_export_job(job);
+}
+
+
+/* As export_pdf(), but for a list of slides in presentation order (see
+ * narrative_load_slides).  Doesn't touch GTK, so can be used without a
+ * display and from any thread. */
+int export_pdf_slides(Slide **slides, int n_slides, GFile *file)
+{
+    struct export_job *job = new_export_job(slides, n_slides, file, NULL);
+    if ( job == NULL ) return 1;
+    return run_export_job(job);
+}
+
+
+static void export_thread(GTask *task, gpointer source, gpointer vp,
+                          GCancellable *cancellable)
+{
+    struct export_job *job = vp;
+    GError *error = NULL;
+
+    if ( write_pdf(job, &error) ) {
+        g_task_return_error(task, error);
+    } else {
+        g_task_return_int(task, g_atomic_int_get(&job->n_reused));
+    }
+}
+
+
+/* The slides are copied straight away, so the narrative can be changed, or
+ * even freed, while the export is running.  'progress' and 'callback' are
+ * called on the current thread-default main context. */
+void export_pdf_async(Narrative *n, GFile *file, GCancellable *cancellable,
+                      ExportProgressFunc progress, gpointer progress_vp,
+                      GAsyncReadyCallback callback, gpointer vp)
+{
+    struct export_job *job;
+    GTask *task;
+
+    task = g_task_new(NULL, cancellable, callback, vp);
+    g_task_set_source_tag(task, export_pdf_async);
+
+    job = new_narrative_export_job(n, file, cancellable);
+    if ( job == NULL ) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                _("Out of memory"));
+        g_object_unref(task);
+        return;
+    }
+
+    job->progress = progress;
+    job->progress_vp = progress_vp;
+    job->context = g_main_context_ref_thread_default();
+    job->task = task;
+
+    g_task_set_task_data(task, job, (GDestroyNotify)free_export_job);
+    g_task_set_return_on_cancel(task, FALSE);
+    g_task_run_in_thread(task, export_thread);
+    g_object_unref(task);
+}
+
+
+/* Returns zero on success.  If 'n_reused' isn't NULL, it will be set to the
+ * number of pages which didn't need to be prepared again, because they hadn't
+ * changed since an earlier export. */
+int export_pdf_finish(GAsyncResult *result, int *n_reused, GError **error)
+{
+    gssize r = g_task_propagate_int(G_TASK(result), error);
+    if ( r < 0 ) return 1;
+    if ( n_reused != NULL ) *n_reused = r;
     return 0;
 }
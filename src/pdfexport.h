@@ -28,9 +28,27 @@
 #endif
 
 #include <gio/gio.h>
+#include <cairo.h>
 
 #include "narrative.h"
+#include "slide.h"
+
+typedef void (*ExportProgressFunc)(double fraction, gpointer vp);
 
 extern int export_pdf(Narrative *n, GFile *file);
+extern int export_pdf_slides(Slide **slides, int n_slides, GFile *file);
+extern void export_pdf_async(Narrative *n, GFile *file, GCancellable *cancellable,
+                             ExportProgressFunc progress, gpointer progress_vp,
+                             GAsyncReadyCallback callback, gpointer vp);
+extern int export_pdf_finish(GAsyncResult *result, int *n_reused,
+                             GError **error);
+
+/* For other exports which write PDFs */
+extern cairo_status_t export_write_to_stream(void *vp, const unsigned char *data,
+                                             unsigned int len);
+extern int export_close_stream(GFileOutputStream *fh, int failed, GError **error);
+extern void export_report_progress(GTask *task, GMainContext *context,
+                                   ExportProgressFunc progress, gpointer vp,
+                                   double fraction);
 
 #endif /* PDFEXPORT_H */
@@ -0,0 +1,142 @@
+/*
+ * prefetch.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#include <gtk/gtk.h>
+
+#include "slide.h"
+#include "renderqueue.h"
+#include "rendercache.h"
+#include "prefetch.h"
+
+
+/* Renders the slides either side of the one being presented, and pins the
+ * results in the render cache, so that the slide view finds them there when
+ * they're needed however much else has been rendered in the meantime. */
+struct prefetch_item
+{
+    RenderJob *job;
+    GdkTexture *tex;
+};
+
+
+struct _prefetcher
+{
+    GPtrArray *items;
+};
+
+
+static void free_item(struct prefetch_item *item)
+{
+    render_job_cancel(item->job);
+    if ( item->tex != NULL ) {
+        render_cache_unpin(item->tex);
+        g_object_unref(item->tex);
+    }
+    free(item);
+}
+
+
+Prefetcher *prefetcher_new(void)
+{
+    Prefetcher *pf = malloc(sizeof(Prefetcher));
+    if ( pf == NULL ) return NULL;
+    pf->items = g_ptr_array_new_with_free_func((GDestroyNotify)free_item);
+    return pf;
+}
+
+
+void prefetcher_free(Prefetcher *pf)
+{
+    if ( pf == NULL ) return;
+    g_ptr_array_unref(pf->items);
+    free(pf);
+}
+
+
+static void prefetch_done(GdkTexture *tex, gpointer vp)
+{
+    struct prefetch_item *item = vp;
+    item->job = NULL;
+    if ( tex != NULL ) {
+        item->tex = g_object_ref(tex);
+        render_cache_pin(tex);
+    }
+}
+
+
+/* Replaces the prefetched set with 'slides', each fitted into all of the
+ * given window sizes (in logical pixels, with the corresponding scale
+ * factors).  Anything already rendered is picked up from the cache straight
+ * away. */
+void prefetcher_update(Prefetcher *pf, Slide **slides, int n_slides,
+                       int *widths, int *heights, double *scales, int n_sizes)
+{
+    GPtrArray *old;
+    int i, j;
+
+    if ( pf == NULL ) return;
+
+    /* The old set is only unpinned afterwards, so that none of its textures
+     * can be evicted before being picked up again */
+    old = pf->items;
+    pf->items = g_ptr_array_new_with_free_func((GDestroyNotify)free_item);
+
+    for ( i=0; i<n_slides; i++ ) {
+        for ( j=0; j<n_sizes; j++ ) {
+
+            struct prefetch_item *item;
+            float aw, bx, by;
+
+            if ( (widths[j] <= 0) || (heights[j] <= 0) ) continue;
+
+            /* Same size as the slide view will ask for */
+            letterbox(widths[j], heights[j], slide_get_aspect(slides[i]),
+                      &aw, &bx, &by);
+
+            item = malloc(sizeof(struct prefetch_item));
+            if ( item == NULL ) break;
+            item->job = NULL;
+            item->tex = NULL;
+            g_ptr_array_add(pf->items, item);
+
+            item->job = render_queue_submit(slides[i], ceil(aw*scales[j]),
+                                            RENDER_PRIORITY_NEXT,
+                                            prefetch_done, item);
+        }
+    }
+
+    g_ptr_array_unref(old);
+}
+
+
+void prefetcher_clear(Prefetcher *pf)
+{
+    if ( pf == NULL ) return;
+    g_ptr_array_set_size(pf->items, 0);
+}
@@ -0,0 +1,41 @@
+/*
+ * prefetch.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "slide.h"
+
+typedef struct _prefetcher Prefetcher;
+
+extern Prefetcher *prefetcher_new(void);
+extern void prefetcher_free(Prefetcher *pf);
+extern void prefetcher_update(Prefetcher *pf, Slide **slides, int n_slides,
+                              int *widths, int *heights, double *scales,
+                              int n_sizes);
+extern void prefetcher_clear(Prefetcher *pf);
+
+#endif /* PREFETCH_H */
@@ -34,6 +34,7 @@
 #define _(x) gettext(x)
 
 #include "prefswindow.h"
+#include "rendercache.h"
 
 G_DEFINE_FINAL_TYPE(PrefsWindow, colloquium_prefs_window, GTK_TYPE_WINDOW)
 
@@ -232,6 +233,42 @@ static void wpm_sig(GtkEntry *self, GSettings *settings)
 }
 
 
+static void render_cache_sig(GtkEntry *self, GSettings *settings)
+{
+    const char *txt = gtk_editable_get_text(GTK_EDITABLE(self));
+    g_settings_set_uint(settings, "render-cache-size", atoi(txt));
+}
+
+
+static void thumb_cache_sig(GtkEntry *self, GSettings *settings)
+{
+    const char *txt = gtk_editable_get_text(GTK_EDITABLE(self));
+    g_settings_set_uint(settings, "thumbnail-cache-size", atoi(txt));
+}
+
+
+static void prefetch_sig(GtkEntry *self, GSettings *settings)
+{
+    const char *txt = gtk_editable_get_text(GTK_EDITABLE(self));
+    g_settings_set_uint(settings, "prefetch-slides", atoi(txt));
+}
+
+
+static void set_render_cache_label(GtkWidget *label)
+{
+    struct render_cache_stats st;
+    char tmp[256];
+    unsigned long total;
+
+    render_cache_get_stats(&st);
+    total = st.hits + st.misses;
+    snprintf(tmp, 255, _("%i slides, %.1f MiB in use, %.0f%% hit rate"),
+             st.n_entries, (double)st.size/(1024*1024),
+             (total > 0) ? 100.0*st.hits/total : 0.0);
+    gtk_label_set_text(GTK_LABEL(label), tmp);
+}
+
+
 static GtkWidget *presentation_prefs(GSettings *settings)
 {
     GtkWidget *box;
@@ -239,6 +276,7 @@ static GtkWidget *presentation_prefs(GSettings *settings)
     GtkWidget *entry;
     char tmp[64];
     GtkWidget *cb;
+    GtkWidget *label;
     GdkRGBA rgba;
 
     box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 4);
@@ -266,6 +304,38 @@ static GtkWidget *presentation_prefs(GSettings *settings)
     gtk_color_dialog_button_set_rgba(GTK_COLOR_DIALOG_BUTTON(cb), &rgba);
     g_signal_connect(G_OBJECT(cb), "notify::rgba", G_CALLBACK(highlight_sig), settings);
 
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 4);
+    gtk_box_append(GTK_BOX(box), hbox);
+    gtk_box_append(GTK_BOX(hbox), gtk_label_new(_("Slide cache size (MiB):")));
+    entry = gtk_entry_new();
+    gtk_box_append(GTK_BOX(hbox), entry);
+    snprintf(tmp, 63, "%u", g_settings_get_uint(settings, "render-cache-size"));
+    gtk_editable_set_text(GTK_EDITABLE(entry), tmp);
+    g_signal_connect(G_OBJECT(entry), "activate", G_CALLBACK(render_cache_sig), settings);
+
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 4);
+    gtk_box_append(GTK_BOX(box), hbox);
+    gtk_box_append(GTK_BOX(hbox), gtk_label_new(_("Thumbnail cache size on disk (MiB):")));
+    entry = gtk_entry_new();
+    gtk_box_append(GTK_BOX(hbox), entry);
+    snprintf(tmp, 63, "%u", g_settings_get_uint(settings, "thumbnail-cache-size"));
+    gtk_editable_set_text(GTK_EDITABLE(entry), tmp);
+    g_signal_connect(G_OBJECT(entry), "activate", G_CALLBACK(thumb_cache_sig), settings);
+
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 4);
+    gtk_box_append(GTK_BOX(box), hbox);
+    gtk_box_append(GTK_BOX(hbox), gtk_label_new(_("Slides to render in advance:")));
+    entry = gtk_entry_new();
+    gtk_box_append(GTK_BOX(hbox), entry);
+    snprintf(tmp, 63, "%u", g_settings_get_uint(settings, "prefetch-slides"));
+    gtk_editable_set_text(GTK_EDITABLE(entry), tmp);
+    g_signal_connect(G_OBJECT(entry), "activate", G_CALLBACK(prefetch_sig), settings);
+
+    label = gtk_label_new("");
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(box), label);
+    set_render_cache_label(label);
+
     return box;
 }
 
@@ -0,0 +1,270 @@
+/*
+ * rendercache.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+#include "slide.h"
+#include "rendercache.h"
+
+
+/* Rendered slide textures, keyed by slide identity and pixel width.  The
+ * least recently used textures are dropped when the total size goes over the
+ * budget set by the "render-cache-size" setting (in megabytes), except for
+ * pinned ones (see render_cache_pin). */
+struct render_cache_entry
+{
+    char *key;
+    char *skey;     /* Slide identity only, for 'by_slide' */
+    int w;
+    GdkTexture *tex;
+    gsize size;
+    GList *link;    /* Position in 'lru' */
+};
+
+
+static GHashTable *render_cache = NULL;
+static GHashTable *by_slide = NULL;  /* Slide key -> GList of entries */
+static GQueue lru = G_QUEUE_INIT;   /* Most recently used at head */
+static GHashTable *pinned = NULL;   /* Texture -> pin count */
+static GSettings *settings = NULL;
+static struct render_cache_stats stats;
+G_LOCK_DEFINE_STATIC(render_cache);
+
+
+static void free_entry(struct render_cache_entry *e)
+{
+    g_object_unref(e->tex);
+    g_free(e->key);
+    g_free(e->skey);
+    free(e);
+}
+
+
+static void remove_entry(struct render_cache_entry *e)
+{
+    GList *sizes = g_hash_table_lookup(by_slide, e->skey);
+    sizes = g_list_remove(sizes, e);
+    if ( sizes == NULL ) {
+        g_hash_table_remove(by_slide, e->skey);
+    } else {
+        g_hash_table_replace(by_slide, g_strdup(e->skey), sizes);
+    }
+
+    g_queue_delete_link(&lru, e->link);
+    stats.size -= e->size;
+    stats.n_entries--;
+    g_hash_table_remove(render_cache, e->key);  /* Frees e */
+}
+
+
+/* Call with lock held.  Anything still on screen keeps its own reference to
+ * the texture, so dropping it here is safe. */
+static void evict(void)
+{
+    GList *link = lru.tail;
+    while ( (stats.size > stats.budget) && (link != NULL) ) {
+        struct render_cache_entry *e = link->data;
+        link = link->prev;
+        if ( g_hash_table_contains(pinned, e->tex) ) continue;
+        remove_entry(e);
+        stats.evictions++;
+    }
+}
+
+
+static void budget_changed_sig(GSettings *s, gchar *key, gpointer vp)
+{
+    G_LOCK(render_cache);
+    stats.budget = (gsize)g_settings_get_uint(s, "render-cache-size")*1024*1024;
+    evict();
+    G_UNLOCK(render_cache);
+}
+
+
+/* Call with lock held */
+static void ensure_cache(void)
+{
+    if ( render_cache != NULL ) return;
+
+    render_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify)free_entry);
+    by_slide = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pinned = g_hash_table_new(g_direct_hash, g_direct_equal);
+    settings = g_settings_new("uk.me.bitwiz.colloquium");
+    stats.budget = (gsize)g_settings_get_uint(settings, "render-cache-size")*1024*1024;
+    g_signal_connect(G_OBJECT(settings), "changed::render-cache-size",
+                     G_CALLBACK(budget_changed_sig), NULL);
+}
+
+
+static char *make_key(const char *skey, int w)
+{
+    return g_strdup_printf("%s\n%i", skey, w);
+}
+
+
+/* Call with lock held */
+static GdkTexture *use_entry(struct render_cache_entry *e)
+{
+    g_queue_unlink(&lru, e->link);
+    g_queue_push_head_link(&lru, e->link);
+    stats.hits++;
+    return g_object_ref(e->tex);
+}
+
+
+/* Returns a new reference to the cached texture, or NULL */
+GdkTexture *render_cache_lookup(Slide *s, int w)
+{
+    char *skey;
+    char *key;
+    struct render_cache_entry *e;
+    GdkTexture *tex = NULL;
+
+    skey = slide_get_key(s);
+    key = make_key(skey, w);
+    g_free(skey);
+
+    G_LOCK(render_cache);
+    ensure_cache();
+    e = g_hash_table_lookup(render_cache, key);
+    if ( e != NULL ) {
+        tex = use_entry(e);
+    } else {
+        stats.misses++;
+    }
+    G_UNLOCK(render_cache);
+
+    g_free(key);
+    return tex;
+}
+
+
+/* Returns a new reference to the narrowest cached texture between 'min_w' and
+ * 'max_w' pixels wide, or NULL.  A texture slightly too big can be scaled
+ * down when drawing, instead of rendering the slide again. */
+GdkTexture *render_cache_lookup_near(Slide *s, int min_w, int max_w)
+{
+    char *skey;
+    GList *l;
+    struct render_cache_entry *best = NULL;
+    GdkTexture *tex = NULL;
+
+    skey = slide_get_key(s);
+
+    G_LOCK(render_cache);
+    ensure_cache();
+    for ( l=g_hash_table_lookup(by_slide, skey); l!=NULL; l=l->next ) {
+        struct render_cache_entry *e = l->data;
+        if ( (e->w < min_w) || (e->w > max_w) ) continue;
+        if ( (best == NULL) || (e->w < best->w) ) best = e;
+    }
+    if ( best != NULL ) {
+        tex = use_entry(best);
+    } else {
+        stats.misses++;
+    }
+    G_UNLOCK(render_cache);
+
+    g_free(skey);
+    return tex;
+}
+
+
+void render_cache_insert(Slide *s, int w, GdkTexture *tex)
+{
+    struct render_cache_entry *e;
+    struct render_cache_entry *old;
+    GList *sizes;
+
+    e = malloc(sizeof(struct render_cache_entry));
+    if ( e == NULL ) return;
+    e->skey = slide_get_key(s);
+    e->key = make_key(e->skey, w);
+    e->w = w;
+    e->tex = g_object_ref(tex);
+    e->size = (gsize)gdk_texture_get_width(tex) * gdk_texture_get_height(tex) * 4;
+
+    G_LOCK(render_cache);
+    ensure_cache();
+
+    old = g_hash_table_lookup(render_cache, e->key);
+    if ( old != NULL ) remove_entry(old);
+
+    g_queue_push_head(&lru, e);
+    e->link = lru.head;
+    g_hash_table_insert(render_cache, e->key, e);
+    sizes = g_hash_table_lookup(by_slide, e->skey);
+    g_hash_table_replace(by_slide, g_strdup(e->skey), g_list_prepend(sizes, e));
+    stats.size += e->size;
+    stats.n_entries++;
+    evict();
+
+    G_UNLOCK(render_cache);
+}
+
+
+/* Keeps the entry for 'tex' (if there is one) in the cache until it's unpinned
+ * as many times as it was pinned.  The caller must keep a reference to 'tex'
+ * in the meantime. */
+void render_cache_pin(GdkTexture *tex)
+{
+    int n;
+    G_LOCK(render_cache);
+    ensure_cache();
+    n = GPOINTER_TO_INT(g_hash_table_lookup(pinned, tex));
+    g_hash_table_replace(pinned, tex, GINT_TO_POINTER(n+1));
+    G_UNLOCK(render_cache);
+}
+
+
+void render_cache_unpin(GdkTexture *tex)
+{
+    int n;
+    G_LOCK(render_cache);
+    ensure_cache();
+    n = GPOINTER_TO_INT(g_hash_table_lookup(pinned, tex));
+    if ( n > 1 ) {
+        g_hash_table_replace(pinned, tex, GINT_TO_POINTER(n-1));
+    } else {
+        g_hash_table_remove(pinned, tex);
+        evict();
+    }
+    G_UNLOCK(render_cache);
+}
+
+
+void render_cache_get_stats(struct render_cache_stats *st)
+{
+    G_LOCK(render_cache);
+    ensure_cache();
+    *st = stats;
+    G_UNLOCK(render_cache);
+}
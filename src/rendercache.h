@@ -0,0 +1,51 @@
+/*
+ * rendercache.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RENDERCACHE_H
+#define RENDERCACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+
+#include "slide.h"
+
+struct render_cache_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    int n_entries;
+    gsize size;
+    gsize budget;
+};
+
+extern GdkTexture *render_cache_lookup(Slide *s, int w);
+extern GdkTexture *render_cache_lookup_near(Slide *s, int min_w, int max_w);
+extern void render_cache_insert(Slide *s, int w, GdkTexture *tex);
+extern void render_cache_pin(GdkTexture *tex);
+extern void render_cache_unpin(GdkTexture *tex);
+extern void render_cache_get_stats(struct render_cache_stats *stats);
+
+#endif /* RENDERCACHE_H */
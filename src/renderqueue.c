@@ -0,0 +1,385 @@
+/*
+ * renderqueue.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+#include "slide.h"
+#include "rendercache.h"
+#include "thumbcache.h"
+#include "renderqueue.h"
+
+
+/* Requests for the same slide at similar sizes share one rendering, which
+ * is done at the largest of the sizes and scaled down slightly when drawn.
+ * This covers several slide windows showing the same slide, even from
+ * different narratives, as well as prefetching. */
+#define CLOSE_SIZE (1.25)
+
+
+/* One rendering, shared by any number of jobs.  A task is freed by the
+ * worker if all of its jobs were cancelled before it started, otherwise by
+ * deliver_task() on the main thread. */
+typedef struct _rendertask RenderTask;
+struct _rendertask
+{
+    Slide *slide;       /* Private copy, so the worker needn't share */
+    char *key;
+    gint req_w;         /* Negated when the worker starts */
+    int w;              /* Worker only */
+    enum render_priority prio;
+    guint64 serial;
+    gint cancelled;
+    gint want_preview;
+    GdkTexture *tex;
+    GdkTexture *preview;
+    GList *jobs;        /* Main thread only */
+    int n_active;       /* Main thread only */
+    int in_flight;      /* Main thread only */
+};
+
+
+/* A job belongs to whoever submitted it until it is either cancelled or
+ * delivered */
+struct _renderjob
+{
+    RenderTask *task;
+    enum render_priority prio;
+    int cancelled;
+    RenderDoneFunc preview_done;
+    RenderDoneFunc done;
+    gpointer vp;
+};
+
+
+static GThreadPool *pool = NULL;
+static guint64 next_serial = 0;
+static GHashTable *in_flight = NULL;   /* Slide key -> GList of tasks */
+
+
+static void free_task(RenderTask *task)
+{
+    if ( task->tex != NULL ) g_object_unref(task->tex);
+    if ( task->preview != NULL ) g_object_unref(task->preview);
+    g_list_free_full(task->jobs, free);
+    slide_free(task->slide);
+    g_free(task->key);
+    free(task);
+}
+
+
+static int task_width(RenderTask *task)
+{
+    return abs(g_atomic_int_get(&task->req_w));
+}
+
+
+/* Main thread only.  No more jobs can join the task after this. */
+static void remove_in_flight(RenderTask *task)
+{
+    GList *tasks;
+
+    if ( !task->in_flight ) return;
+    task->in_flight = 0;
+
+    tasks = g_hash_table_lookup(in_flight, task->key);
+    tasks = g_list_remove(tasks, task);
+    if ( tasks == NULL ) {
+        g_hash_table_remove(in_flight, task->key);
+    } else {
+        g_hash_table_replace(in_flight, g_strdup(task->key), tasks);
+    }
+}
+
+
+static gboolean deliver_task(gpointer vp)
+{
+    RenderTask *task = vp;
+    GList *l;
+
+    /* The callbacks might submit more work for the same slide */
+    remove_in_flight(task);
+
+    for ( l=task->jobs; l!=NULL; l=l->next ) {
+        RenderJob *job = l->data;
+        if ( job->cancelled ) continue;
+        job->cancelled = 1;  /* Delivered, so it can't be cancelled any more */
+        job->done(task->tex, job->vp);
+    }
+    free_task(task);
+    return G_SOURCE_REMOVE;
+}
+
+
+/* Always runs before deliver_task() for the same task */
+static gboolean deliver_preview(gpointer vp)
+{
+    RenderTask *task = vp;
+    GList *l;
+
+    for ( l=task->jobs; l!=NULL; l=l->next ) {
+        RenderJob *job = l->data;
+        if ( job->cancelled || (job->preview_done == NULL) ) continue;
+        job->preview_done(task->preview, job->vp);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+
+static void render_task(gpointer data, gpointer vp)
+{
+    RenderTask *task = data;
+
+    if ( g_atomic_int_get(&task->cancelled) ) {
+        free_task(task);
+        return;
+    }
+
+    /* From now on, the size is fixed */
+    do {
+        task->w = g_atomic_int_get(&task->req_w);
+    } while ( !g_atomic_int_compare_and_exchange(&task->req_w, task->w, -task->w) );
+
+    /* Another task might have done the work while this one was waiting, or
+     * it might have been done in a previous session */
+    task->tex = render_cache_lookup_near(task->slide, task->w, task->w*CLOSE_SIZE);
+    if ( (task->tex == NULL) && (task->prio >= RENDER_PRIORITY_VISIBLE) ) {
+        float aspect;
+        task->tex = thumb_cache_lookup(task->slide, task->w, &aspect);
+        if ( task->tex != NULL ) {
+            render_cache_insert(task->slide, task->w, task->tex);
+        }
+    }
+    if ( task->tex != NULL ) {
+        g_idle_add_full(G_PRIORITY_DEFAULT, deliver_task, task, NULL);
+        return;
+    }
+
+    slide_ftype(task->slide);
+
+    /* Once a preview has been sent, the task must go via deliver_task() to be
+     * freed, even if it's cancelled in the meantime */
+    if ( g_atomic_int_get(&task->want_preview) ) {
+        task->preview = slide_render_preview(task->slide, task->w);
+        if ( task->preview != NULL ) {
+            g_idle_add_full(G_PRIORITY_DEFAULT, deliver_preview, task, NULL);
+        }
+    }
+
+    if ( !g_atomic_int_get(&task->cancelled) ) {
+        task->tex = slide_render_texture(task->slide, task->w);
+    }
+
+    /* Thumbnails are also kept for next time */
+    if ( (task->tex != NULL) && (task->prio >= RENDER_PRIORITY_VISIBLE) ) {
+        thumb_cache_store(task->slide, task->w, task->tex);
+    }
+
+    g_idle_add_full(G_PRIORITY_DEFAULT, deliver_task, task, NULL);
+}
+
+
+/* Most urgent first, then first come first served */
+static gint compare_tasks(gconstpointer a, gconstpointer b, gpointer vp)
+{
+    const RenderTask *ta = a;
+    const RenderTask *tb = b;
+    if ( ta->prio != tb->prio ) return (ta->prio < tb->prio) ? -1 : 1;
+    if ( ta->serial != tb->serial ) return (ta->serial < tb->serial) ? -1 : 1;
+    return 0;
+}
+
+
+/* Finds a task for the same slide which will give a suitable size.  A task
+ * which hasn't started yet can be enlarged a little, but it mustn't hold up
+ * something more urgent. */
+static RenderTask *find_task(const char *key, int w, enum render_priority prio)
+{
+    GList *l;
+
+    for ( l=g_hash_table_lookup(in_flight, key); l!=NULL; l=l->next ) {
+        RenderTask *task = l->data;
+        int tw = g_atomic_int_get(&task->req_w);
+
+        if ( tw < 0 ) {
+            /* Already being rendered */
+            if ( (w <= -tw) && (-tw <= w*CLOSE_SIZE) ) return task;
+            continue;
+        }
+
+        if ( task->prio > prio ) continue;
+        if ( (w <= tw) && (tw <= w*CLOSE_SIZE) ) return task;
+        if ( (w > tw) && (w <= tw*CLOSE_SIZE)
+          && g_atomic_int_compare_and_exchange(&task->req_w, tw, w) ) return task;
+    }
+    return NULL;
+}
+
+
+/* The caller must push the task to the pool once its first job is attached */
+static RenderTask *new_task(Slide *s, char *key, int w, enum render_priority prio)
+{
+    RenderTask *task;
+    GList *tasks;
+
+    task = malloc(sizeof(RenderTask));
+    if ( task == NULL ) return NULL;
+    task->slide = slide_copy(s);
+    task->key = key;
+    task->req_w = w;
+    task->w = 0;
+    task->prio = prio;
+    task->serial = next_serial++;
+    task->cancelled = 0;
+    task->want_preview = 0;
+    task->tex = NULL;
+    task->preview = NULL;
+    task->jobs = NULL;
+    task->n_active = 0;
+    task->in_flight = 1;
+
+    tasks = g_hash_table_lookup(in_flight, key);
+    g_hash_table_replace(in_flight, g_strdup(key), g_list_append(tasks, task));
+    return task;
+}
+
+
+/* Call from the main thread only.  If the result is already available, 'done'
+ * is called before returning, and the return value is NULL.  Otherwise, the
+ * returned job may be cancelled until 'done' has been called.  If
+ * 'preview_done' isn't NULL, it may be called first with a quick, low-quality
+ * version (see slide_render_preview).  The texture might be slightly wider
+ * than 'w', if that saves rendering the slide again. */
+RenderJob *render_queue_submit_progressive(Slide *s, int w, enum render_priority prio,
+                                           RenderDoneFunc preview_done,
+                                           RenderDoneFunc done, gpointer vp)
+{
+    RenderJob *job;
+    RenderTask *task;
+    GdkTexture *tex;
+    enum slide_filetype ftype;
+    char *key;
+    int is_new = 0;
+
+    /* If the file type isn't known yet, the worker will find out */
+    ftype = s->file_type;
+    if ( (s->ext_file == NULL)
+      || ((ftype != SLIDE_FTYPE_UNKNOWN)
+       && (ftype != SLIDE_FTYPE_PDF)
+       && (ftype != SLIDE_FTYPE_SVG)
+       && (ftype != SLIDE_FTYPE_IMAGE)) )
+    {
+        done(NULL, vp);
+        return NULL;
+    }
+
+    /* The thumbnail cache is left to the worker, because it might have to
+     * read its index first */
+    tex = render_cache_lookup_near(s, w, w*CLOSE_SIZE);
+    if ( tex != NULL ) {
+        done(tex, vp);
+        g_object_unref(tex);
+        return NULL;
+    }
+
+    if ( pool == NULL ) {
+        pool = g_thread_pool_new(render_task, NULL, g_get_num_processors(),
+                                 FALSE, NULL);
+        g_thread_pool_set_sort_function(pool, compare_tasks, NULL);
+        in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    job = malloc(sizeof(RenderJob));
+    if ( job == NULL ) {
+        done(NULL, vp);
+        return NULL;
+    }
+
+    key = slide_get_key(s);
+    task = find_task(key, w, prio);
+    if ( task != NULL ) {
+        g_free(key);
+    } else {
+        task = new_task(s, key, w, prio);
+        if ( task == NULL ) {
+            g_free(key);
+            free(job);
+            done(NULL, vp);
+            return NULL;
+        }
+        is_new = 1;
+    }
+
+    job->task = task;
+    job->prio = prio;
+    job->cancelled = 0;
+    job->preview_done = preview_done;
+    job->done = done;
+    job->vp = vp;
+    task->jobs = g_list_prepend(task->jobs, job);
+    task->n_active++;
+    if ( preview_done != NULL ) g_atomic_int_set(&task->want_preview, 1);
+
+    /* Only now can the worker be allowed to see it */
+    if ( is_new ) g_thread_pool_push(pool, task, NULL);
+
+    return job;
+}
+
+
+RenderJob *render_queue_submit(Slide *s, int w, enum render_priority prio,
+                               RenderDoneFunc done, gpointer vp)
+{
+    return render_queue_submit_progressive(s, w, prio, NULL, done, vp);
+}
+
+
+/* Call from the main thread only.  'done' will not be called for this job,
+ * and the job must not be used again.  The rendering itself is abandoned if
+ * nothing else is waiting for it. */
+void render_job_cancel(RenderJob *job)
+{
+    RenderTask *task;
+
+    if ( job == NULL ) return;
+    if ( job->cancelled ) return;
+    job->cancelled = 1;
+
+    task = job->task;
+    if ( --task->n_active == 0 ) {
+        remove_in_flight(task);
+        g_atomic_int_set(&task->cancelled, 1);
+    }
+}
+
+
+enum render_priority render_job_get_priority(RenderJob *job)
+{
+    return job->prio;
+}
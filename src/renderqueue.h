@@ -0,0 +1,58 @@
+/*
+ * renderqueue.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+
+#include "slide.h"
+
+/* In order of urgency */
+enum render_priority
+{
+    RENDER_PRIORITY_PRESENTING,
+    RENDER_PRIORITY_NEXT,
+    RENDER_PRIORITY_VISIBLE,
+    RENDER_PRIORITY_OFFSCREEN
+};
+
+typedef struct _renderjob RenderJob;
+
+/* Called on the main thread.  'tex' is NULL if rendering failed, and must be
+ * referenced if it is to be kept */
+typedef void (*RenderDoneFunc)(GdkTexture *tex, gpointer vp);
+
+extern RenderJob *render_queue_submit(Slide *s, int w, enum render_priority prio,
+                                      RenderDoneFunc done, gpointer vp);
+extern RenderJob *render_queue_submit_progressive(Slide *s, int w,
+                                                  enum render_priority prio,
+                                                  RenderDoneFunc preview_done,
+                                                  RenderDoneFunc done, gpointer vp);
+extern void render_job_cancel(RenderJob *job);
+extern enum render_priority render_job_get_priority(RenderJob *job);
+
+#endif /* RENDERQUEUE_H */
@@ -37,6 +37,9 @@
 #define _(x) gettext(x)
 
 #include "slide.h"
+#include "doccache.h"
+#include "rendercache.h"
+#include "slideprobe.h"
 
 
 Slide *slide_new()
@@ -56,6 +59,7 @@ Slide *slide_new()
 void slide_free(Slide *s)
 {
     if ( s->ext_file != NULL ) g_object_unref(s->ext_file);
+    g_strfreev(s->hide_elements);
     free(s);
 }
 
@@ -65,6 +69,7 @@ Slide *slide_copy(const Slide *s)
     Slide *o = slide_new();
     *o = *s;
     o->anchor = NULL;
+    o->hide_elements = g_strdupv(s->hide_elements);
     if ( s->ext_file != NULL ) {
         o->ext_file = g_file_dup(o->ext_file);
     } else {
@@ -90,7 +95,8 @@ void slide_set_hidden_elements(Slide *s, char **elements, int n)
 {
     int i;
 
-    s->hide_elements = malloc((n+1)*sizeof(char *));
+    g_strfreev(s->hide_elements);
+    s->hide_elements = g_new(char *, n+1);
     for ( i=0; i<n; i++ ) {
         s->hide_elements[i] = g_strdup(elements[i]);
     }
@@ -127,36 +133,6 @@ static GdkTexture *surface_to_paintable(cairo_surface_t *surf, int w, int h)
 }
 
 
-static float get_aspect_image(GFile *file)
-{
-    GFileInputStream *stream;
-    GError *error;
-    GdkPixbuf *pixbuf;
-    int pw, ph;
-
-    error = NULL;
-    stream = g_file_read(file, NULL, &error);
-    if ( stream == NULL ) {
-        fprintf(stderr, _("Failed to open read (aspect): %s\n"), error->message);
-        return 1;
-    }
-
-    error = NULL;
-    pixbuf = gdk_pixbuf_new_from_stream(G_INPUT_STREAM(stream), NULL, &error);
-    g_object_unref(stream);
-    if ( pixbuf == NULL ) {
-        fprintf(stderr, _("Failed to load image (aspect): %s\n"), error->message);
-        return 1;
-    }
-
-    pw = gdk_pixbuf_get_width(pixbuf);
-    ph = gdk_pixbuf_get_height(pixbuf);
-    g_object_unref(pixbuf);
-
-    return (float)pw/ph;
-}
-
-
 static GdkTexture *load_image(GFile *file, int w)
 {
     GFileInputStream *stream;
@@ -193,17 +169,20 @@ static GdkTexture *load_image(GFile *file, int w)
 }
 
 
-static void load_image_cairo(GFile *file, int w, cairo_t *cr)
+/* Decodes an image at width 'w', ready to be painted with Cairo */
+static cairo_surface_t *load_image_surface(GFile *file, int w)
 {
     GFileInputStream *stream;
     GError *error;
     GdkPixbuf *pixbuf;
+    cairo_surface_t *surf;
+    cairo_t *cr;
 
     error = NULL;
     stream = g_file_read(file, NULL, &error);
     if ( stream == NULL ) {
         fprintf(stderr, _("Failed to read image: %s\n"), error->message);
-        return;
+        return NULL;
     }
 
     error = NULL;
@@ -212,111 +191,46 @@ static void load_image_cairo(GFile *file, int w, cairo_t *cr)
     g_object_unref(G_OBJECT(stream));
     if ( pixbuf == NULL ) {
         fprintf(stderr, _("Failed to load image (paintable): %s\n"), error->message);
-        return;
+        return NULL;
     }
 
+    surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                      gdk_pixbuf_get_width(pixbuf),
+                                      gdk_pixbuf_get_height(pixbuf));
+    cr = cairo_create(surf);
     G_GNUC_BEGIN_IGNORE_DEPRECATIONS
     gdk_cairo_set_source_pixbuf(cr, pixbuf, 0, 0);
     G_GNUC_END_IGNORE_DEPRECATIONS
-
     cairo_paint(cr);
+    cairo_destroy(cr);
 
     g_object_unref(G_OBJECT(pixbuf));
+    return surf;
 }
 
 
-static float get_aspect_svg(GFile *file)
+static void load_image_cairo(GFile *file, int w, cairo_t *cr)
 {
-    RsvgHandle *fh;
-    GError *error;
-    RsvgLength width, height;
-    RsvgRectangle viewbox;
-    gboolean has_viewbox, has_width, has_height;
-    float aspect;
-
-    error = NULL;
-    fh = rsvg_handle_new_from_gfile_sync(file, RSVG_HANDLE_FLAGS_NONE,
-                                        NULL, &error);
-    if ( fh == NULL ) {
-        fprintf(stderr, _("Failed to read SVG (aspect): %s\n"), error->message);
-        return 1.0;
-    }
-
-    rsvg_handle_set_dpi(fh, 96);
-    rsvg_handle_get_intrinsic_dimensions(fh, &has_width, &width,
-                                         &has_height, &height,
-                                         &has_viewbox, &viewbox);
-
-    if ( has_viewbox ) {
-        aspect = viewbox.width/viewbox.height;
-    } else {
-        if ( !has_width || !has_height ) {
-            fprintf(stderr, _("Failed to load SVG - no width/height\n"));
-            aspect = 1.0;
-        }
-        if ( width.unit != height.unit ) {
-            fprintf(stderr, _("Failed to load SVG - units not the same\n"));
-            aspect = 1.0;
-        }
-        if ( width.unit == RSVG_UNIT_PERCENT ) {
-            fprintf(stderr, _("Failed to load SVG - no viewbox and percent size\n"));
-            aspect = 1.0;
-        }
-        aspect = width.length / height.length;
-    }
-
-    g_object_unref(fh);
-    return aspect;
+    cairo_surface_t *surf = load_image_surface(file, w);
+    if ( surf == NULL ) return;
+    cairo_set_source_surface(cr, surf, 0, 0);
+    cairo_paint(cr);
+    cairo_surface_destroy(surf);
 }
 
 
-static GdkTexture *load_svg_stream(GInputStream *stream, GFile *file, int w, char **hide_elements,
-                                   cairo_t *in_cr)
+/* Call with the handle locked, if it came from the document cache */
+static GdkTexture *render_svg(RsvgHandle *fh, float aspect, int w,
+                              char **hide_elements, cairo_t *in_cr)
 {
-    RsvgHandle *fh;
     GError *error;
-    RsvgLength width, height;
-    RsvgRectangle viewbox;
-    gboolean has_viewbox, has_width, has_height;
     RsvgRectangle viewport;
-    float aspect;
     int h;
     cairo_surface_t *surf;
     cairo_t *cr;
+    GString *css;
+    int i;
 
-    error = NULL;
-    fh = rsvg_handle_new_from_stream_sync(stream, file, RSVG_HANDLE_FLAGS_NONE,
-                                          NULL, &error);
-    if ( fh == NULL ) {
-        fprintf(stderr, _("Failed to read SVG: %s\n"), error->message);
-        return NULL;
-    }
-
-    rsvg_handle_set_dpi(fh, 96);
-    rsvg_handle_get_intrinsic_dimensions(fh, &has_width, &width,
-                                         &has_height, &height,
-                                         &has_viewbox, &viewbox);
-
-    if ( has_viewbox ) {
-        aspect = viewbox.width/viewbox.height;
-    } else {
-        if ( !has_width || !has_height ) {
-            fprintf(stderr, _("Failed to load SVG - no width/height\n"));
-            g_object_unref(fh);
-            return NULL;
-        }
-        if ( width.unit != height.unit ) {
-            fprintf(stderr, _("Failed to load SVG - units not the same\n"));
-            g_object_unref(fh);
-            return NULL;
-        }
-        if ( width.unit == RSVG_UNIT_PERCENT ) {
-            fprintf(stderr, _("Failed to load SVG - no viewbox and percent size\n"));
-            g_object_unref(fh);
-            return NULL;
-        }
-        aspect = width.length / height.length;
-    }
     h = w/aspect;
 
     if ( in_cr == NULL ) {
@@ -329,21 +243,18 @@ static GdkTexture *load_svg_stream(GInputStream *stream, GFile *file, int w, cha
     cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
     cairo_paint(cr);
 
-    if ( hide_elements != NULL ) {
-        gchar *css = g_strdup("");
-        int i = 0;
-        while ( hide_elements[i] != NULL ) {
-            gchar *ncss = g_strconcat(css, "#", hide_elements[i], "{opacity: 0.0;}", NULL);
-            g_free(css);
-            css = ncss;
-            i++;
-        }
-        error = NULL;
-        if ( !rsvg_handle_set_stylesheet(fh, (const guint8 *)css, strlen(css), &error) ) {
-            fprintf(stderr, "CSS error: %s\n", error->message);
-        }
-        g_free(css);
+    /* Always set the stylesheet, because the handle may be shared with
+     * other build steps of the same slide */
+    css = g_string_new(NULL);
+    for ( i=0; (hide_elements != NULL) && (hide_elements[i] != NULL); i++ ) {
+        g_string_append_printf(css, "#%s{opacity: 0.0;}", hide_elements[i]);
     }
+    error = NULL;
+    if ( !rsvg_handle_set_stylesheet(fh, (const guint8 *)css->str, css->len, &error) ) {
+        fprintf(stderr, "CSS error: %s\n", error->message);
+        g_error_free(error);
+    }
+    g_string_free(css, TRUE);
 
     viewport.x = 0;
     viewport.y = 0;
@@ -351,9 +262,9 @@ static GdkTexture *load_svg_stream(GInputStream *stream, GFile *file, int w, cha
     viewport.height = h;
     error = NULL;
     rsvg_handle_render_document(fh, cr, &viewport, &error);
-    g_object_unref(fh);
 
     if ( in_cr == NULL ) {
+        cairo_destroy(cr);
         return surface_to_paintable(surf, w, h);
     } else {
         return NULL;
@@ -361,40 +272,49 @@ static GdkTexture *load_svg_stream(GInputStream *stream, GFile *file, int w, cha
 }
 
 
-static GdkTexture *load_svg(GFile *file, int w, char **hide_elements, cairo_t *cr)
+static GdkTexture *load_svg_stream(GInputStream *stream, int w)
 {
-    GInputStream *stream;
-    GError *error = NULL;
-    stream = G_INPUT_STREAM(g_file_read(file, NULL, &error));
-    if ( stream == NULL ) {
-        fprintf(stderr, _("Failed to open SVG: %s\n"), error->message);
+    RsvgHandle *fh;
+    GError *error;
+    float aspect;
+    GdkTexture *tex;
+
+    error = NULL;
+    fh = rsvg_handle_new_from_stream_sync(stream, NULL, RSVG_HANDLE_FLAGS_NONE,
+                                          NULL, &error);
+    if ( fh == NULL ) {
+        fprintf(stderr, _("Failed to read SVG: %s\n"), error->message);
         return NULL;
     }
-    return load_svg_stream(stream, file, w, hide_elements, cr);
-}
 
+    rsvg_handle_set_dpi(fh, 96);
+    aspect = svg_get_aspect(fh);
+    if ( aspect <= 0.0 ) {
+        g_object_unref(fh);
+        return NULL;
+    }
 
-static float get_aspect_pdf(GFile *file, int pagenum)
-{
-    PopplerDocument *doc;
-    PopplerPage *page;
-    double pw, ph;
+    tex = render_svg(fh, aspect, w, NULL, NULL);
+    g_object_unref(fh);
+    return tex;
+}
 
-    doc = poppler_document_new_from_gfile(file, NULL, NULL, NULL);
-    if ( doc == NULL ) return 1.0;
 
-    page = poppler_document_get_page(doc, pagenum-1);
-    if ( page == NULL ) {
-        g_object_unref(G_OBJECT(doc));
-        return 1.0;
-    }
+static GdkTexture *load_svg(GFile *file, int w, char **hide_elements, cairo_t *cr)
+{
+    RsvgHandle *fh;
+    float aspect;
+    GdkTexture *tex;
 
-    poppler_page_get_size(page, &pw, &ph);
+    fh = doc_cache_get_svg(file, &aspect);
+    if ( fh == NULL ) return NULL;
 
-    g_object_unref(G_OBJECT(page));
-    g_object_unref(G_OBJECT(doc));
+    doc_cache_lock(fh);
+    tex = render_svg(fh, aspect, w, hide_elements, cr);
+    doc_cache_unlock(fh);
+    g_object_unref(fh);
 
-    return pw/ph;
+    return tex;
 }
 
 
@@ -407,12 +327,12 @@ static GdkTexture *load_pdf(GFile *file, int pagenum, int w, cairo_t *in_cr)
     cairo_t *cr;
     int h;
 
-    doc = poppler_document_new_from_gfile(file, NULL, NULL, NULL);
+    doc = doc_cache_get_pdf(file);
     if ( doc == NULL ) return NULL;
 
     page = poppler_document_get_page(doc, pagenum-1);
     if ( page == NULL ) {
-        g_object_unref(G_OBJECT(doc));
+        doc_cache_put_pdf(doc);
         return NULL;
     }
 
@@ -430,9 +350,10 @@ static GdkTexture *load_pdf(GFile *file, int pagenum, int w, cairo_t *in_cr)
     poppler_page_render(page, cr);
 
     g_object_unref(G_OBJECT(page));
-    g_object_unref(G_OBJECT(doc));
+    doc_cache_put_pdf(doc);
 
     if ( in_cr == NULL ) {
+        cairo_destroy(cr);
         return surface_to_paintable(surf, w, h);
     } else {
         return NULL;
@@ -440,63 +361,19 @@ static GdkTexture *load_pdf(GFile *file, int pagenum, int w, cairo_t *in_cr)
 }
 
 
+/* Type and aspect ratio both come from the probe results (see slideprobe.c).
+ * On the main thread, they might not be available yet. */
 static int ensure_ftype(Slide *s)
 {
     if ( s->file_type == SLIDE_FTYPE_UNKNOWN ) {
 
-        GFileInfo *info;
-        const char *type;
-        GError *error;
+        struct slide_probe pr;
 
         if ( s->ext_file == NULL ) return 1;
+        if ( slide_probe_get(s->ext_file, s->ext_slidenumber, &pr) ) return 1;
 
-        error = NULL;
-        info = g_file_query_info(s->ext_file, "standard::", G_FILE_QUERY_INFO_NONE, NULL, &error);
-        if ( info == NULL ) {
-            fprintf(stderr, _("Failed to read info: %s\n"), error->message);
-            return 1;
-        }
-
-        type = g_file_info_get_content_type(info);
-
-        /* PDF types */
-        if ( g_content_type_equals(type, "application/pdf") ) {
-            s->file_type = SLIDE_FTYPE_PDF;
-        } else if ( g_content_type_equals(type, "com.adobe.pdf") ) {
-            s->file_type = SLIDE_FTYPE_PDF;
-
-        /* Bitmap images */
-        } else if ( g_content_type_equals(type, "public.png") ) {
-            s->file_type = SLIDE_FTYPE_IMAGE;
-        } else if ( g_content_type_equals(type, "image/jpeg") ) {
-            s->file_type = SLIDE_FTYPE_IMAGE;
-        } else if ( g_content_type_equals(type, "public.jpeg") ) {
-            s->file_type = SLIDE_FTYPE_IMAGE;
-        } else if ( g_content_type_equals(type, "image/png") ) {
-            s->file_type = SLIDE_FTYPE_IMAGE;
-
-        /* Vector images */
-        } else if ( g_content_type_equals(type, "image/svg+xml") ) {
-            s->file_type = SLIDE_FTYPE_SVG;
-        } else if ( g_content_type_equals(type, "public.svg-image") ) {
-            s->file_type = SLIDE_FTYPE_SVG;
-
-        /* Video types */
-        } else if ( g_content_type_equals(type, "image/gif") ) {
-            s->file_type = SLIDE_FTYPE_VIDEO;
-        } else if ( g_content_type_equals(type, "com.compuserve.gif") ) {
-            s->file_type = SLIDE_FTYPE_VIDEO;
-        } else if ( g_content_type_equals(type, "video/mpeg") ) {
-            s->file_type = SLIDE_FTYPE_VIDEO;
-        } else if ( g_content_type_equals(type, "public.mpeg") ) {
-            s->file_type = SLIDE_FTYPE_VIDEO;
-
-        } else {
-            fprintf(stderr, "File format not recognised: %s\n", type);
-            s->file_type = SLIDE_FTYPE_UNKNOWN;
-        }
-
-        g_object_unref(G_OBJECT(info));
+        s->file_type = pr.type;
+        if ( (s->aspect < 0.0) && (pr.aspect > 0.0) ) s->aspect = pr.aspect;
 
     }
 
@@ -512,6 +389,369 @@ enum slide_filetype slide_ftype(Slide *s)
 }
 
 
+/* Identifies the rendered appearance of a slide, independent of size.  On the
+ * main thread, this doesn't touch the disk (see doc_cache_get_mtime). */
+char *slide_get_key(Slide *s)
+{
+    char *uri;
+    char *hide;
+    char *key;
+
+    uri = g_file_get_uri(s->ext_file);
+    if ( s->hide_elements != NULL ) {
+        hide = g_strjoinv(",", s->hide_elements);
+    } else {
+        hide = g_strdup("");
+    }
+    key = g_strdup_printf("%s\n%" G_GUINT64_FORMAT "\n%i\n%s", uri,
+                          doc_cache_get_mtime(s->ext_file),
+                          s->ext_slidenumber, hide);
+    g_free(uri);
+    g_free(hide);
+    return key;
+}
+
+
+/* PDF and SVG slides are recorded once, as vector drawing operations.
+ * Rendering at any size replays the recording, without going back to the
+ * source file.  However, Poppler scales bitmap images down to the size they're
+ * drawn at, so a recording can't be used for a much larger rendering.  The
+ * recording widths therefore go up in factors of two, as needed. */
+#define RECORDING_WIDTH (1000)      /* Smallest */
+#define MAX_RECORDING_WIDTH (8000)
+#define MAX_RECORDINGS (32)
+
+struct recording
+{
+    char *key;
+    cairo_surface_t *rec;
+    GList *link;
+};
+
+static GHashTable *recordings = NULL;
+static GQueue recordings_lru = G_QUEUE_INIT;
+static cairo_user_data_key_t recording_lock_key;
+G_LOCK_DEFINE_STATIC(recordings);
+
+
+static void free_recording(struct recording *r)
+{
+    cairo_surface_destroy(r->rec);
+    g_free(r->key);
+    free(r);
+}
+
+
+static void free_lock(GMutex *lock)
+{
+    g_mutex_clear(lock);
+    free(lock);
+}
+
+
+/* The width of recording to use for rendering at width 'w' */
+static int recording_width(int w)
+{
+    int rw = RECORDING_WIDTH;
+    while ( (rw < w) && (rw < MAX_RECORDING_WIDTH) ) rw *= 2;
+    return rw;
+}
+
+
+static cairo_surface_t *record_slide(Slide *s, int rw)
+{
+    cairo_rectangle_t extents;
+    cairo_surface_t *rec;
+    cairo_t *cr;
+    GMutex *lock;
+
+    extents.x = 0.0;
+    extents.y = 0.0;
+    extents.width = rw;
+    extents.height = rw/slide_get_aspect(s);
+    rec = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+    cr = cairo_create(rec);
+
+    if ( s->file_type == SLIDE_FTYPE_PDF ) {
+        load_pdf(s->ext_file, s->ext_slidenumber, rw, cr);
+    } else {
+        load_svg(s->ext_file, rw, s->hide_elements, cr);
+    }
+    cairo_destroy(cr);
+
+    if ( cairo_surface_status(rec) != CAIRO_STATUS_SUCCESS ) {
+        cairo_surface_destroy(rec);
+        return NULL;
+    }
+
+    /* Replaying a recording isn't safe from several threads at once */
+    lock = malloc(sizeof(GMutex));
+    if ( lock == NULL ) {
+        cairo_surface_destroy(rec);
+        return NULL;
+    }
+    g_mutex_init(lock);
+    cairo_surface_set_user_data(rec, &recording_lock_key, lock,
+                                (cairo_destroy_func_t)free_lock);
+    return rec;
+}
+
+
+/* Call with lock held.  Returns a new reference to the recording with 'key',
+ * or NULL if there isn't one. */
+static cairo_surface_t *find_recording(const char *key)
+{
+    struct recording *r;
+
+    if ( recordings == NULL ) {
+        recordings = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                           (GDestroyNotify)free_recording);
+    }
+    r = g_hash_table_lookup(recordings, key);
+    if ( r == NULL ) return NULL;
+
+    g_queue_unlink(&recordings_lru, r->link);
+    g_queue_push_head_link(&recordings_lru, r->link);
+    return cairo_surface_reference(r->rec);
+}
+
+
+/* Returns a new reference to a recording of a PDF or SVG slide, suitable for
+ * rendering at width 'w', making it if necessary.  May be called from any
+ * thread, with a slide which isn't shared. */
+static cairo_surface_t *get_recording(Slide *s, int w)
+{
+    char *skey;
+    char *key;
+    struct recording *r;
+    cairo_surface_t *rec;
+    int rw;
+
+    if ( (s->file_type != SLIDE_FTYPE_PDF) && (s->file_type != SLIDE_FTYPE_SVG) ) {
+        return NULL;
+    }
+    if ( (s->file_type == SLIDE_FTYPE_PDF) && (s->ext_slidenumber == 0) ) {
+        return NULL;
+    }
+
+    rw = recording_width(w);
+    skey = slide_get_key(s);
+    key = g_strdup_printf("%s\n%i", skey, rw);
+    g_free(skey);
+
+    G_LOCK(recordings);
+    rec = find_recording(key);
+    G_UNLOCK(recordings);
+    if ( rec != NULL ) {
+        g_free(key);
+        return rec;
+    }
+
+    /* Two threads might record the same slide at once, but that's harmless */
+    rec = record_slide(s, rw);
+    if ( rec == NULL ) {
+        g_free(key);
+        return NULL;
+    }
+
+    r = malloc(sizeof(struct recording));
+    if ( r == NULL ) {
+        g_free(key);
+        return rec;
+    }
+    r->key = key;
+    r->rec = cairo_surface_reference(rec);
+
+    G_LOCK(recordings);
+    if ( g_hash_table_lookup(recordings, key) != NULL ) {
+        G_UNLOCK(recordings);
+        free_recording(r);
+        return rec;
+    }
+    g_queue_push_head(&recordings_lru, r);
+    r->link = recordings_lru.head;
+    g_hash_table_insert(recordings, r->key, r);
+    while ( g_hash_table_size(recordings) > MAX_RECORDINGS ) {
+        struct recording *old = g_queue_pop_tail(&recordings_lru);
+        g_hash_table_remove(recordings, old->key);
+    }
+    G_UNLOCK(recordings);
+
+    return rec;
+}
+
+
+static void replay_recording(cairo_surface_t *rec, int w, cairo_t *cr)
+{
+    GMutex *lock = cairo_surface_get_user_data(rec, &recording_lock_key);
+    cairo_rectangle_t extents;
+    double scale;
+
+    cairo_recording_surface_get_extents(rec, &extents);
+    scale = w/extents.width;
+
+    g_mutex_lock(lock);
+    cairo_save(cr);
+    cairo_scale(cr, scale, scale);
+    cairo_set_source_surface(cr, rec, 0.0, 0.0);
+    cairo_paint(cr);
+    cairo_restore(cr);
+    g_mutex_unlock(lock);
+}
+
+
+static GdkTexture *rasterise_recording(cairo_surface_t *rec, int w, float aspect)
+{
+    cairo_surface_t *surf;
+    cairo_t *cr;
+    int h = w/aspect;
+
+    surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+    cr = cairo_create(surf);
+    replay_recording(rec, w, cr);
+    cairo_destroy(cr);
+    return surface_to_paintable(surf, w, h);
+}
+
+
+/* As slide_render_texture(), but without adding the result to the render
+ * cache.  For exporting, where the result won't be shown on screen. */
+GdkTexture *slide_render_texture_uncached(Slide *s, int w)
+{
+    GdkTexture *tex;
+    cairo_surface_t *rec;
+
+    switch ( s->file_type ) {
+
+        case SLIDE_FTYPE_PDF:
+        case SLIDE_FTYPE_SVG:
+        rec = get_recording(s, w);
+        if ( rec == NULL ) return NULL;
+        tex = rasterise_recording(rec, w, slide_get_aspect(s));
+        cairo_surface_destroy(rec);
+        break;
+
+        case SLIDE_FTYPE_IMAGE:
+        tex = load_image(s->ext_file, w);
+        break;
+
+        default:
+        return NULL;
+    }
+
+    return tex;
+}
+
+
+/* Renders a PDF, SVG or bitmap slide to a texture, and adds it to the render
+ * cache.  Does not touch any GTK state, so may be called from any thread, but
+ * the file type must already be known (see slide_ftype). */
+GdkTexture *slide_render_texture(Slide *s, int w)
+{
+    GdkTexture *tex = slide_render_texture_uncached(s, w);
+    if ( tex != NULL ) render_cache_insert(s, w, tex);
+    return tex;
+}
+
+
+static GdkTexture *pdf_embedded_thumbnail(Slide *s)
+{
+    PopplerDocument *doc;
+    PopplerPage *page;
+    cairo_surface_t *surf;
+
+    doc = doc_cache_get_pdf(s->ext_file);
+    if ( doc == NULL ) return NULL;
+
+    surf = NULL;
+    page = poppler_document_get_page(doc, s->ext_slidenumber-1);
+    if ( page != NULL ) {
+        surf = poppler_page_get_thumbnail(page);
+        g_object_unref(page);
+    }
+    doc_cache_put_pdf(doc);
+
+    if ( surf == NULL ) return NULL;
+    return surface_to_paintable(surf, cairo_image_surface_get_width(surf),
+                                cairo_image_surface_get_height(surf));
+}
+
+
+/* Returns a new reference to any existing recording of the slide, or NULL.
+ * Never makes a new one. */
+static cairo_surface_t *existing_recording(Slide *s)
+{
+    char *skey;
+    cairo_surface_t *rec = NULL;
+    int rw;
+
+    skey = slide_get_key(s);
+    G_LOCK(recordings);
+    for ( rw=RECORDING_WIDTH; rw<=MAX_RECORDING_WIDTH; rw*=2 ) {
+        char *key = g_strdup_printf("%s\n%i", skey, rw);
+        rec = find_recording(key);
+        g_free(key);
+        if ( rec != NULL ) break;
+    }
+    G_UNLOCK(recordings);
+    g_free(skey);
+    return rec;
+}
+
+
+/* A quick, rough rendering to show while slide_render_texture() does the real
+ * thing: the PDF's own thumbnail of the page if it has one, otherwise a
+ * quarter-resolution replay of an existing recording of the slide, without
+ * antialiasing.  Making a recording is the slow part of rendering, so there's
+ * no preview if that hasn't already been done.  Returns NULL if there's no
+ * quicker way, e.g. for bitmaps or small sizes.  The result doesn't go in the
+ * render cache.  As for slide_render_texture(), the file type must already be
+ * known. */
+GdkTexture *slide_render_preview(Slide *s, int w)
+{
+    cairo_surface_t *rec;
+    cairo_surface_t *surf;
+    cairo_t *cr;
+    int pw, ph;
+
+    if ( (s->file_type != SLIDE_FTYPE_PDF) && (s->file_type != SLIDE_FTYPE_SVG) ) {
+        return NULL;
+    }
+    if ( (s->file_type == SLIDE_FTYPE_PDF) && (s->ext_slidenumber == 0) ) {
+        return NULL;
+    }
+
+    if ( s->file_type == SLIDE_FTYPE_PDF ) {
+        GdkTexture *tex = pdf_embedded_thumbnail(s);
+        if ( tex != NULL ) return tex;
+    }
+
+    if ( w < 256 ) return NULL;
+
+    rec = existing_recording(s);
+    if ( rec == NULL ) return NULL;
+
+    pw = w/4;
+    ph = pw/slide_get_aspect(s);
+    surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, pw, ph);
+    cr = cairo_create(surf);
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+    replay_recording(rec, pw, cr);
+    cairo_surface_destroy(rec);
+
+    cairo_destroy(cr);
+    return surface_to_paintable(surf, pw, ph);
+}
+
+
+static GdkTexture *render_texture(Slide *s, int w)
+{
+    GdkTexture *tex = render_cache_lookup(s, w);
+    if ( tex != NULL ) return tex;
+    return slide_render_texture(s, w);
+}
+
+
 GdkPaintable *slide_render(Slide *s, int w)
 {
     if ( ensure_ftype(s) ) return placeholder_image();
@@ -523,13 +763,11 @@ GdkPaintable *slide_render(Slide *s, int w)
             fprintf(stderr, "PDF without page number\n");
             return placeholder_image();
         }
-        return GDK_PAINTABLE(load_pdf(s->ext_file, s->ext_slidenumber, w, NULL));
+        return GDK_PAINTABLE(render_texture(s, w));
 
         case SLIDE_FTYPE_IMAGE:
-        return GDK_PAINTABLE(load_image(s->ext_file, w));
-
         case SLIDE_FTYPE_SVG:
-        return GDK_PAINTABLE(load_svg(s->ext_file, w, s->hide_elements, NULL));
+        return GDK_PAINTABLE(render_texture(s, w));
 
         case SLIDE_FTYPE_VIDEO:
         if ( s->mediastream == NULL ) {
@@ -546,6 +784,8 @@ GdkPaintable *slide_render(Slide *s, int w)
 
 void slide_render_cairo(Slide *s, int w, cairo_t *cr)
 {
+    cairo_surface_t *rec;
+
     if ( ensure_ftype(s) ) return;
 
     switch ( s->file_type ) {
@@ -555,17 +795,19 @@ void slide_render_cairo(Slide *s, int w, cairo_t *cr)
             fprintf(stderr, "PDF without page number\n");
             return;
         }
-        load_pdf(s->ext_file, s->ext_slidenumber, w, cr);
+        /* Fall through */
+
+        case SLIDE_FTYPE_SVG:
+        rec = get_recording(s, w);
+        if ( rec == NULL ) return;
+        replay_recording(rec, w, cr);
+        cairo_surface_destroy(rec);
         break;
 
         case SLIDE_FTYPE_IMAGE:
         load_image_cairo(s->ext_file, w, cr);
         break;
 
-        case SLIDE_FTYPE_SVG:
-        load_svg(s->ext_file, w, s->hide_elements, cr);
-        break;
-
         case SLIDE_FTYPE_VIDEO:
         return;
 
@@ -576,6 +818,49 @@ void slide_render_cairo(Slide *s, int w, cairo_t *cr)
 }
 
 
+/* Does the slow parts of slide_render_cairo() in advance: finds out the file
+ * type, reads and parses the file, and makes the vector recording (or, for a
+ * bitmap, decodes the image at width 'w').  May be called from any thread,
+ * with a slide which isn't shared.  The result, which may be NULL, should be
+ * given to slide_render_cairo_prepared() with the same width. */
+cairo_surface_t *slide_prepare_cairo(Slide *s, int w)
+{
+    if ( ensure_ftype(s) ) return NULL;
+
+    switch ( s->file_type ) {
+
+        case SLIDE_FTYPE_PDF:
+        case SLIDE_FTYPE_SVG:
+        return get_recording(s, w);
+
+        case SLIDE_FTYPE_IMAGE:
+        return load_image_surface(s->ext_file, w);
+
+        default:
+        return NULL;
+    }
+}
+
+
+/* As slide_render_cairo(), using the result of slide_prepare_cairo() */
+void slide_render_cairo_prepared(Slide *s, cairo_surface_t *prep, int w, cairo_t *cr)
+{
+    if ( prep == NULL ) {
+        slide_render_cairo(s, w, cr);
+        return;
+    }
+
+    if ( s->file_type == SLIDE_FTYPE_IMAGE ) {
+        cairo_save(cr);
+        cairo_set_source_surface(cr, prep, 0, 0);
+        cairo_paint(cr);
+        cairo_restore(cr);
+    } else {
+        replay_recording(prep, w, cr);
+    }
+}
+
+
 float slide_get_aspect(Slide *s)
 {
     float t;
@@ -591,16 +876,12 @@ float slide_get_aspect(Slide *s)
             fprintf(stderr, "PDF without page number\n");
             return 1.0;
         }
-        s->aspect = get_aspect_pdf(s->ext_file, s->ext_slidenumber);
-        break;
+        /* Fall through */
 
         case SLIDE_FTYPE_IMAGE:
-        s->aspect = get_aspect_image(s->ext_file);
-        break;
-
         case SLIDE_FTYPE_SVG:
-        s->aspect = get_aspect_svg(s->ext_file);
-        break;
+        /* ensure_ftype() would have set the aspect ratio, if possible */
+        return 1.0;
 
         case SLIDE_FTYPE_VIDEO:
         if ( s->mediastream == NULL ) {
@@ -652,6 +933,7 @@ GdkPaintable *placeholder_image()
 
     stream = g_resources_open_stream("/uk/me/bitwiz/colloquium/uk.me.bitwiz.colloquium.svg",
                                      G_RESOURCE_LOOKUP_FLAGS_NONE, &error);
-    the_placeholder = GDK_PAINTABLE(load_svg_stream(stream, NULL, 512, NULL, NULL));
+    the_placeholder = GDK_PAINTABLE(load_svg_stream(stream, 512));
+    g_object_unref(stream);
     return the_placeholder;
 }
@@ -64,8 +64,15 @@ extern void slide_set_ext_number(Slide *s, int num);
 extern void slide_set_hidden_elements(Slide *s, char **elements, int n);
 
 extern float slide_get_aspect(Slide *s);
+extern char *slide_get_key(Slide *s);
 extern GdkPaintable *slide_render(Slide *s, int w);
+extern GdkTexture *slide_render_texture(Slide *s, int w);
+extern GdkTexture *slide_render_texture_uncached(Slide *s, int w);
+extern GdkTexture *slide_render_preview(Slide *s, int w);
 extern void slide_render_cairo(Slide *s, int w, cairo_t *cr);
+extern cairo_surface_t *slide_prepare_cairo(Slide *s, int w);
+extern void slide_render_cairo_prepared(Slide *s, cairo_surface_t *prep, int w,
+                                        cairo_t *cr);
 extern enum slide_filetype slide_ftype(Slide *s);
 
 extern void letterbox(float dw, float dh, float aspect,
@@ -38,6 +38,7 @@
 #include "slide.h"
 #include "slide_sorter.h"
 #include "thumbnailwidget.h"
+#include "slideprobe.h"
 
 
 G_DEFINE_FINAL_TYPE(SlideSorter, colloquium_slide_sorter, GTK_TYPE_WINDOW)
@@ -63,65 +64,67 @@ static void sr_destroy_sig(GtkWidget *self, NarrativeWindow *nw)
 static GSList *files_in_narrative(Narrative *n)
 {
     GSList *list = NULL;
-    GtkTextIter iter;
-    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(n->textbuf);
-    GtkTextTag *tag = gtk_text_tag_table_lookup(table, "slide");
-    gboolean more;
-
-    gtk_text_buffer_get_start_iter(n->textbuf, &iter);
-    do {
-        GtkTextChildAnchor *anc;
-        more = gtk_text_iter_forward_to_tag_toggle(&iter, tag);
-        anc = gtk_text_iter_get_child_anchor(&iter);
-        if ( anc != NULL ) {
-            Slide *slide;
-            guint nc;
-            char *ef;
-            GtkWidget **th = gtk_text_child_anchor_get_widgets(anc, &nc);
-            assert(nc == 1);
-            slide = thumbnail_get_slide(COLLOQUIUM_THUMBNAIL(th[0]));
-            ef = g_file_get_uri(slide->ext_file);
-            if ( g_slist_find_custom(list, ef, (GCompareFunc)g_strcmp0) == NULL ) {
-                list = g_slist_prepend(list, ef);
-            }
-            g_free(th);
+    int i;
+
+    for ( i=0; i<narrative_count_slides(n); i++ ) {
+        Slide *slide = narrative_get_slide(n, i);
+        char *ef = g_file_get_uri(slide->ext_file);
+        if ( g_slist_find_custom(list, ef, (GCompareFunc)g_strcmp0) == NULL ) {
+            list = g_slist_prepend(list, ef);
+        } else {
+            g_free(ef);
         }
-    } while ( more );
+    }
     return list;
 }
 
 
-static void addfile(gpointer sv, gpointer vp)
+struct sorter_file
 {
-    char *filename = sv;
-    GtkWidget *flowbox = vp;
     GFile *file;
-    PopplerDocument *doc;
-    int np;
-    int i;
+    GtkWidget *flowbox;
+};
+
 
-    file = g_file_new_for_uri(filename);
-    doc = poppler_document_new_from_gfile(file, NULL, NULL, NULL);
-    if ( doc == NULL ) return;
+static void file_probed(gpointer vp)
+{
+    struct sorter_file *sf = vp;
+    struct slide_probe pr;
+    int i;
 
-    np = poppler_document_get_n_pages(doc);
+    if ( (slide_probe_get(sf->file, 1, &pr) == 0) && (pr.type == SLIDE_FTYPE_PDF) ) {
 
-    for ( i=0; i<np;  i++ ) {
+        for ( i=0; i<pr.n_pages;  i++ ) {
 
-        Slide *s;
-        GtkWidget *th;
+            Slide *s;
+            GtkWidget *th;
 
-        s = slide_new();
-        slide_set_ext_file(s, file);
-        slide_set_ext_number(s, i+1);
-        th = thumbnail_new(s, NULL);
-        gtk_widget_set_size_request(GTK_WIDGET(th), 128, -1);
-        gtk_flow_box_append(GTK_FLOW_BOX(flowbox), GTK_WIDGET(th));
+            s = slide_new();
+            slide_set_ext_file(s, sf->file);
+            slide_set_ext_number(s, i+1);
+            th = thumbnail_new(s, NULL);
+            gtk_widget_set_size_request(GTK_WIDGET(th), 128, -1);
+            gtk_flow_box_append(GTK_FLOW_BOX(sf->flowbox), GTK_WIDGET(th));
 
+        }
     }
 
-    g_object_unref(doc);
-    g_object_unref(file);
+    g_object_unref(sf->file);
+    g_object_unref(sf->flowbox);
+    free(sf);
+}
+
+
+static void addfile(gpointer sv, gpointer vp)
+{
+    char *filename = sv;
+    struct sorter_file *sf;
+
+    sf = malloc(sizeof(struct sorter_file));
+    if ( sf == NULL ) return;
+    sf->file = g_file_new_for_uri(filename);
+    sf->flowbox = g_object_ref(vp);
+    slide_probe_start(sf->file, file_probed, sf);
 }
 
 
@@ -0,0 +1,245 @@
+/*
+ * slidepaintable.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#include <gtk/gtk.h>
+
+#include "slide.h"
+#include "renderqueue.h"
+#include "slidepaintable.h"
+
+
+/* A slide which is rendered at whatever size it's drawn at.  Rendering happens
+ * in the background via the render queue, which replays the slide's vector
+ * recording rather than going back to the source file.  Until the new size
+ * is ready, the previous rendering is scaled to fit. */
+
+static void slide_paintable_iface_init(GdkPaintableInterface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE(SlidePaintable, colloquium_slide_paintable, G_TYPE_OBJECT,
+                              G_IMPLEMENT_INTERFACE(GDK_TYPE_PAINTABLE,
+                                                    slide_paintable_iface_init))
+
+
+static void slide_paintable_dispose(GObject *obj)
+{
+    SlidePaintable *sp = COLLOQUIUM_SLIDE_PAINTABLE(obj);
+    slide_paintable_cancel(sp);
+    if ( sp->tex != NULL ) {
+        g_object_unref(sp->tex);
+        sp->tex = NULL;
+    }
+    G_OBJECT_CLASS(colloquium_slide_paintable_parent_class)->dispose(obj);
+}
+
+
+static void colloquium_slide_paintable_class_init(SlidePaintableClass *klass)
+{
+    GObjectClass *oklass = G_OBJECT_CLASS(klass);
+    oklass->dispose = slide_paintable_dispose;
+}
+
+
+static void colloquium_slide_paintable_init(SlidePaintable *sp)
+{
+}
+
+
+static double slide_paintable_get_intrinsic_aspect_ratio(GdkPaintable *p)
+{
+    SlidePaintable *sp = COLLOQUIUM_SLIDE_PAINTABLE(p);
+    if ( sp->slide->aspect > 0.0 ) return sp->slide->aspect;
+    if ( sp->tex != NULL ) {
+        return gdk_paintable_get_intrinsic_aspect_ratio(GDK_PAINTABLE(sp->tex));
+    }
+    return 0.0;
+}
+
+
+static void render_done(GdkTexture *tex, gpointer vp)
+{
+    SlidePaintable *sp = vp;
+    double old_aspect;
+
+    sp->job = NULL;
+    if ( tex == NULL ) {
+        sp->failed_w = sp->job_w;
+        sp->job_w = 0;
+        return;
+    }
+
+    old_aspect = slide_paintable_get_intrinsic_aspect_ratio(GDK_PAINTABLE(sp));
+    if ( sp->tex != NULL ) g_object_unref(sp->tex);
+    sp->tex = g_object_ref(tex);
+    sp->tex_w = sp->job_w;
+    sp->job_w = 0;
+
+    /* If this happened during the snapshot, the new texture is about to be
+     * drawn anyway */
+    if ( !sp->in_snapshot ) {
+        gdk_paintable_invalidate_contents(GDK_PAINTABLE(sp));
+    }
+    if ( old_aspect != slide_paintable_get_intrinsic_aspect_ratio(GDK_PAINTABLE(sp)) ) {
+        gdk_paintable_invalidate_size(GDK_PAINTABLE(sp));
+    }
+}
+
+
+static void preview_done(GdkTexture *tex, gpointer vp)
+{
+    SlidePaintable *sp = vp;
+    double old_aspect;
+
+    /* Anything real which is already there is better than a preview */
+    if ( sp->tex != NULL ) return;
+
+    old_aspect = slide_paintable_get_intrinsic_aspect_ratio(GDK_PAINTABLE(sp));
+    sp->tex = g_object_ref(tex);
+    sp->tex_w = 0;
+    gdk_paintable_invalidate_contents(GDK_PAINTABLE(sp));
+    if ( old_aspect != slide_paintable_get_intrinsic_aspect_ratio(GDK_PAINTABLE(sp)) ) {
+        gdk_paintable_invalidate_size(GDK_PAINTABLE(sp));
+    }
+}
+
+
+static void request_render(SlidePaintable *sp, int w)
+{
+    render_job_cancel(sp->job);
+    sp->job_w = w;
+    sp->job = NULL;
+
+    /* Show a preview first if there's nothing to show yet */
+    sp->job = render_queue_submit_progressive(sp->slide, w, sp->prio,
+                                              (sp->tex == NULL) ? preview_done : NULL,
+                                              render_done, sp);
+}
+
+
+static void slide_paintable_snapshot(GdkPaintable *p, GdkSnapshot *snapshot,
+                                     double width, double height)
+{
+    SlidePaintable *sp = COLLOQUIUM_SLIDE_PAINTABLE(p);
+    int w = ceil(width*sp->scale);  /* Exactly as many pixels as the screen */
+
+    if ( (w > 0) && (w != sp->tex_w) && (w != sp->job_w) && (w != sp->failed_w) ) {
+        sp->in_snapshot = 1;
+        request_render(sp, w);
+        sp->in_snapshot = 0;
+    }
+
+    if ( sp->tex != NULL ) {
+        gdk_paintable_snapshot(GDK_PAINTABLE(sp->tex), snapshot, width, height);
+    }
+}
+
+
+static void slide_paintable_iface_init(GdkPaintableInterface *iface)
+{
+    iface->snapshot = slide_paintable_snapshot;
+    iface->get_intrinsic_aspect_ratio = slide_paintable_get_intrinsic_aspect_ratio;
+}
+
+
+SlidePaintable *slide_paintable_new(Slide *s, enum render_priority prio)
+{
+    SlidePaintable *sp;
+
+    sp = g_object_new(COLLOQUIUM_TYPE_SLIDE_PAINTABLE, NULL);
+    sp->slide = s;
+    sp->prio = prio;
+    sp->tex = NULL;
+    sp->tex_w = 0;
+    sp->job = NULL;
+    sp->job_w = 0;
+    sp->failed_w = 0;
+    sp->in_snapshot = 0;
+    sp->scale = 1.0;
+    return sp;
+}
+
+
+/* The previous slide stays visible until the new one has been rendered */
+void slide_paintable_set_slide(SlidePaintable *sp, Slide *s)
+{
+    if ( sp->slide == s ) return;
+    sp->slide = s;
+    slide_paintable_refresh(sp);
+    gdk_paintable_invalidate_size(GDK_PAINTABLE(sp));
+}
+
+
+/* Any outstanding render is re-queued with the new priority */
+void slide_paintable_set_priority(SlidePaintable *sp, enum render_priority prio)
+{
+    if ( sp->prio == prio ) return;
+    sp->prio = prio;
+    if ( sp->job != NULL ) request_render(sp, sp->job_w);
+}
+
+
+/* Render again (e.g. if the source file has changed) the next time the
+ * slide is drawn */
+void slide_paintable_refresh(SlidePaintable *sp)
+{
+    slide_paintable_cancel(sp);
+    sp->tex_w = 0;
+    sp->failed_w = 0;
+    gdk_paintable_invalidate_contents(GDK_PAINTABLE(sp));
+}
+
+
+void slide_paintable_cancel(SlidePaintable *sp)
+{
+    render_job_cancel(sp->job);
+    sp->job = NULL;
+    sp->job_w = 0;
+}
+
+
+/* Call from the snapshot function of the widget containing the paintable.
+ * The slide will be re-rendered only if this changes the size in device
+ * pixels. */
+void slide_paintable_set_scale(SlidePaintable *sp, double scale)
+{
+    if ( scale > 0.0 ) sp->scale = scale;
+}
+
+
+/* Device pixels per logical pixel, including fractional scaling */
+double slide_paintable_widget_scale(GtkWidget *widget)
+{
+    GtkNative *native;
+    GdkSurface *surf;
+
+    native = gtk_widget_get_native(widget);
+    if ( native == NULL ) return 1.0;
+    surf = gtk_native_get_surface(native);
+    if ( surf == NULL ) return gtk_widget_get_scale_factor(widget);
+    return gdk_surface_get_scale(surf);
+}
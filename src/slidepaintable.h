@@ -0,0 +1,75 @@
+/*
+ * slidepaintable.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COLLOQUIUM_SLIDE_PAINTABLE_H
+#define COLLOQUIUM_SLIDE_PAINTABLE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <glib-object.h>
+
+typedef struct _colloquiumslidepaintable SlidePaintable;
+typedef struct _colloquiumslidepaintableclass SlidePaintableClass;
+
+#include "slide.h"
+#include "renderqueue.h"
+
+#define COLLOQUIUM_TYPE_SLIDE_PAINTABLE (colloquium_slide_paintable_get_type())
+
+#define COLLOQUIUM_SLIDE_PAINTABLE(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), \
+                                         COLLOQUIUM_TYPE_SLIDE_PAINTABLE, SlidePaintable))
+
+struct _colloquiumslidepaintable
+{
+    GObject              parent_instance;
+
+    /*< private >*/
+    Slide               *slide;
+    enum render_priority prio;
+    GdkTexture          *tex;        /* Most recent rendering */
+    int                  tex_w;      /* ... and its width, or zero if stale */
+    RenderJob           *job;
+    int                  job_w;
+    int                  failed_w;
+    int                  in_snapshot;
+    double               scale;      /* Device pixels per logical pixel */
+};
+
+struct _colloquiumslidepaintableclass
+{
+    GObjectClass parent_class;
+};
+
+extern GType colloquium_slide_paintable_get_type(void);
+
+extern SlidePaintable *slide_paintable_new(Slide *s, enum render_priority prio);
+extern void slide_paintable_set_slide(SlidePaintable *sp, Slide *s);
+extern void slide_paintable_set_priority(SlidePaintable *sp, enum render_priority prio);
+extern void slide_paintable_refresh(SlidePaintable *sp);
+extern void slide_paintable_cancel(SlidePaintable *sp);
+extern void slide_paintable_set_scale(SlidePaintable *sp, double scale);
+extern double slide_paintable_widget_scale(GtkWidget *widget);
+
+#endif /* COLLOQUIUM_SLIDE_PAINTABLE_H */
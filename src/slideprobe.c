@@ -0,0 +1,436 @@
+/*
+ * slideprobe.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+#include <poppler.h>
+
+#include <libintl.h>
+#define _(x) gettext(x)
+
+#include "slide.h"
+#include "doccache.h"
+#include "slideprobe.h"
+
+
+/* Everything which needs to be known about a slide file before it can be
+ * laid out: the type, the number of pages and the shape of each page.  Each
+ * file is probed once, in a single pass, in the background (see
+ * slide_probe_start).  Results are kept for the rest of the session, unless
+ * the file's modification time changes (see doc_cache_get_mtime), which the
+ * main thread can check without touching the disk. */
+struct probe_entry
+{
+    int ready;
+    guint64 mtime;          /* When probed, or 0 if not known */
+    enum slide_filetype type;
+    int n_pages;
+    float *aspects;
+    GSList *waiters;
+};
+
+
+struct waiter
+{
+    SlideProbeFunc done;
+    gpointer vp;
+};
+
+
+struct probe_task
+{
+    GFile *file;
+    struct probe_entry *e;
+};
+
+
+static GHashTable *probes = NULL;
+static GThreadPool *pool = NULL;
+static GCond probe_cond;
+G_LOCK_DEFINE_STATIC(probes);
+
+
+static enum slide_filetype type_for_content_type(const char *type)
+{
+    /* PDF types */
+    if ( g_content_type_equals(type, "application/pdf") ) return SLIDE_FTYPE_PDF;
+    if ( g_content_type_equals(type, "com.adobe.pdf") ) return SLIDE_FTYPE_PDF;
+
+    /* Bitmap images */
+    if ( g_content_type_equals(type, "public.png") ) return SLIDE_FTYPE_IMAGE;
+    if ( g_content_type_equals(type, "image/jpeg") ) return SLIDE_FTYPE_IMAGE;
+    if ( g_content_type_equals(type, "public.jpeg") ) return SLIDE_FTYPE_IMAGE;
+    if ( g_content_type_equals(type, "image/png") ) return SLIDE_FTYPE_IMAGE;
+
+    /* Vector images */
+    if ( g_content_type_equals(type, "image/svg+xml") ) return SLIDE_FTYPE_SVG;
+    if ( g_content_type_equals(type, "public.svg-image") ) return SLIDE_FTYPE_SVG;
+
+    /* Video types */
+    if ( g_content_type_equals(type, "image/gif") ) return SLIDE_FTYPE_VIDEO;
+    if ( g_content_type_equals(type, "com.compuserve.gif") ) return SLIDE_FTYPE_VIDEO;
+    if ( g_content_type_equals(type, "video/mpeg") ) return SLIDE_FTYPE_VIDEO;
+    if ( g_content_type_equals(type, "public.mpeg") ) return SLIDE_FTYPE_VIDEO;
+
+    fprintf(stderr, "File format not recognised: %s\n", type);
+    return SLIDE_FTYPE_UNKNOWN;
+}
+
+
+static void probe_pdf(GFile *file, struct probe_entry *e)
+{
+    PopplerDocument *doc;
+    int i;
+
+    /* The document goes back to the cache, ready for rendering */
+    doc = doc_cache_get_pdf(file);
+    if ( doc == NULL ) return;
+
+    e->n_pages = poppler_document_get_n_pages(doc);
+    e->aspects = malloc(e->n_pages*sizeof(float));
+    if ( e->aspects == NULL ) {
+        e->n_pages = 0;
+    }
+    for ( i=0; i<e->n_pages; i++ ) {
+        PopplerPage *page = poppler_document_get_page(doc, i);
+        e->aspects[i] = -1.0;
+        if ( page != NULL ) {
+            double pw, ph;
+            poppler_page_get_size(page, &pw, &ph);
+            e->aspects[i] = pw/ph;
+            g_object_unref(page);
+        }
+    }
+    doc_cache_put_pdf(doc);
+}
+
+
+static void size_prepared_sig(GdkPixbufLoader *loader, int w, int h, float *aspect)
+{
+    *aspect = (float)w/h;
+}
+
+
+/* Reads only as far as the image header */
+static float probe_image(GFile *file)
+{
+    GFileInputStream *stream;
+    GdkPixbufLoader *loader;
+    GError *error = NULL;
+    float aspect = -1.0;
+    guchar buf[4096];
+
+    stream = g_file_read(file, NULL, &error);
+    if ( stream == NULL ) {
+        fprintf(stderr, _("Failed to open read (aspect): %s\n"), error->message);
+        g_error_free(error);
+        return -1.0;
+    }
+
+    loader = gdk_pixbuf_loader_new();
+    g_signal_connect(G_OBJECT(loader), "size-prepared",
+                     G_CALLBACK(size_prepared_sig), &aspect);
+
+    while ( aspect < 0.0 ) {
+        gssize n = g_input_stream_read(G_INPUT_STREAM(stream), buf, sizeof(buf),
+                                       NULL, NULL);
+        if ( n <= 0 ) break;
+        if ( !gdk_pixbuf_loader_write(loader, buf, n, NULL) ) break;
+    }
+
+    gdk_pixbuf_loader_close(loader, NULL);
+    g_object_unref(loader);
+    g_object_unref(stream);
+
+    if ( aspect < 0.0 ) {
+        fprintf(stderr, _("Failed to load image (aspect)\n"));
+    }
+    return aspect;
+}
+
+
+/* The handle stays in the cache, ready for rendering */
+static float probe_svg(GFile *file)
+{
+    RsvgHandle *fh;
+    float aspect;
+
+    fh = doc_cache_get_svg(file, &aspect);
+    if ( fh == NULL ) return -1.0;
+    g_object_unref(fh);
+    return aspect;
+}
+
+
+/* Fills in 'e', without the lock held */
+static void probe_file(GFile *file, struct probe_entry *e)
+{
+    GFileInfo *info;
+    GError *error = NULL;
+
+    e->type = SLIDE_FTYPE_UNKNOWN;
+    e->n_pages = 0;
+    e->aspects = NULL;
+    e->mtime = doc_cache_get_mtime(file);
+
+    info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+                             G_FILE_QUERY_INFO_NONE, NULL, &error);
+    if ( info == NULL ) {
+        fprintf(stderr, _("Failed to read info: %s\n"), error->message);
+        g_error_free(error);
+        return;
+    }
+    e->type = type_for_content_type(g_file_info_get_content_type(info));
+    g_object_unref(info);
+
+    switch ( e->type ) {
+
+        case SLIDE_FTYPE_PDF:
+        probe_pdf(file, e);
+        return;
+
+        case SLIDE_FTYPE_IMAGE:
+        case SLIDE_FTYPE_SVG:
+        e->aspects = malloc(sizeof(float));
+        if ( e->aspects == NULL ) return;
+        e->n_pages = 1;
+        if ( e->type == SLIDE_FTYPE_IMAGE ) {
+            e->aspects[0] = probe_image(file);
+        } else {
+            e->aspects[0] = probe_svg(file);
+        }
+        return;
+
+        default:
+        /* Video aspect ratio comes from the media stream */
+        e->n_pages = 1;
+        return;
+    }
+}
+
+
+static gboolean notify_waiters(gpointer vp)
+{
+    GSList *waiters = vp;
+    GSList *l;
+    for ( l=waiters; l!=NULL; l=l->next ) {
+        struct waiter *w = l->data;
+        w->done(w->vp);
+        free(w);
+    }
+    g_slist_free(waiters);
+    return G_SOURCE_REMOVE;
+}
+
+
+/* Call with lock held.  Returns the entry for 'key' (the URI), creating it
+ * in the "not ready" state if necessary.  If the file has changed since it
+ * was probed, according to 'mtime', the old results are thrown away.
+ * '*created' is set if the caller is now responsible for probing the file.
+ * Takes ownership of 'key'. */
+static struct probe_entry *get_entry(char *key, guint64 mtime, int *created)
+{
+    struct probe_entry *e;
+
+    if ( probes == NULL ) {
+        probes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    *created = 0;
+    e = g_hash_table_lookup(probes, key);
+    if ( (e != NULL) && e->ready && (mtime != 0) && (e->mtime != 0)
+      && (e->mtime != mtime) )
+    {
+        /* Nothing else refers to a finished entry */
+        g_hash_table_remove(probes, key);
+        free(e->aspects);
+        free(e);
+        e = NULL;
+    }
+    if ( e != NULL ) {
+        g_free(key);
+        return e;
+    }
+
+    e = malloc(sizeof(struct probe_entry));
+    if ( e == NULL ) {
+        g_free(key);
+        return NULL;
+    }
+    e->ready = 0;
+    e->mtime = 0;
+    e->aspects = NULL;
+    e->waiters = NULL;
+    g_hash_table_insert(probes, key, e);
+    *created = 1;
+    return e;
+}
+
+
+/* Probes the file (without the lock), then publishes the result */
+static void complete_entry(GFile *file, struct probe_entry *e)
+{
+    struct probe_entry result;
+    GSList *waiters;
+
+    probe_file(file, &result);
+
+    G_LOCK(probes);
+    e->type = result.type;
+    e->n_pages = result.n_pages;
+    e->aspects = result.aspects;
+    e->mtime = result.mtime;
+    e->ready = 1;
+    waiters = e->waiters;
+    e->waiters = NULL;
+    g_cond_broadcast(&probe_cond);
+    G_UNLOCK(probes);
+
+    if ( waiters != NULL ) {
+        g_idle_add_full(G_PRIORITY_DEFAULT, notify_waiters, waiters, NULL);
+    }
+}
+
+
+static void probe_task(gpointer data, gpointer vp)
+{
+    struct probe_task *task = data;
+    complete_entry(task->file, task->e);
+    g_object_unref(task->file);
+    free(task);
+}
+
+
+/* Probes the file for a newly created entry, in the background */
+static void start_task(GFile *file, struct probe_entry *e)
+{
+    struct probe_task *task;
+
+    if ( pool == NULL ) {
+        pool = g_thread_pool_new(probe_task, NULL, g_get_num_processors(),
+                                 FALSE, NULL);
+    }
+
+    task = malloc(sizeof(struct probe_task));
+    if ( task == NULL ) {
+        complete_entry(file, e);
+        return;
+    }
+    task->file = g_object_ref(file);
+    task->e = e;
+    g_thread_pool_push(pool, task, NULL);
+}
+
+
+/* Call from the main thread.  Starts probing 'file' in the background, unless
+ * that has already happened, and calls 'done' when the results are ready
+ * (immediately, if they already are). */
+void slide_probe_start(GFile *file, SlideProbeFunc done, gpointer vp)
+{
+    struct probe_entry *e;
+    struct waiter *w;
+    char *key;
+    guint64 mtime;
+    int created;
+
+    key = g_file_get_uri(file);
+    mtime = doc_cache_get_mtime(file);
+
+    G_LOCK(probes);
+    e = get_entry(key, mtime, &created);
+    if ( (e == NULL) || e->ready ) {
+        G_UNLOCK(probes);
+        done(vp);
+        return;
+    }
+
+    w = malloc(sizeof(struct waiter));
+    if ( w != NULL ) {
+        w->done = done;
+        w->vp = vp;
+        e->waiters = g_slist_prepend(e->waiters, w);
+    }
+    G_UNLOCK(probes);
+
+    if ( created ) start_task(file, e);
+}
+
+
+/* Returns the probe results for page 'page' (counting from 1) of 'file'.
+ * Worker threads probe the file now if necessary, or wait for a probe which
+ * is already running.  The main thread never waits: if the results aren't
+ * ready yet, probing starts in the background and the type comes back as
+ * unknown (use slide_probe_start to find out when to try again).  Returns
+ * non-zero on error, or if the results aren't available yet. */
+int slide_probe_get(GFile *file, int page, struct slide_probe *pr)
+{
+    struct probe_entry *e;
+    char *key;
+    guint64 mtime;
+    int created;
+
+    pr->type = SLIDE_FTYPE_UNKNOWN;
+    pr->n_pages = 0;
+    pr->aspect = -1.0;
+
+    key = g_file_get_uri(file);
+    mtime = doc_cache_get_mtime(file);
+
+    G_LOCK(probes);
+    e = get_entry(key, mtime, &created);
+    if ( e == NULL ) {
+        G_UNLOCK(probes);
+        return 1;
+    }
+
+    if ( !e->ready && g_main_context_is_owner(g_main_context_default()) ) {
+        G_UNLOCK(probes);
+        if ( created ) start_task(file, e);
+        return 1;
+    }
+
+    if ( created ) {
+        G_UNLOCK(probes);
+        complete_entry(file, e);
+        G_LOCK(probes);
+    }
+
+    while ( !e->ready ) {
+        g_cond_wait(&probe_cond, &G_LOCK_NAME(probes));
+    }
+
+    pr->type = e->type;
+    pr->n_pages = e->n_pages;
+    if ( (e->aspects != NULL) && (page >= 1) && (page <= e->n_pages) ) {
+        pr->aspect = e->aspects[page-1];
+    }
+    G_UNLOCK(probes);
+
+    return pr->type == SLIDE_FTYPE_UNKNOWN;
+}
@@ -0,0 +1,47 @@
+/*
+ * slideprobe.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SLIDEPROBE_H
+#define SLIDEPROBE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gio/gio.h>
+
+#include "slide.h"
+
+struct slide_probe
+{
+    enum slide_filetype type;
+    int n_pages;    /* 1 unless PDF */
+    float aspect;   /* Of the requested page, or negative if unknown */
+};
+
+/* Called on the main thread once the file has been probed */
+typedef void (*SlideProbeFunc)(gpointer vp);
+
+extern void slide_probe_start(GFile *file, SlideProbeFunc done, gpointer vp);
+extern int slide_probe_get(GFile *file, int page, struct slide_probe *pr);
+
+#endif /* SLIDEPROBE_H */
@@ -39,6 +39,8 @@
 #include "slide.h"
 #include "slideview.h"
 #include "laseroverlay.h"
+#include "slidepaintable.h"
+#include "slideprobe.h"
 
 
 G_DEFINE_FINAL_TYPE(SlideView, colloquium_slide_view, GTK_TYPE_WIDGET)
@@ -47,12 +49,16 @@ static void slide_view_finalize(GObject *object);
 static void slide_view_realize(GtkWidget *w);
 static void slide_view_size_allocate(GtkWidget *widget, int w, int h, int baseline);
 static void slide_view_dispose(GObject *object);
+static void slide_view_unmap(GtkWidget *w);
+static void slide_view_snapshot(GtkWidget *w, GtkSnapshot *snapshot);
 
 static void colloquium_slide_view_class_init(SlideViewClass *klass)
 {
     GtkWidgetClass *wklass = GTK_WIDGET_CLASS(klass);
     GObjectClass *oklass = G_OBJECT_CLASS(klass);
     wklass->realize = slide_view_realize;
+    wklass->unmap = slide_view_unmap;
+    wklass->snapshot = slide_view_snapshot;
     wklass->size_allocate = slide_view_size_allocate;
     oklass->finalize = slide_view_finalize;
     oklass->dispose = slide_view_dispose;
@@ -73,7 +79,30 @@ static void slide_view_finalize(GObject *object)
 static void slide_view_dispose(GObject *object)
 {
     SlideView *sv = COLLOQUIUM_SLIDE_VIEW(object);
-    gtk_widget_unparent(sv->overlay);
+    g_clear_object(&sv->paintable);
+    if ( sv->overlay != NULL ) {
+        gtk_widget_unparent(sv->overlay);
+        sv->overlay = NULL;
+    }
+}
+
+
+static void slide_view_unmap(GtkWidget *w)
+{
+    SlideView *sv = COLLOQUIUM_SLIDE_VIEW(w);
+
+    /* Rendering will be requested again if it gets drawn */
+    if ( sv->paintable != NULL ) slide_paintable_cancel(sv->paintable);
+
+    GTK_WIDGET_CLASS(colloquium_slide_view_parent_class)->unmap(w);
+}
+
+
+static void slide_view_snapshot(GtkWidget *w, GtkSnapshot *snapshot)
+{
+    SlideView *sv = COLLOQUIUM_SLIDE_VIEW(w);
+    slide_paintable_set_scale(sv->paintable, slide_paintable_widget_scale(w));
+    gtk_widget_snapshot_child(w, sv->overlay, snapshot);
 }
 
 
@@ -92,6 +121,27 @@ static void slide_view_realize(GtkWidget *w)
 }
 
 
+static void probe_done(gpointer vp)
+{
+    SlideView *sv = vp;
+    if ( sv->overlay != NULL ) {
+        sv->need_render = 1;
+        gtk_widget_queue_allocate(GTK_WIDGET(sv));
+    }
+    g_object_unref(sv);
+}
+
+
+/* The type and shape of the slide aren't known until the file has been
+ * probed, so it has to be laid out again afterwards */
+static void probe_slide(SlideView *sv)
+{
+    if ( (sv->slide->ext_file == NULL)
+      || (sv->slide->file_type != SLIDE_FTYPE_UNKNOWN) ) return;
+    slide_probe_start(sv->slide->ext_file, probe_done, g_object_ref(sv));
+}
+
+
 void slide_view_set_slide(GtkWidget *widget, Slide *slide)
 {
     SlideView *e = COLLOQUIUM_SLIDE_VIEW(widget);
@@ -100,13 +150,13 @@ void slide_view_set_slide(GtkWidget *widget, Slide *slide)
     /* Slide is actually rendered on size_allocate */
     e->need_render = 1;
     gtk_widget_queue_allocate(widget);
+    probe_slide(e);
 }
 
 
 static void slide_view_size_allocate(GtkWidget *widget, int w, int h, int baseline)
 {
     GtkAllocation alloc;
-    int old_w;
     SlideView *sv = COLLOQUIUM_SLIDE_VIEW(widget);
 
     alloc.x = 0;
@@ -115,10 +165,16 @@ static void slide_view_size_allocate(GtkWidget *widget, int w, int h, int baseli
     alloc.height = h;
     gtk_widget_size_allocate(sv->overlay, &alloc, -1);
 
-    old_w = gdk_paintable_get_intrinsic_width(gtk_picture_get_paintable(GTK_PICTURE(sv->picture)));
-    if ( alloc.width > old_w || sv->need_render ) {
-        gtk_picture_set_paintable(GTK_PICTURE(sv->picture),
-                                  slide_render(sv->slide, alloc.width));
+    if ( sv->need_render ) {
+        if ( slide_ftype(sv->slide) == SLIDE_FTYPE_VIDEO ) {
+            gtk_picture_set_paintable(GTK_PICTURE(sv->picture),
+                                      slide_render(sv->slide, alloc.width));
+        } else {
+            /* The previous slide stays on screen until the new one is ready */
+            slide_paintable_set_slide(sv->paintable, sv->slide);
+            gtk_picture_set_paintable(GTK_PICTURE(sv->picture),
+                                      GDK_PAINTABLE(sv->paintable));
+        }
         sv->need_render = 0;
     }
 
@@ -138,10 +194,12 @@ GtkWidget *slide_view_new(Narrative *n, Slide *slide)
     sv->n = n;
     sv->slide = slide;
     sv->need_render = 1;
+    sv->paintable = slide_paintable_new(slide, RENDER_PRIORITY_PRESENTING);
 
     gtk_widget_add_css_class(GTK_WIDGET(sv), "slideview");
 
-    /* Slide will be rendered in response to size_allocate */
+    /* The slide is set in response to size_allocate, and then rendered at
+     * whatever size the picture is drawn */
     sv->picture = gtk_picture_new_for_paintable(placeholder_image());
 
     sv->overlay  = gtk_overlay_new();
@@ -153,6 +211,7 @@ GtkWidget *slide_view_new(Narrative *n, Slide *slide)
     gtk_widget_set_parent(GTK_WIDGET(sv->overlay), GTK_WIDGET(sv));
     gtk_widget_set_can_focus(GTK_WIDGET(sv), TRUE);
     gtk_widget_grab_focus(GTK_WIDGET(sv));
+    probe_slide(sv);
 
     return GTK_WIDGET(sv);
 }
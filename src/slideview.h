@@ -33,6 +33,7 @@
 
 #include "narrative.h"
 #include "slide.h"
+#include "slidepaintable.h"
 
 typedef struct _colloquiumslideview SlideView;
 typedef struct _colloquiumslideviewclass SlideViewClass;
@@ -54,6 +55,7 @@ struct _colloquiumslideview
     GtkWidget           *laser;
     GtkWidget           *picture;
     int                  need_render;
+    SlidePaintable      *paintable;
 };
 
 struct _colloquiumslideviewclass
@@ -0,0 +1,663 @@
+/*
+ * thumbcache.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <libintl.h>
+#define _(x) gettext(x)
+
+#include "slide.h"
+#include "thumbcache.h"
+
+
+/* Thumbnails which survive between sessions, in $XDG_CACHE_HOME/colloquium.
+ *
+ * The pixels live in a pack file, which is memory-mapped so that textures can
+ * be made directly from it without copying.  New thumbnails are appended to
+ * the pack, and a line is appended to the text index:
+ *
+ *    <sha1 of slide key and width> <offset> <w> <h> <stride> <aspect> <atime>
+ *
+ * Later lines override earlier ones.  The first line of the index names the
+ * current pack file.  When the cache goes over the size set by the
+ * "thumbnail-cache-size" setting (in megabytes), the most recently used
+ * thumbnails are copied to a new pack and index, which replace the old ones.
+ * That's done on its own thread, mostly without the lock held, so that it
+ * never holds up the main thread. */
+
+#define INDEX_HEADER "colloquium-thumbnails 1"
+
+struct thumb_entry
+{
+    guint64 offset;
+    int w;
+    int h;
+    int stride;
+    float aspect;
+    gint64 atime;
+    int touched;    /* New atime has been written to the index */
+};
+
+
+static GHashTable *thumbs = NULL;
+static char *cache_dir = NULL;
+static char *pack_name = NULL;
+static GBytes *pack_bytes = NULL;
+static gsize total_size = 0;
+static int n_index_lines = 0;
+static int disabled = 0;
+static int compacting = 0;
+static GSettings *settings = NULL;
+G_LOCK_DEFINE_STATIC(thumb_cache);
+
+
+static gsize entry_size(struct thumb_entry *e)
+{
+    return (gsize)e->stride * e->h;
+}
+
+
+static char *cache_path(const char *name)
+{
+    return g_build_filename(cache_dir, name, NULL);
+}
+
+
+static gsize get_budget(void)
+{
+    return (gsize)g_settings_get_uint(settings, "thumbnail-cache-size")*1024*1024;
+}
+
+
+static void remap(void)
+{
+    char *path;
+    GMappedFile *mf;
+
+    /* Textures made from the old mapping keep it alive */
+    if ( pack_bytes != NULL ) g_bytes_unref(pack_bytes);
+    pack_bytes = NULL;
+
+    if ( pack_name == NULL ) return;
+    path = cache_path(pack_name);
+    mf = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if ( mf == NULL ) return;
+    pack_bytes = g_mapped_file_get_bytes(mf);
+    g_mapped_file_unref(mf);
+}
+
+
+static void format_entry(GString *str, const char *key, struct thumb_entry *e)
+{
+    char aspect[G_ASCII_DTOSTR_BUF_SIZE];
+    g_ascii_dtostr(aspect, G_ASCII_DTOSTR_BUF_SIZE, e->aspect);
+    g_string_append_printf(str, "%s %" G_GUINT64_FORMAT " %i %i %i %s %" G_GINT64_FORMAT "\n",
+                           key, e->offset, e->w, e->h, e->stride, aspect, e->atime);
+}
+
+
+static void append_index(const char *key, struct thumb_entry *e)
+{
+    char *path;
+    FILE *fh;
+    GString *str;
+
+    path = cache_path("thumbnails.idx");
+    fh = fopen(path, "a");
+    g_free(path);
+    if ( fh == NULL ) return;
+
+    str = g_string_new(NULL);
+    format_entry(str, key, e);
+    fputs(str->str, fh);
+    g_string_free(str, TRUE);
+    fclose(fh);
+    n_index_lines++;
+}
+
+
+static int parse_entry(char **bits, struct thumb_entry *e)
+{
+    if ( g_strv_length(bits) != 7 ) return 1;
+    e->offset = g_ascii_strtoull(bits[1], NULL, 10);
+    e->w = atoi(bits[2]);
+    e->h = atoi(bits[3]);
+    e->stride = atoi(bits[4]);
+    e->aspect = g_ascii_strtod(bits[5], NULL);
+    e->atime = g_ascii_strtoll(bits[6], NULL, 10);
+    e->touched = 0;
+    if ( (e->w <= 0) || (e->h <= 0) || (e->stride < e->w*4) || (e->aspect <= 0.0) ) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static void read_index(void)
+{
+    char *path;
+    char *contents;
+    char **lines;
+    gsize pack_len;
+    int i;
+
+    path = cache_path("thumbnails.idx");
+    if ( !g_file_get_contents(path, &contents, NULL, NULL) ) {
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    lines = g_strsplit(contents, "\n", 0);
+    g_free(contents);
+
+    if ( (lines[0] == NULL)
+      || !g_str_has_prefix(lines[0], INDEX_HEADER" ")
+      || (strchr(lines[0]+strlen(INDEX_HEADER)+1, '/') != NULL) )
+    {
+        g_strfreev(lines);
+        return;
+    }
+
+    pack_name = g_strdup(lines[0]+strlen(INDEX_HEADER)+1);
+    remap();
+    pack_len = (pack_bytes != NULL) ? g_bytes_get_size(pack_bytes) : 0;
+
+    for ( i=1; lines[i] != NULL; i++ ) {
+
+        char **bits;
+        struct thumb_entry *e;
+        struct thumb_entry *old;
+
+        if ( lines[i][0] == '\0' ) continue;
+        n_index_lines++;
+
+        e = malloc(sizeof(struct thumb_entry));
+        if ( e == NULL ) break;
+
+        bits = g_strsplit(lines[i], " ", 0);
+        if ( parse_entry(bits, e) || (e->offset + entry_size(e) > pack_len) ) {
+            free(e);
+            g_strfreev(bits);
+            continue;
+        }
+
+        old = g_hash_table_lookup(thumbs, bits[0]);
+        if ( old != NULL ) total_size -= entry_size(old);
+        total_size += entry_size(e);
+        g_hash_table_replace(thumbs, g_strdup(bits[0]), e);
+        g_strfreev(bits);
+    }
+
+    g_strfreev(lines);
+}
+
+
+/* A thumbnail as it was when compaction started */
+struct compact_item
+{
+    char *key;
+    guint64 offset;
+    gsize size;
+    gint64 atime;
+    gint64 new_offset;  /* Negative if it's being dropped */
+};
+
+
+static gint compare_atime(gconstpointer a, gconstpointer b)
+{
+    const struct compact_item *ia = a;
+    const struct compact_item *ib = b;
+    if ( ia->atime == ib->atime ) return 0;
+    return (ia->atime > ib->atime) ? -1 : 1;  /* Most recent first */
+}
+
+
+/* Call with lock held.  Writes out a fresh index, naming 'new_pack_name',
+ * which atomically replaces the old one.  Returns non-zero on error. */
+static int write_index(const char *new_pack_name)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+    GString *index;
+    GError *error = NULL;
+    char *path;
+    int r = 0;
+
+    index = g_string_new(INDEX_HEADER" ");
+    g_string_append_printf(index, "%s\n", new_pack_name);
+    n_index_lines = 0;
+    g_hash_table_iter_init(&iter, thumbs);
+    while ( g_hash_table_iter_next(&iter, &key, &val) ) {
+        struct thumb_entry *e = val;
+        e->touched = 1;
+        format_entry(index, key, e);
+        n_index_lines++;
+    }
+
+    /* Written to a temporary file, then renamed */
+    path = cache_path("thumbnails.idx");
+    if ( !g_file_set_contents(path, index->str, index->len, &error) ) {
+        fprintf(stderr, _("Failed to write thumbnail cache: %s\n"), error->message);
+        g_error_free(error);
+        r = 1;
+    }
+    g_free(path);
+    g_string_free(index, TRUE);
+    return r;
+}
+
+
+/* Call with lock held, if there's no pack file yet */
+static void start_pack(void)
+{
+    char *new_pack_name;
+    char *path;
+    GError *error = NULL;
+
+    new_pack_name = g_strdup_printf("thumbnails-%08x.pack", g_random_int());
+    path = cache_path(new_pack_name);
+    if ( !g_file_set_contents(path, "", 0, &error) ) {
+        fprintf(stderr, _("Failed to create thumbnail cache: %s\n"), error->message);
+        g_error_free(error);
+        g_free(path);
+        g_free(new_pack_name);
+        disabled = 1;
+        return;
+    }
+    g_free(path);
+
+    g_hash_table_remove_all(thumbs);
+    total_size = 0;
+    if ( write_index(new_pack_name) ) {
+        path = cache_path(new_pack_name);
+        g_unlink(path);
+        g_free(path);
+        g_free(new_pack_name);
+        disabled = 1;
+        return;
+    }
+
+    pack_name = new_pack_name;
+    remap();
+}
+
+
+/* Call with lock held.  Moves everything over to the new pack: the
+ * thumbnails which were copied, and any which were stored in the meantime. */
+static void swap_pack(char *new_pack_name, struct compact_item *items, int n_items)
+{
+    GHashTable *done;
+    GHashTableIter iter;
+    gpointer key, val;
+    const guint8 *data = NULL;
+    gsize data_len = 0;
+    char *path;
+    FILE *fh;
+    int i;
+
+    done = g_hash_table_new(g_str_hash, g_str_equal);
+    for ( i=0; i<n_items; i++ ) {
+        g_hash_table_insert(done, items[i].key, &items[i]);
+    }
+
+    remap();
+    if ( pack_bytes != NULL ) data = g_bytes_get_data(pack_bytes, &data_len);
+
+    path = cache_path(new_pack_name);
+    fh = fopen(path, "ab");
+    g_free(path);
+
+    total_size = 0;
+    g_hash_table_iter_init(&iter, thumbs);
+    while ( g_hash_table_iter_next(&iter, &key, &val) ) {
+
+        struct thumb_entry *e = val;
+        struct compact_item *item = g_hash_table_lookup(done, key);
+        gsize size = entry_size(e);
+
+        if ( item != NULL ) {
+            if ( item->new_offset < 0 ) {
+                g_hash_table_iter_remove(&iter);
+                continue;
+            }
+            e->offset = item->new_offset;
+        } else {
+            /* Stored since compaction started */
+            long end;
+            if ( (fh == NULL) || (e->offset + size > data_len)
+              || (fwrite(data+e->offset, 1, size, fh) != size) || fflush(fh) )
+            {
+                g_hash_table_iter_remove(&iter);
+                continue;
+            }
+            end = ftell(fh);
+            e->offset = end - size;
+        }
+        total_size += size;
+    }
+    if ( fh != NULL ) fclose(fh);
+    g_hash_table_destroy(done);
+
+    if ( write_index(new_pack_name) ) {
+        path = cache_path(new_pack_name);
+        g_unlink(path);
+        g_free(path);
+        g_free(new_pack_name);
+        g_hash_table_remove_all(thumbs);
+        total_size = 0;
+        disabled = 1;
+        return;
+    }
+
+    if ( pack_name != NULL ) {
+        path = cache_path(pack_name);
+        g_unlink(path);
+        g_free(path);
+        g_free(pack_name);
+    }
+    pack_name = new_pack_name;
+    remap();
+}
+
+
+/* Copies the most recently used thumbnails, up to 'limit' bytes, into a new
+ * pack, then atomically replaces the index.  The copying is done without the
+ * lock held. */
+static gpointer compact_thread(gpointer vp)
+{
+    gsize limit = GPOINTER_TO_SIZE(vp);
+    GHashTableIter iter;
+    gpointer key, val;
+    struct compact_item *items;
+    int n_items;
+    GBytes *bytes;
+    const guint8 *data = NULL;
+    gsize data_len = 0;
+    char *new_pack_name;
+    char *path;
+    FILE *fh;
+    gsize size = 0;
+    guint64 offset = 0;
+    int fail = 0;
+    int i;
+
+    G_LOCK(thumb_cache);
+    n_items = g_hash_table_size(thumbs);
+    items = malloc(n_items*sizeof(struct compact_item));
+    if ( (items == NULL) && (n_items > 0) ) {
+        compacting = 0;
+        G_UNLOCK(thumb_cache);
+        return NULL;
+    }
+    remap();
+    bytes = (pack_bytes != NULL) ? g_bytes_ref(pack_bytes) : NULL;
+    i = 0;
+    g_hash_table_iter_init(&iter, thumbs);
+    while ( g_hash_table_iter_next(&iter, &key, &val) ) {
+        struct thumb_entry *e = val;
+        items[i].key = g_strdup(key);
+        items[i].offset = e->offset;
+        items[i].size = entry_size(e);
+        items[i].atime = e->atime;
+        items[i].new_offset = -1;
+        i++;
+    }
+    G_UNLOCK(thumb_cache);
+
+    if ( bytes != NULL ) data = g_bytes_get_data(bytes, &data_len);
+    qsort(items, n_items, sizeof(struct compact_item), compare_atime);
+
+    new_pack_name = g_strdup_printf("thumbnails-%08x.pack", g_random_int());
+    path = cache_path(new_pack_name);
+    fh = fopen(path, "wb");
+    g_free(path);
+    if ( fh == NULL ) {
+        fprintf(stderr, _("Failed to create thumbnail cache: %s\n"), strerror(errno));
+        g_free(new_pack_name);
+        new_pack_name = NULL;
+    }
+
+    for ( i=0; (fh != NULL) && (i<n_items); i++ ) {
+        struct compact_item *item = &items[i];
+        if ( (size + item->size > limit) || (item->offset + item->size > data_len) ) {
+            continue;
+        }
+        if ( fwrite(data+item->offset, 1, item->size, fh) != item->size ) {
+            fail = 1;
+            break;
+        }
+        item->new_offset = offset;
+        offset += item->size;
+        size += item->size;
+    }
+    if ( (fh != NULL) && (fclose(fh) || fail) ) {
+        path = cache_path(new_pack_name);
+        g_unlink(path);
+        g_free(path);
+        g_free(new_pack_name);
+        new_pack_name = NULL;
+    }
+    if ( bytes != NULL ) g_bytes_unref(bytes);
+
+    G_LOCK(thumb_cache);
+    if ( new_pack_name != NULL ) swap_pack(new_pack_name, items, n_items);
+    compacting = 0;
+    G_UNLOCK(thumb_cache);
+
+    for ( i=0; i<n_items; i++ ) g_free(items[i].key);
+    free(items);
+    return NULL;
+}
+
+
+/* Call with lock held */
+static void start_compaction(gsize limit)
+{
+    if ( compacting ) return;
+    compacting = 1;
+    g_thread_unref(g_thread_new("thumb-cache-compact", compact_thread,
+                                GSIZE_TO_POINTER(limit)));
+}
+
+
+/* Call with lock held.  Returns non-zero if the cache can't be used */
+static int ensure_cache(void)
+{
+    gsize budget;
+
+    if ( disabled ) return 1;
+    if ( thumbs != NULL ) return 0;
+
+    thumbs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+    settings = g_settings_new("uk.me.bitwiz.colloquium");
+
+    cache_dir = g_build_filename(g_get_user_cache_dir(), "colloquium", NULL);
+    if ( g_mkdir_with_parents(cache_dir, 0700) ) {
+        fprintf(stderr, _("Failed to create cache folder %s: %s\n"),
+                cache_dir, strerror(errno));
+        disabled = 1;
+        return 1;
+    }
+
+    read_index();
+
+    /* Start with a fresh pack if there isn't one.  Tidy up in the background
+     * if there are too many thumbnails or too many obsolete lines in the
+     * index. */
+    budget = get_budget();
+    if ( pack_name == NULL ) {
+        start_pack();
+    } else if ( total_size > budget ) {
+        start_compaction(budget*3/4);
+    } else if ( n_index_lines > 2*g_hash_table_size(thumbs) + 64 ) {
+        start_compaction(budget);
+    }
+
+    return disabled;
+}
+
+
+static char *make_key(Slide *s, int w)
+{
+    char *skey = slide_get_key(s);
+    char *key = g_strdup_printf("%s\n%i", skey, w);
+    char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    g_free(skey);
+    g_free(key);
+    return hash;
+}
+
+
+/* Returns a new texture backed by the pack file, or NULL.  The aspect ratio
+ * of the slide is also returned, so that the file needn't be opened at all.
+ * The first call reads the index, and a hit can write to it, so call this
+ * from a worker thread (the render queue does). */
+GdkTexture *thumb_cache_lookup(Slide *s, int w, float *aspect)
+{
+    char *key;
+    struct thumb_entry *e;
+    GdkTexture *tex = NULL;
+
+    if ( s->ext_file == NULL ) return NULL;
+    key = make_key(s, w);
+
+    G_LOCK(thumb_cache);
+
+    if ( ensure_cache() ) {
+        G_UNLOCK(thumb_cache);
+        g_free(key);
+        return NULL;
+    }
+
+    e = g_hash_table_lookup(thumbs, key);
+    if ( e != NULL ) {
+
+        gsize size = entry_size(e);
+
+        /* Appended since the pack was last mapped? */
+        if ( (pack_bytes == NULL) || (e->offset + size > g_bytes_get_size(pack_bytes)) ) {
+            remap();
+        }
+
+        if ( (pack_bytes != NULL) && (e->offset + size <= g_bytes_get_size(pack_bytes)) ) {
+
+            GBytes *bytes = g_bytes_new_from_bytes(pack_bytes, e->offset, size);
+            tex = gdk_memory_texture_new(e->w, e->h, GDK_MEMORY_DEFAULT,
+                                         bytes, e->stride);
+            g_bytes_unref(bytes);
+            *aspect = e->aspect;
+
+            e->atime = g_get_real_time()/G_USEC_PER_SEC;
+            if ( !e->touched ) {
+                append_index(key, e);
+                e->touched = 1;
+            }
+        }
+    }
+
+    G_UNLOCK(thumb_cache);
+    g_free(key);
+    return tex;
+}
+
+
+/* May be called from any thread, with a slide which isn't shared */
+void thumb_cache_store(Slide *s, int w, GdkTexture *tex)
+{
+    char *key;
+    char *path;
+    FILE *fh;
+    guchar *data;
+    struct thumb_entry *e;
+    long end;
+
+    e = malloc(sizeof(struct thumb_entry));
+    if ( e == NULL ) return;
+    e->w = gdk_texture_get_width(tex);
+    e->h = gdk_texture_get_height(tex);
+    e->stride = e->w*4;
+    e->aspect = slide_get_aspect(s);
+    e->atime = g_get_real_time()/G_USEC_PER_SEC;
+    e->touched = 1;
+
+    data = malloc(entry_size(e));
+    if ( data == NULL ) {
+        free(e);
+        return;
+    }
+    gdk_texture_download(tex, data, e->stride);
+
+    key = make_key(s, w);
+
+    G_LOCK(thumb_cache);
+
+    if ( ensure_cache() || (g_hash_table_lookup(thumbs, key) != NULL) ) {
+        G_UNLOCK(thumb_cache);
+        g_free(key);
+        free(data);
+        free(e);
+        return;
+    }
+
+    path = cache_path(pack_name);
+    fh = fopen(path, "ab");
+    g_free(path);
+    if ( fh == NULL ) {
+        G_UNLOCK(thumb_cache);
+        g_free(key);
+        free(data);
+        free(e);
+        return;
+    }
+    if ( (fwrite(data, 1, entry_size(e), fh) != entry_size(e)) || fflush(fh) ) {
+        fclose(fh);
+        G_UNLOCK(thumb_cache);
+        g_free(key);
+        free(data);
+        free(e);
+        return;
+    }
+    end = ftell(fh);
+    fclose(fh);
+    free(data);
+
+    e->offset = end - entry_size(e);
+    append_index(key, e);
+    g_hash_table_insert(thumbs, key, e);  /* Takes ownership of key */
+    total_size += entry_size(e);
+
+    if ( total_size > get_budget() ) start_compaction(get_budget()*3/4);
+
+    G_UNLOCK(thumb_cache);
+}
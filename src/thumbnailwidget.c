@@ -36,6 +36,7 @@
 #include "narrative_window.h"
 #include "slide.h"
 #include "slide_window.h"
+#include "slideprobe.h"
 
 
 G_DEFINE_FINAL_TYPE(Thumbnail, colloquium_thumbnail, GTK_TYPE_WIDGET)
@@ -44,6 +45,8 @@ G_DEFINE_FINAL_TYPE(Thumbnail, colloquium_thumbnail, GTK_TYPE_WIDGET)
 static void thumbnail_dispose(GObject *obj);
 static void thumbnail_size_allocate(GtkWidget *widget, int w, int h, int baseline);
 static void thumbnail_snapshot(GtkWidget *da, GtkSnapshot *snapshot);
+static void thumbnail_map(GtkWidget *widget);
+static void thumbnail_unmap(GtkWidget *widget);
 
 
 static void colloquium_thumbnail_class_init(ThumbnailClass *klass)
@@ -53,6 +56,8 @@ static void colloquium_thumbnail_class_init(ThumbnailClass *klass)
     oklass->dispose = thumbnail_dispose;
     wklass->size_allocate = thumbnail_size_allocate;
     wklass->snapshot = thumbnail_snapshot;
+    wklass->map = thumbnail_map;
+    wklass->unmap = thumbnail_unmap;
 }
 
 
@@ -64,7 +69,11 @@ static void colloquium_thumbnail_init(Thumbnail *e)
 static void thumbnail_dispose(GObject *obj)
 {
     Thumbnail *th = COLLOQUIUM_THUMBNAIL(obj);
-    gtk_widget_unparent(th->picture);
+    g_clear_object(&th->paintable);
+    if ( th->picture != NULL ) {
+        gtk_widget_unparent(th->picture);
+        th->picture = NULL;
+    }
     G_OBJECT_CLASS(colloquium_thumbnail_parent_class)->dispose(obj);
 }
 
@@ -79,7 +88,12 @@ static void thumbnail_snapshot(GtkWidget *da, GtkSnapshot *snapshot)
     float border_offs_x, border_offs_y;
     GdkRGBA color;
 
-    aspect = slide_get_aspect(th->slide);
+    /* Until the file has been probed, go by the placeholder */
+    if ( th->probed || (th->slide->aspect > 0.0) ) {
+        aspect = slide_get_aspect(th->slide);
+    } else {
+        aspect = gdk_paintable_get_intrinsic_aspect_ratio(gtk_picture_get_paintable(GTK_PICTURE(th->picture)));
+    }
     w = gtk_widget_get_width(da);
     h = gtk_widget_get_height(da);
 
@@ -90,6 +104,9 @@ static void thumbnail_snapshot(GtkWidget *da, GtkSnapshot *snapshot)
     rect = GRAPHENE_RECT_INIT(border_offs_x, border_offs_y, aw, ah);
     gsk_rounded_rect_init_from_rect(&rrect, &rect, 3);
     gtk_snapshot_push_rounded_clip(snapshot, &rrect);
+    if ( th->paintable != NULL ) {
+        slide_paintable_set_scale(th->paintable, slide_paintable_widget_scale(da));
+    }
     gtk_widget_snapshot_child(da, th->picture, snapshot);
     gtk_snapshot_pop(snapshot);
 
@@ -112,7 +129,7 @@ static GdkContentProvider *drag_prepare(GtkDragSource *ds, double x, double y, T
 static void update_size_request(Thumbnail *th)
 {
     GdkPaintable *p;
-    if ( slide_ftype(th->slide) == SLIDE_FTYPE_VIDEO ) {
+    if ( GTK_IS_VIDEO(th->picture) ) {
         p = GDK_PAINTABLE(gtk_video_get_media_stream(GTK_VIDEO(th->picture)));
     } else {
         p = gtk_picture_get_paintable(GTK_PICTURE(th->picture));
@@ -145,10 +162,84 @@ static void paintable_resize_sig(GdkPaintable *p, Thumbnail *th)
 }
 
 
+static void set_paintable(Thumbnail *th, GdkPaintable *p)
+{
+    GdkPaintable *oldp = gtk_picture_get_paintable(GTK_PICTURE(th->picture));
+    if ( oldp == p ) return;
+    if ( oldp != NULL ) {
+        g_signal_handlers_disconnect_by_func(G_OBJECT(oldp), paintable_resize_sig, th);
+    }
+    gtk_picture_set_paintable(GTK_PICTURE(th->picture), p);
+    update_size_request(th);
+    g_signal_connect(G_OBJECT(p), "invalidate-size", G_CALLBACK(paintable_resize_sig), th);
+}
+
+
+static enum render_priority thumbnail_priority(Thumbnail *th)
+{
+    GtkWidget *scroll;
+    graphene_rect_t bounds;
+
+    scroll = gtk_widget_get_ancestor(GTK_WIDGET(th), GTK_TYPE_SCROLLED_WINDOW);
+    if ( scroll == NULL ) return RENDER_PRIORITY_VISIBLE;
+
+    if ( !gtk_widget_compute_bounds(GTK_WIDGET(th), scroll, &bounds) ) {
+        return RENDER_PRIORITY_OFFSCREEN;
+    }
+    if ( (bounds.origin.y + bounds.size.height < 0.0)
+      || (bounds.origin.y > gtk_widget_get_height(scroll)) )
+    {
+        return RENDER_PRIORITY_OFFSCREEN;
+    }
+    return RENDER_PRIORITY_VISIBLE;
+}
+
+
+static void scroll_sig(GtkAdjustment *adj, Thumbnail *th)
+{
+    /* Thumbnails scrolled into view get rendered first */
+    if ( th->paintable != NULL ) {
+        slide_paintable_set_priority(th->paintable, thumbnail_priority(th));
+    }
+}
+
+
+static void thumbnail_map(GtkWidget *widget)
+{
+    Thumbnail *th = COLLOQUIUM_THUMBNAIL(widget);
+    GtkWidget *scroll;
+
+    GTK_WIDGET_CLASS(colloquium_thumbnail_parent_class)->map(widget);
+
+    scroll = gtk_widget_get_ancestor(widget, GTK_TYPE_SCROLLED_WINDOW);
+    if ( scroll != NULL ) {
+        th->vadj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scroll));
+        g_signal_connect(G_OBJECT(th->vadj), "value-changed", G_CALLBACK(scroll_sig), th);
+    }
+
+    scroll_sig(th->vadj, th);
+}
+
+
+static void thumbnail_unmap(GtkWidget *widget)
+{
+    Thumbnail *th = COLLOQUIUM_THUMBNAIL(widget);
+
+    /* Rendering will be requested again if it gets drawn */
+    if ( th->paintable != NULL ) slide_paintable_cancel(th->paintable);
+
+    if ( th->vadj != NULL ) {
+        g_signal_handlers_disconnect_by_func(G_OBJECT(th->vadj), scroll_sig, th);
+        th->vadj = NULL;
+    }
+
+    GTK_WIDGET_CLASS(colloquium_thumbnail_parent_class)->unmap(widget);
+}
+
+
 static void thumbnail_size_allocate(GtkWidget *widget, int w, int h, int baseline)
 {
     GtkAllocation alloc;
-    int old_w;
     Thumbnail *th = COLLOQUIUM_THUMBNAIL(widget);
 
     alloc.x = 0;
@@ -163,18 +254,37 @@ static void thumbnail_size_allocate(GtkWidget *widget, int w, int h, int baselin
         return;
     }
 
-    old_w = gdk_paintable_get_intrinsic_width(gtk_picture_get_paintable(GTK_PICTURE(th->picture)));
-    if ( alloc.width > old_w || th->need_render ) {
-        GdkPaintable *oldp = gtk_picture_get_paintable(GTK_PICTURE(th->picture));
-        GdkPaintable *p = slide_render(th->slide, alloc.width);
-        if ( oldp != p ) {
-            g_signal_handlers_disconnect_by_func(G_OBJECT(p), paintable_resize_sig, th);
-            gtk_picture_set_paintable(GTK_PICTURE(th->picture), p);
+    if ( (th->paintable != NULL) && th->need_render ) {
+        slide_paintable_refresh(th->paintable);
+        th->need_render = 0;
+    }
+}
+
+
+static void probe_done(gpointer vp)
+{
+    Thumbnail *th = vp;
+
+    if ( th->picture != NULL ) {
+
+        th->probed = 1;
+
+        if ( slide_ftype(th->slide) == SLIDE_FTYPE_VIDEO ) {
+            gtk_widget_unparent(th->picture);
+            th->picture = gtk_video_new_for_media_stream(GTK_MEDIA_STREAM(slide_render(th->slide, 128)));
+            gtk_widget_set_parent(th->picture, GTK_WIDGET(th));
+            gtk_widget_add_css_class(GTK_WIDGET(th->picture), "thumbnail");
             update_size_request(th);
-            g_signal_connect(G_OBJECT(p), "invalidate-size", G_CALLBACK(paintable_resize_sig), th);
+        } else {
+            /* The placeholder stays until the first rendering arrives */
+            th->paintable = slide_paintable_new(th->slide, thumbnail_priority(th));
+            set_paintable(th, GDK_PAINTABLE(th->paintable));
         }
-        th->need_render = 0;
+
+        gtk_widget_queue_draw(GTK_WIDGET(th));
     }
+
+    g_object_unref(th);
 }
 
 
@@ -186,15 +296,14 @@ GtkWidget *thumbnail_new(Slide *slide, NarrativeWindow *nw)
     th->nw = nw;
     th->slide = slide;
     th->need_render = 1;
+    th->paintable = NULL;
+    th->vadj = NULL;
     th->size_set = 0;
 
     gtk_widget_add_css_class(GTK_WIDGET(th), "thumbnail");
 
-    if ( slide_ftype(slide) == SLIDE_FTYPE_VIDEO ) {
-        th->picture = gtk_video_new_for_media_stream(GTK_MEDIA_STREAM(slide_render(slide, 128)));
-    } else {
-        th->picture = gtk_picture_new_for_paintable(placeholder_image());
-    }
+    /* Replaced by a video, if necessary, when the file has been probed */
+    th->picture = gtk_picture_new_for_paintable(placeholder_image());
     gtk_widget_set_parent(th->picture, GTK_WIDGET(th));
     gtk_widget_add_css_class(GTK_WIDGET(th->picture), "thumbnail");
 
@@ -206,13 +315,12 @@ GtkWidget *thumbnail_new(Slide *slide, NarrativeWindow *nw)
     g_signal_connect(G_OBJECT(th->drag_source), "prepare",
                      G_CALLBACK(drag_prepare), th);
 
-    return GTK_WIDGET(th);
-}
-
+    th->probed = 0;
+    if ( slide->ext_file != NULL ) {
+        slide_probe_start(slide->ext_file, probe_done, g_object_ref(th));
+    } else {
+        th->probed = 1;
+    }
 
-Slide *thumbnail_get_slide(Thumbnail *th)
-{
-    gtk_widget_queue_allocate(GTK_WIDGET(th));
-    th->need_render = 1;
-    return th->slide;
+    return GTK_WIDGET(th);
 }
@@ -35,6 +35,7 @@ typedef struct _colloquiumthumbnailclass ThumbnailClass;
 
 #include "slide.h"
 #include "narrative_window.h"
+#include "slidepaintable.h"
 
 #define COLLOQUIUM_TYPE_THUMBNAIL (colloquium_thumbnail_get_type())
 
@@ -52,6 +53,9 @@ struct _colloquiumthumbnail
     GtkWidget           *picture;
     GtkDragSource       *drag_source;
     int                  need_render;
+    int                  probed;
+    SlidePaintable      *paintable;
+    GtkAdjustment       *vadj;
     int                  min_w;
     int                  min_h;
     int                  size_set;
@@ -65,7 +69,6 @@ struct _colloquiumthumbnailclass
 extern GType colloquium_thumbnail_get_type(void);
 
 extern GtkWidget *thumbnail_new(Slide *slide, NarrativeWindow *nw);
-extern Slide *thumbnail_get_slide(Thumbnail *th);
 extern void thumbnail_set_min_dims(Thumbnail *th, int w, int h);
 
 #endif  /* COLLOQUIUM_THUMBNAIL_H */
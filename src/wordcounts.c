@@ -0,0 +1,219 @@
+/*
+ * wordcounts.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.org.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wordcounts.h"
+
+
+/* The number of words on each line of the narrative, in a Fenwick tree so
+ * that the number of words up to any line can be found, or changed, in
+ * O(log n) time.  Adding or removing lines in the middle needs the tree to
+ * be rebuilt, which is O(n) but involves no text.  Adding lines at the end,
+ * which is what happens when loading, is O(log n). */
+struct _wordcounts
+{
+    int n_lines;
+    int max_lines;
+    int *counts;    /* Plain count for each line */
+    int *tree;      /* 1-based Fenwick tree of 'counts' */
+};
+
+
+static int lowbit(int i)
+{
+    return i & (-i);
+}
+
+
+static void rebuild(WordCounts *wc)
+{
+    int i;
+
+    for ( i=1; i<=wc->n_lines; i++ ) {
+        wc->tree[i] = wc->counts[i-1];
+    }
+    for ( i=1; i<=wc->n_lines; i++ ) {
+        int parent = i + lowbit(i);
+        if ( parent <= wc->n_lines ) wc->tree[parent] += wc->tree[i];
+    }
+}
+
+
+static int ensure_space(WordCounts *wc, int n_lines)
+{
+    int *ncounts;
+    int *ntree;
+    int nmax = wc->max_lines;
+
+    if ( n_lines <= wc->max_lines ) return 0;
+    while ( nmax < n_lines ) nmax *= 2;
+
+    ncounts = realloc(wc->counts, nmax*sizeof(int));
+    if ( ncounts == NULL ) return 1;
+    wc->counts = ncounts;
+
+    ntree = realloc(wc->tree, (nmax+1)*sizeof(int));
+    if ( ntree == NULL ) return 1;
+    wc->tree = ntree;
+
+    wc->max_lines = nmax;
+    return 0;
+}
+
+
+/* Starts off with one empty line, like an empty text buffer */
+WordCounts *word_counts_new()
+{
+    WordCounts *wc;
+
+    wc = malloc(sizeof(WordCounts));
+    if ( wc == NULL ) return NULL;
+
+    wc->max_lines = 256;
+    wc->counts = malloc(wc->max_lines*sizeof(int));
+    wc->tree = malloc((wc->max_lines+1)*sizeof(int));
+    if ( (wc->counts == NULL) || (wc->tree == NULL) ) {
+        free(wc->counts);
+        free(wc->tree);
+        free(wc);
+        return NULL;
+    }
+
+    wc->n_lines = 1;
+    wc->counts[0] = 0;
+    wc->tree[1] = 0;
+    return wc;
+}
+
+
+void word_counts_free(WordCounts *wc)
+{
+    free(wc->counts);
+    free(wc->tree);
+    free(wc);
+}
+
+
+int word_counts_get_n_lines(WordCounts *wc)
+{
+    return wc->n_lines;
+}
+
+
+void word_counts_set(WordCounts *wc, int line, int count)
+{
+    int i;
+    int delta;
+
+    if ( (line < 0) || (line >= wc->n_lines) ) return;
+
+    delta = count - wc->counts[line];
+    if ( delta == 0 ) return;
+    wc->counts[line] = count;
+
+    for ( i=line+1; i<=wc->n_lines; i+=lowbit(i) ) {
+        wc->tree[i] += delta;
+    }
+}
+
+
+/* Adds 'n' lines, with no words, before 'line' */
+void word_counts_insert_lines(WordCounts *wc, int line, int n)
+{
+    if ( n <= 0 ) return;
+    if ( (line < 0) || (line > wc->n_lines) ) return;
+    if ( ensure_space(wc, wc->n_lines+n) ) return;
+
+    if ( line == wc->n_lines ) {
+        int i;
+        for ( i=0; i<n; i++ ) {
+            int idx = ++wc->n_lines;
+            wc->counts[idx-1] = 0;
+            wc->tree[idx] = word_counts_sum(wc, idx-1)
+                          - word_counts_sum(wc, idx-lowbit(idx));
+        }
+        return;
+    }
+
+    memmove(&wc->counts[line+n], &wc->counts[line],
+            (wc->n_lines-line)*sizeof(int));
+    memset(&wc->counts[line], 0, n*sizeof(int));
+    wc->n_lines += n;
+    rebuild(wc);
+}
+
+
+/* Removes 'n' lines, starting with 'line' */
+void word_counts_delete_lines(WordCounts *wc, int line, int n)
+{
+    if ( n <= 0 ) return;
+    if ( (line < 0) || (line+n > wc->n_lines) ) return;
+
+    memmove(&wc->counts[line], &wc->counts[line+n],
+            (wc->n_lines-line-n)*sizeof(int));
+    wc->n_lines -= n;
+    rebuild(wc);
+}
+
+
+/* The total number of words on the first 'n' lines */
+int word_counts_sum(WordCounts *wc, int n)
+{
+    int sum = 0;
+    if ( n > wc->n_lines ) n = wc->n_lines;
+    for ( ; n>0; n-=lowbit(n) ) {
+        sum += wc->tree[n];
+    }
+    return sum;
+}
+
+
+int word_counts_total(WordCounts *wc)
+{
+    return word_counts_sum(wc, wc->n_lines);
+}
+
+
+/* Returns the first line by the end of which there have been at least
+ * 'words' words, or the number of lines if there aren't that many words */
+int word_counts_find(WordCounts *wc, int words)
+{
+    int pos = 0;
+    int step = 1;
+
+    while ( step*2 <= wc->n_lines ) step *= 2;
+
+    for ( ; step>0; step/=2 ) {
+        if ( (pos+step <= wc->n_lines) && (wc->tree[pos+step] < words) ) {
+            pos += step;
+            words -= wc->tree[pos];
+        }
+    }
+    return pos;
+}
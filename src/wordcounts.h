@@ -0,0 +1,42 @@
+/*
+ * wordcounts.h
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef WORDCOUNTS_H
+#define WORDCOUNTS_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+typedef struct _wordcounts WordCounts;
+
+extern WordCounts *word_counts_new(void);
+extern void word_counts_free(WordCounts *wc);
+extern int word_counts_get_n_lines(WordCounts *wc);
+extern void word_counts_set(WordCounts *wc, int line, int count);
+extern void word_counts_insert_lines(WordCounts *wc, int line, int n);
+extern void word_counts_delete_lines(WordCounts *wc, int line, int n);
+extern int word_counts_sum(WordCounts *wc, int n);
+extern int word_counts_total(WordCounts *wc);
+extern int word_counts_find(WordCounts *wc, int words);
+
+#endif /* WORDCOUNTS_H */
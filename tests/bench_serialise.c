@@ -0,0 +1,168 @@
+/*
+ * bench_serialise.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+#include "narrative.h"
+#include "slide.h"
+
+
+/* Times the Markdown writer on a synthetic narrative, by default with 10000
+ * paragraphs: headings, bullet points, slides, and text with bold, italic
+ * and underlined runs and characters which need escaping.
+ *
+ * Usage: bench-serialise [n_paragraphs] [n_runs] */
+
+#define DEFAULT_PARAGRAPHS (10000)
+#define DEFAULT_RUNS (20)
+
+
+static void add_text(GtkTextBuffer *buf, const char *text, const char *tag)
+{
+    GtkTextIter end;
+    gtk_text_buffer_get_end_iter(buf, &end);
+    if ( tag != NULL ) {
+        gtk_text_buffer_insert_with_tags_by_name(buf, &end, text, -1, tag, NULL);
+    } else {
+        gtk_text_buffer_insert(buf, &end, text, -1);
+    }
+}
+
+
+static Slide *add_slide(GtkTextBuffer *buf, int i)
+{
+    GtkTextIter end;
+    GFile *file;
+    Slide *slide;
+    char tmp[64];
+
+    slide = slide_new();
+    if ( slide == NULL ) return NULL;
+
+    snprintf(tmp, sizeof(tmp), "/tmp/colloquium-bench/slides-%i.pdf", i/100);
+    file = g_file_new_for_path(tmp);
+    slide_set_ext_file(slide, file);
+    g_object_unref(file);
+    slide_set_ext_number(slide, i%100 + 1);
+
+    gtk_text_buffer_get_end_iter(buf, &end);
+    insert_slide_anchor(buf, slide, end, 1);
+    return slide;
+}
+
+
+static void add_paragraph(GtkTextBuffer *buf, int i)
+{
+    char tmp[128];
+
+    if ( i % 50 == 0 ) {
+        snprintf(tmp, sizeof(tmp), "Part %i: #%i of the talk", i/50, i/50);
+        add_text(buf, tmp, "segstart");
+        add_text(buf, "\n", NULL);
+        return;
+    }
+
+    if ( i % 7 == 0 ) {
+        snprintf(tmp, sizeof(tmp), "Bullet point number %i", i);
+        add_text(buf, tmp, "bulletpoint");
+        add_text(buf, "\n", NULL);
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "Paragraph %i says something ", i);
+    add_text(buf, tmp, NULL);
+    add_text(buf, "important", "bold");
+    add_text(buf, " and something ", NULL);
+    add_text(buf, "subtle", "italic");
+    add_text(buf, ", with 2*3 = 6 and snake_case_names [in brackets] ", NULL);
+    add_text(buf, "underlined", "underline");
+    add_text(buf, " for emphasis.\n", NULL);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Narrative *n;
+    Slide **slides;
+    int n_paras = DEFAULT_PARAGRAPHS;
+    int n_runs = DEFAULT_RUNS;
+    int n_slides = 0;
+    gint64 best = G_MAXINT64;
+    gint64 total = 0;
+    gint64 t;
+    gsize size = 0;
+    int i;
+
+    if ( argc > 1 ) n_paras = atoi(argv[1]);
+    if ( argc > 2 ) n_runs = atoi(argv[2]);
+    if ( (n_paras < 1) || (n_runs < 1) ) {
+        fprintf(stderr, "Usage: %s [n_paragraphs] [n_runs]\n", argv[0]);
+        return 1;
+    }
+
+    n = narrative_new();
+    slides = malloc((n_paras/20+1)*sizeof(Slide *));
+    if ( (n == NULL) || (slides == NULL) ) {
+        fprintf(stderr, "Failed to create narrative\n");
+        return 1;
+    }
+
+    t = g_get_monotonic_time();
+    for ( i=0; i<n_paras; i++ ) {
+        add_paragraph(n->textbuf, i);
+        if ( i % 20 == 19 ) {
+            Slide *slide = add_slide(n->textbuf, i);
+            if ( slide != NULL ) slides[n_slides++] = slide;
+        }
+    }
+    printf("Built %i paragraphs and %i slides (%i characters) in %.1f ms\n",
+           n_paras, n_slides, gtk_text_buffer_get_char_count(n->textbuf),
+           (g_get_monotonic_time()-t)/1000.0);
+
+    for ( i=0; i<n_runs; i++ ) {
+        GBytes *bytes;
+        gint64 dt;
+
+        t = g_get_monotonic_time();
+        bytes = narrative_serialise(n, NULL, NULL);
+        dt = g_get_monotonic_time() - t;
+
+        size = g_bytes_get_size(bytes);
+        g_bytes_unref(bytes);
+        total += dt;
+        if ( dt < best ) best = dt;
+    }
+
+    printf("Serialised %zu bytes: best %.2f ms, mean %.2f ms over %i runs\n",
+           size, best/1000.0, total/1000.0/n_runs, n_runs);
+
+    narrative_free(n);
+    for ( i=0; i<n_slides; i++ ) slide_free(slides[i]);
+    free(slides);
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * highlight_test.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+#include "narrative.h"
+
+
+/* Moves the presenting highlight through a long narrative, as Page Down
+ * would, and checks that exactly the right line is highlighted each time.
+ * Also reports the time per step for a short and a long narrative, which
+ * should be about the same. */
+
+#define SHORT_LINES (100)
+#define LONG_LINES (50000)
+
+
+static Narrative *make_narrative(int n_lines)
+{
+    Narrative *n;
+    GtkTextIter end;
+    int i;
+
+    n = narrative_new();
+    if ( n == NULL ) return NULL;
+
+    for ( i=0; i<n_lines; i++ ) {
+        char tmp[64];
+        gtk_text_buffer_get_end_iter(n->textbuf, &end);
+        if ( i % 10 == 9 ) {
+            /* Empty lines must not spill onto the next one */
+            gtk_text_buffer_insert(n->textbuf, &end, "\n", -1);
+            continue;
+        }
+        snprintf(tmp, sizeof(tmp), "This is line number %i.\n", i);
+        gtk_text_buffer_insert(n->textbuf, &end, tmp, -1);
+    }
+    return n;
+}
+
+
+static void highlight_line(Narrative *n, int line)
+{
+    GtkTextIter pos;
+    gtk_text_buffer_get_iter_at_line(n->textbuf, &pos, line);
+    narrative_set_highlight(n, &pos);
+}
+
+
+/* Returns non-zero if the highlight isn't exactly the whole of 'line' */
+static int check_line(Narrative *n, int line, int prev)
+{
+    GtkTextBuffer *buf = n->textbuf;
+    GtkTextTag *tag = lookup_tag(buf, "highlight");
+    GtkTextIter start, end, iter;
+
+    gtk_text_buffer_get_iter_at_mark(buf, &start, n->highlight_start);
+    gtk_text_buffer_get_iter_at_mark(buf, &end, n->highlight_end);
+
+    if ( (gtk_text_iter_get_line(&start) != line)
+      || (gtk_text_iter_get_line(&end) != line)
+      || !gtk_text_iter_starts_line(&start)
+      || !gtk_text_iter_ends_line(&end) )
+    {
+        fprintf(stderr, "Highlight marks are at lines %i and %i, not %i\n",
+                gtk_text_iter_get_line(&start), gtk_text_iter_get_line(&end),
+                line);
+        return 1;
+    }
+
+    /* The tag should cover the line, and nothing else */
+    iter = start;
+    if ( !gtk_text_iter_equal(&start, &end) && !gtk_text_iter_has_tag(&iter, tag) ) {
+        fprintf(stderr, "Line %i isn't highlighted\n", line);
+        return 1;
+    }
+    if ( gtk_text_iter_forward_to_tag_toggle(&iter, tag)
+      && !gtk_text_iter_equal(&iter, &end) )
+    {
+        fprintf(stderr, "Highlight on line %i stops in the wrong place\n", line);
+        return 1;
+    }
+    if ( gtk_text_iter_forward_to_tag_toggle(&iter, tag) ) {
+        fprintf(stderr, "Highlight continues after line %i\n", line);
+        return 1;
+    }
+
+    if ( prev >= 0 ) {
+        gtk_text_buffer_get_iter_at_line(buf, &iter, prev);
+        if ( gtk_text_iter_has_tag(&iter, tag) ) {
+            fprintf(stderr, "Line %i is still highlighted\n", prev);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Returns the mean time per step in microseconds, or a negative number if
+ * anything went wrong */
+static double step_through(Narrative *n, int n_lines)
+{
+    GtkTextTag *tag = lookup_tag(n->textbuf, "highlight");
+    GtkTextIter iter;
+    gint64 t, total = 0;
+    int line;
+    int prev = -1;
+    int n_steps = 0;
+
+    /* Every line near the start and end, and a sample in between */
+    for ( line=0; line<n_lines; line += ((line < 200) || (line > n_lines-200)) ? 1 : 97 ) {
+        t = g_get_monotonic_time();
+        highlight_line(n, line);
+        total += g_get_monotonic_time() - t;
+        n_steps++;
+        if ( check_line(n, line, prev) ) return -1.0;
+        prev = line;
+    }
+
+    /* Jumping back to the start */
+    highlight_line(n, 0);
+    if ( check_line(n, 0, prev) ) return -1.0;
+
+    /* Removing it altogether */
+    narrative_set_highlight(n, NULL);
+    gtk_text_buffer_get_start_iter(n->textbuf, &iter);
+    if ( gtk_text_iter_has_tag(&iter, tag)
+      || gtk_text_iter_forward_to_tag_toggle(&iter, tag) )
+    {
+        fprintf(stderr, "Highlight wasn't removed\n");
+        return -1.0;
+    }
+
+    return (double)total/n_steps;
+}
+
+
+int main(int argc, char *argv[])
+{
+    Narrative *n;
+    double t_short, t_long;
+
+    n = make_narrative(SHORT_LINES);
+    if ( n == NULL ) return 1;
+    t_short = step_through(n, SHORT_LINES);
+    narrative_free(n);
+    if ( t_short < 0.0 ) return 1;
+
+    n = make_narrative(LONG_LINES);
+    if ( n == NULL ) return 1;
+    t_long = step_through(n, LONG_LINES);
+    narrative_free(n);
+    if ( t_long < 0.0 ) return 1;
+
+    printf("Mean time per step: %.1f us for %i lines, %.1f us for %i lines\n",
+           t_short, SHORT_LINES, t_long, LONG_LINES);
+    return 0;
+}
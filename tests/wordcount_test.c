@@ -0,0 +1,190 @@
+/*
+ * wordcount_test.c
+ *
+ * Copyright © 2026 Thomas White <taw@bitwiz.me.uk>
+ *
+ * This file is part of Colloquium.
+ *
+ * Colloquium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+#include "narrative.h"
+#include "wordcounts.h"
+
+
+/* Edits a narrative, and checks straight after each edit that the word
+ * counts and timing marks agree with a narrative built from scratch with
+ * the same text */
+
+#define WPM (10.0)
+
+
+static int count_spaces(GtkTextBuffer *buf, int line)
+{
+    GtkTextIter start, end;
+    char *txt;
+    int i, n = 0;
+
+    gtk_text_buffer_get_iter_at_line(buf, &start, line);
+    end = start;
+    gtk_text_iter_forward_line(&end);
+    txt = gtk_text_iter_get_slice(&start, &end);
+    for ( i=0; txt[i]!='\0'; i++ ) {
+        if ( txt[i] == ' ' ) n++;
+    }
+    g_free(txt);
+    return n;
+}
+
+
+/* Returns non-zero if anything doesn't match */
+static int check(Narrative *n, const char *what)
+{
+    GtkTextBuffer *buf = n->textbuf;
+    Narrative *ref;
+    GtkTextIter start, end;
+    char *text;
+    int n_lines, line, sum, i;
+
+    narrative_update_timing(n, WPM);
+
+    n_lines = gtk_text_buffer_get_line_count(buf);
+    if ( word_counts_get_n_lines(n->word_counts) != n_lines ) {
+        fprintf(stderr, "%s: %i lines counted, but buffer has %i\n", what,
+                word_counts_get_n_lines(n->word_counts), n_lines);
+        return 1;
+    }
+
+    sum = 0;
+    for ( line=0; line<n_lines; line++ ) {
+        sum += count_spaces(buf, line);
+        if ( word_counts_sum(n->word_counts, line+1) != sum ) {
+            fprintf(stderr, "%s: %i words up to line %i, should be %i\n",
+                    what, word_counts_sum(n->word_counts, line+1), line, sum);
+            return 1;
+        }
+    }
+    if ( word_counts_total(n->word_counts) != sum ) {
+        fprintf(stderr, "%s: %i words in total, should be %i\n", what,
+                word_counts_total(n->word_counts), sum);
+        return 1;
+    }
+
+    ref = narrative_new();
+    gtk_text_buffer_get_bounds(buf, &start, &end);
+    text = gtk_text_buffer_get_text(buf, &start, &end, TRUE);
+    gtk_text_buffer_get_start_iter(ref->textbuf, &start);
+    gtk_text_buffer_insert(ref->textbuf, &start, text, -1);
+    g_free(text);
+    narrative_update_timing(ref, WPM);
+
+    if ( (n->total_minutes != ref->total_minutes)
+      || (n->n_time_marks != ref->n_time_marks) )
+    {
+        fprintf(stderr, "%s: %i marks over %.2f minutes, should be %i over %.2f\n",
+                what, n->n_time_marks, n->total_minutes,
+                ref->n_time_marks, ref->total_minutes);
+        narrative_free(ref);
+        return 1;
+    }
+    for ( i=0; i<n->n_time_marks; i++ ) {
+        if ( (n->time_marks[i].line != ref->time_marks[i].line)
+          || (n->time_marks[i].minutes != ref->time_marks[i].minutes) )
+        {
+            fprintf(stderr, "%s: mark %i at line %i, should be at line %i\n",
+                    what, i, n->time_marks[i].line, ref->time_marks[i].line);
+            narrative_free(ref);
+            return 1;
+        }
+    }
+
+    narrative_free(ref);
+    return 0;
+}
+
+
+static void insert_at(Narrative *n, int line, int offset, const char *text)
+{
+    GtkTextIter pos;
+    gtk_text_buffer_get_iter_at_line_offset(n->textbuf, &pos, line, offset);
+    gtk_text_buffer_insert(n->textbuf, &pos, text, -1);
+}
+
+
+static void delete_between(Narrative *n, int l1, int o1, int l2, int o2)
+{
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_line_offset(n->textbuf, &start, l1, o1);
+    gtk_text_buffer_get_iter_at_line_offset(n->textbuf, &end, l2, o2);
+    gtk_text_buffer_delete(n->textbuf, &start, &end);
+}
+
+
+int main(int argc, char *argv[])
+{
+    Narrative *n;
+    GtkTextIter start, end;
+    int i;
+
+    n = narrative_new();
+    if ( n == NULL ) return 1;
+    if ( check(n, "Empty") ) return 1;
+
+    for ( i=0; i<100; i++ ) {
+        GtkTextIter pos;
+        char tmp[128];
+        snprintf(tmp, sizeof(tmp), "Line %i has a few words on it, %s\n", i,
+                 (i % 3 == 0) ? "and some more words besides those" : "no more");
+        gtk_text_buffer_get_end_iter(n->textbuf, &pos);
+        gtk_text_buffer_insert(n->textbuf, &pos, tmp, -1);
+        if ( check(n, "Appending lines") ) return 1;
+    }
+
+    insert_at(n, 10, 5, "new words ");
+    if ( check(n, "Inserting words") ) return 1;
+
+    insert_at(n, 20, 3, "one two\nthree four five\nsix ");
+    if ( check(n, "Inserting lines in the middle of a line") ) return 1;
+
+    insert_at(n, 30, 0, "\n");
+    if ( check(n, "Typing a newline") ) return 1;
+
+    delete_between(n, 30, 0, 31, 0);
+    if ( check(n, "Deleting a newline") ) return 1;
+
+    delete_between(n, 40, 4, 40, 12);
+    if ( check(n, "Deleting words") ) return 1;
+
+    delete_between(n, 50, 6, 57, 3);
+    if ( check(n, "Deleting across lines") ) return 1;
+
+    insert_at(n, 0, 0, "At the start ");
+    if ( check(n, "Inserting at the start") ) return 1;
+
+    gtk_text_buffer_get_bounds(n->textbuf, &start, &end);
+    gtk_text_buffer_delete(n->textbuf, &start, &end);
+    if ( check(n, "Deleting everything") ) return 1;
+
+    narrative_free(n);
+    return 0;
+}